@@ -1,9 +1,17 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <stdexcept>
 #include <string>
 
 #include "avr/boards.h"
+#include "fuzz.h"
 #include "segment.h"
 #include "simulator.h"
+#include "translate.h"
 
 using namespace simulator;
 
@@ -13,9 +21,10 @@ void repl(simulator::simulator & sim)
 
     char command;
     while (std::cin >> command) {
+        stop_reason reason = {stop_kind::done, 0, 0};
         switch (command) {
         case 's':
-            sim.step();
+            reason = sim.step();
             break;
         case 'b':
             {
@@ -24,25 +33,151 @@ void repl(simulator::simulator & sim)
                 sim.set_breakpoint(addr);
                 break;
             }
+        case 'w':
+            {
+                address_t addr;
+                std::cin >> std::hex >> addr;
+                sim.set_watchpoint(addr);
+                break;
+            }
         case 'c':
-            sim.run();
+            reason = sim.run();
+            break;
+        case 'r':
+            reason = sim.reverse_step();
             break;
+        case 'R':
+            reason = sim.reverse_continue();
+            break;
+        }
+
+        if (reason.kind != stop_kind::done && reason.kind != stop_kind::breakpoint) {
+            std::cout << describe(reason.kind) << '\n';
+        }
+        if (reason.kind != stop_kind::invalid_instruction) {
+            std::cout << avr::mnemonic(sim.next_instruction()) << '\n';
         }
-        std::cout << avr::mnemonic(sim.next_instruction()) << '\n';
     }
 }
 
-int main(int argc, char **argv)
+static int usage(const char *argv0)
 {
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " <elf>\n";
+    std::cerr << "usage: " << argv0 << " <elf>\n"
+              << "       " << argv0 << " translate <elf> <output.cpp>\n"
+              << "       " << argv0 << " fuzz <elf> <input> <entry> [-n <runs>] [-w <address>]...\n"
+              << "\n"
+              << "The fuzzer writes each input to <input>, a variable or <hex address>:<size>, and\n"
+              << "runs it from <entry>, a function or hex word address, until the function returns\n"
+              << "or the program comes back there.\n"
+              << "Crashes are invalid instructions, the stack running into __heap_start, and stores\n"
+              << "to a watched variable or hex address.\n";
+    return 1;
+}
+
+// A variable's address in the data space, or a hex address
+static address_t data_address(
+    const std::map<std::string, symbol> & symbols, const std::string & where, uint64_t & size)
+{
+    auto found = symbols.find(where);
+    if (found != symbols.end()) {
+        // Variables are linked at 0x800000 plus their address
+        size = found->second.size;
+        return found->second.value & 0xFFFF;
+    }
+    size = 0;
+    return std::stoul(where, nullptr, 16);
+}
+
+static void print_bytes(const std::vector<byte_t> & bytes)
+{
+    std::cout << std::hex << std::setfill('0');
+    for (auto b : bytes) {
+        std::cout << std::setw(2) << unsigned(b);
+    }
+    std::cout << std::dec << std::setfill(' ');
+}
+
+static int fuzz(const std::string & elf, image_handle image, int argc, char **argv)
+{
+    fuzz_target target;
+    target.image = image;
+    uint64_t runs = 1000000;
+    auto symbols = read_symbols(elf);
+    try {
+        std::string input = argv[3];
+        auto colon = input.find(':');
+        uint64_t size;
+        target.input = data_address(symbols, input.substr(0, colon), size);
+        if (colon != std::string::npos) {
+            size = std::stoul(input.substr(colon + 1), nullptr, 0);
+        }
+        target.input_size = size;
+
+        auto entry = symbols.find(argv[4]);
+        if (entry != symbols.end()) {
+            target.entry = entry->second.value / 2;
+        } else {
+            target.entry = std::stoul(argv[4], nullptr, 16);
+        }
+
+        auto heap_start = symbols.find("__heap_start");
+        if (heap_start != symbols.end()) {
+            target.stack_limit = heap_start->second.value & 0xFFFF;
+        }
+
+        for (int i = 5; i < argc; i += 2) {
+            if (i + 1 == argc) {
+                return usage(argv[0]);
+            } else if (argv[i] == std::string("-n")) {
+                runs = std::stoull(argv[i + 1]);
+            } else if (argv[i] == std::string("-w")) {
+                target.watchpoints.push_back(data_address(symbols, argv[i + 1], size));
+            } else {
+                return usage(argv[0]);
+            }
+        }
+    } catch (const std::logic_error &) {
+        return usage(argv[0]);
+    }
+
+    std::unique_ptr<fuzzer> fuzzer;
+    try {
+        fuzzer = make_fuzzer(target);
+    } catch (const std::invalid_argument & error) {
+        std::cerr << error.what() << '\n';
         return 1;
     }
 
-    std::string elf = argv[1];
-    auto text = map_segment(elf, TEXT);
-    auto data = map_segment(elf, DATA);
-    auto bss = map_segment(elf, BSS);
+    auto start = std::chrono::steady_clock::now();
+    while (fuzzer->executions() < runs) {
+        for (auto & crash : fuzzer->run(std::min<uint64_t>(100000, runs - fuzzer->executions()))) {
+            std::cout << describe(crash.reason.kind) << " at " << std::hex << crash.reason.pc << std::dec
+                      << ", input ";
+            print_bytes(crash.input);
+            std::cout << '\n';
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        auto rate = uint64_t(fuzzer->executions() / elapsed.count());
+        std::cout << fuzzer->executions() << " runs, " << rate << "/s, " << fuzzer->corpus_size()
+                  << " inputs kept, " << fuzzer->edges_covered() << " edges\n";
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    bool translating = argc == 4 && argv[1] == std::string("translate");
+    bool fuzzing = argc >= 5 && argv[1] == std::string("fuzz");
+    if (argc != 2 && !translating && !fuzzing) {
+        return usage(argv[0]);
+    }
+
+    std::string elf = translating || fuzzing ? argv[2] : argv[1];
+    auto segments = map_segments(elf);
+    auto & text = segments[TEXT];
+    auto & data = segments[DATA];
+    auto & bss = segments[BSS];
 
     std::vector<segment *> ram_segs;
     if (data->size() > 0) {
@@ -52,6 +187,21 @@ int main(int argc, char **argv)
         ram_segs.push_back(bss.get());
     }
 
+    if (translating) {
+        std::ofstream out(argv[3]);
+        translate(avr::atmega168, *text, ram_segs, out);
+        if (!out) {
+            std::cerr << "could not write " << argv[3] << '\n';
+            return 1;
+        }
+        return 0;
+    }
+
+    if (fuzzing) {
+        return fuzz(elf, load_program(avr::atmega168, *text, ram_segs), argc, argv);
+    }
+
     auto sim = program_with_segments(avr::atmega168, *text, ram_segs);
+    sim->keep_history(true);
     repl(*sim);
 }
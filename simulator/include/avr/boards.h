@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstddef>
+
+#include "avr/timing.h"
+
 namespace avr {
 
     static constexpr uint16_t kilobyte = 1024;
@@ -8,15 +12,26 @@ namespace avr {
     {
         const size_t ram_end;
         const size_t flash_end;
+        timing (*const instruction_timing)(opcode);
+        const size_t vector_count;  // interrupt vectors, including reset
+        const size_t vector_words;  // flash words per vector, enough for a jmp or an rjmp
 
-        board(size_t ram_end_, size_t flash_end_)
+        board(
+            size_t ram_end_, size_t flash_end_, timing (*instruction_timing_)(opcode),
+            size_t vector_count_, size_t vector_words_)
             : ram_end(ram_end_)
             , flash_end(flash_end_)
+            , instruction_timing(instruction_timing_)
+            , vector_count(vector_count_)
+            , vector_words(vector_words_)
         {}
     };
 
     static const board atmega168(
         1*kilobyte,         // ram_end TODO is this right?
-        (16*kilobyte)/2     // flash_end
+        (16*kilobyte)/2,    // flash_end
+        classic_timing,
+        26,                 // vector_count
+        2                   // vector_words
     );
 }
@@ -0,0 +1,590 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <vector>
+
+#include "avr/boards.h"
+#include "avr/instruction.h"
+#include "avr/register.h"
+#include "types.h"
+
+namespace avr {
+
+    // Instead of updating SREG after every arithmetic instruction, only the operands of the last
+    // one are kept. Flags are worked out from them when they are read, which for most
+    // instructions is never, because the next instruction overwrites them.
+    enum class flag_op
+        : uint8_t
+    {
+        none,
+        add,
+        sub,
+        cp,
+        cpc,
+        cpi,
+        eor,
+    };
+
+    struct flag_record
+    {
+        flag_op op = flag_op::none;
+        uint8_t lhs = 0;
+        uint8_t rhs = 0;
+        byte_t prior = 0;   // flags from before the operation which the result depends on
+    };
+
+    // The data space: registers, I/O space and SRAM
+    using data_space = std::array<byte_t, 0x10000>;
+
+    // Everything an instruction can change, in one block which is copied in one go. The counters and
+    // the flags of the last arithmetic instruction share a cache line, and the registers and I/O
+    // space fill the four after it. The data space is all that a 16-bit address can reach, so no
+    // access can go out of bounds, whatever the device's SRAM size.
+    struct alignas(64) state
+    {
+        uint64_t                cycle_count = 0;    // clock cycles executed since reset
+        uint16_t                pc = 0;
+        flag_record             last_flags;
+        std::array<uint64_t, 4> side_effects = {};  // one bit for each I/O address; see load()
+        alignas(64) data_space      memory = {};
+        std::array<uint8_t, 0x100>  written_pages = {}; // set by stores into each 256-byte page
+
+        // Before C++17, new only aligns objects for the fundamental types
+        static void *operator new(size_t size)
+        {
+            // Keep the block new returned just in front of the aligned one
+            auto raw = static_cast<char *>(::operator new(size + alignof(state)));
+            auto aligned = raw + alignof(state) - reinterpret_cast<uintptr_t>(raw) % alignof(state);
+            reinterpret_cast<void **>(aligned)[-1] = raw;
+            return aligned;
+        }
+
+        static void operator delete(void *p)
+        {
+            ::operator delete(static_cast<void **>(p)[-1]);
+        }
+    };
+
+    // The state of an AVR (flash, data space and program counter) and the effect of each
+    // instruction on it. This is shared by the simulator's engines and by programs translated to C++
+    // with `avr-db translate`, so that they agree on what every instruction does.
+    struct core
+        : state
+    {
+        core(const board & board)
+            // One word of padding so that decoding a two-word instruction in the last word of flash
+            // stays in bounds
+            : text(board.flash_end + 1)
+            , flash(text.data())
+            , pc_mask(board.flash_end - 1)
+        {
+            set_side_effects(reg::SREG);
+        }
+
+        // A core running a program whose flash, of `flash_words` words, is shared with others and
+        // outlives the core
+        core(const uint16_t *shared_flash, size_t flash_words)
+            : flash(shared_flash)
+            , pc_mask(flash_words - 1)
+        {
+            set_side_effects(reg::SREG);
+        }
+
+        core(const core &) = delete;
+        core & operator=(const core &) = delete;
+
+        virtual ~core() {}
+
+        // Reads one flag, computing it from the last flag-producing operation if need be
+        bool flag(sreg_flag bit) const
+        {
+            if (flag_mask(last_flags.op) & bit) {
+                return pending_flags() & bit;
+            }
+            return sreg() & bit;
+        }
+
+        // The value of SREG, with every flag up to date
+        byte_t sreg_value() const
+        {
+            auto mask = flag_mask(last_flags.op);
+            return (sreg() & ~mask) | (pending_flags() & mask);
+        }
+
+        // Bring the flags stored in memory up to date, for code which reads SREG directly
+        void sync_sreg()
+        {
+            sreg() = sreg_value();
+            last_flags.op = flag_op::none;
+        }
+
+        // Access to the data space for instructions which can address I/O registers. Most addresses
+        // are plain memory; a bit for each I/O address picks out the few where an access does
+        // something more, which are SREG and the registers of peripherals.
+        byte_t load(address_t address)
+        {
+            if (has_side_effects(address)) {
+                if (address == reg::SREG) {
+                    sync_sreg();
+                } else {
+                    io_read(address);
+                }
+            }
+            return memory[address];
+        }
+
+        void store(address_t address, byte_t value)
+        {
+            if (logging_stores) {
+                storing(address);
+            }
+            memory[address] = value;
+            written_pages[address >> 8] = 1;
+            if (has_side_effects(address)) {
+                if (address == reg::SREG) {
+                    last_flags.op = flag_op::none;
+                    if (value & SREG_I) {
+                        interrupts_enabled();
+                    }
+                } else {
+                    io_write(address);
+                }
+            }
+        }
+
+        bool has_side_effects(address_t address) const
+        {
+            return address < io_end && (side_effects[address / 64] >> (address % 64) & 1);
+        }
+
+        // Send accesses to an address through io_read and io_write
+        void set_side_effects(address_t address)
+        {
+            side_effects[address / 64] |= uint64_t(1) << (address % 64);
+        }
+
+        // The I/O registers, including the extended I/O space reached only through ld and st
+        static constexpr address_t io_begin = 0x20;
+        static constexpr address_t io_end = 0x100;
+
+    protected:
+        // Hooks for peripherals: called before an I/O register other than SREG is read, and after
+        // one is written
+        virtual void io_read(address_t) {}
+        virtual void io_write(address_t) {}
+
+        // Called whenever an instruction sets the global interrupt flag, even if it was already set
+        virtual void interrupts_enabled() {}
+
+        // Called before each store while logging_stores is set, so that the store can be undone or
+        // checked
+        virtual void storing(address_t) {}
+        bool logging_stores = false;
+
+    public:
+
+        void add_to_reg(uint8_t & reg, uint8_t del)
+        {
+            set_flags(flag_op::add, reg, del);
+            reg += del;
+        }
+
+        void sub_from_reg(uint8_t & reg, uint8_t del)
+        {
+            set_flags(flag_op::sub, reg, del);
+            reg -= del;
+        }
+
+        void adiw(register_pair pair, uint16_t value)
+        {
+            // adiw should not modify the half-carry flag, but only ever clears it
+            byte_t h = flag(SREG_H) ? SREG_H : 0;
+
+            auto & lo = memory[register_pair_address(pair)];
+            auto & hi = memory[register_pair_address(pair) + 1];
+            uint8_t lo_del = value & 0xFF;
+            bool carry = lo + lo_del > 0xFF;
+            lo += lo_del;
+
+            // The flags come from the high byte, except that the result is only zero if both are
+            uint8_t hi_del = ((value & 0xFF00) >> 8) + carry;
+            set_flags(flag_op::add, hi, hi_del, h | (lo ? 0 : SREG_Z));
+            hi += hi_del;
+        }
+
+        void sbiw(register_pair pair, uint16_t value)
+        {
+            // sbiw should not modify the half-carry flag, but only ever clears it
+            byte_t h = flag(SREG_H) ? SREG_H : 0;
+
+            auto & lo = memory[register_pair_address(pair)];
+            auto & hi = memory[register_pair_address(pair) + 1];
+            uint8_t lo_del = value & 0xFF;
+            bool carry = lo_del > lo;
+            lo -= lo_del;
+
+            // The flags come from the high byte, except that the result is only zero if both are
+            uint8_t hi_del = ((value & 0xFF00) >> 8) + carry;
+            set_flags(flag_op::sub, hi, hi_del, h | (lo ? 0 : SREG_Z));
+            hi -= hi_del;
+        }
+
+        void add(uint8_t r1, uint8_t r2)
+        {
+            auto & rr = memory[r1];
+            auto & rd = memory[r2];
+            add_to_reg(rd, rr);
+        }
+
+        void adc(uint8_t r1, uint8_t r2)
+        {
+            auto & rr = memory[r1];
+            auto & rd = memory[r2];
+            add_to_reg(rd, rr + flag(SREG_C));
+        }
+
+        // A 16-bit register held in two bytes of the data space, low byte first
+        uint16_t word_at(address_t lo) const
+        {
+            return memory[lo] | memory[lo + 1] << 8;
+        }
+
+        void set_word_at(address_t lo, uint16_t value)
+        {
+            memory[lo] = value & 0xFF;
+            memory[lo + 1] = value >> 8;
+        }
+
+        void push(uint8_t b)
+        {
+            uint16_t sp = word_at(SPL);
+            set_word_at(SPL, sp - 1);
+            store(sp, b);
+        }
+
+        uint8_t pop()
+        {
+            uint16_t sp = word_at(SPL) + 1;
+            set_word_at(SPL, sp);
+            return load(sp);
+        }
+
+        void call(uint16_t jump_to, uint16_t return_to)
+        {
+            push(return_to & 0x00FF);
+            push(return_to >> 8);
+            pc = jump_to & pc_mask;
+        }
+
+        void rcall(int16_t offset, uint16_t return_to)
+        {
+            call(pc + offset, return_to);
+        }
+
+        void ret()
+        {
+            uint16_t addr = 0;
+            addr |= pop() << 8;
+            addr |= pop();
+            pc = addr & pc_mask;
+        }
+
+        void reti()
+        {
+            ret();
+            sei();
+        }
+
+        void sei()
+        {
+            // I is not one of the lazily computed flags, so it can be set directly
+            sreg() |= SREG_I;
+            interrupts_enabled();
+        }
+
+        void cli()
+        {
+            sreg() &= ~SREG_I;
+        }
+
+        void jmp(address_t addr)
+        {
+            pc = addr & pc_mask;
+        }
+
+        void sts(uint8_t reg, address_t address)
+        {
+            store(address, memory[reg]);
+        }
+
+        void cp(uint8_t r1, uint8_t r2)
+        {
+            set_flags(flag_op::cp, memory[r2], memory[r1]);
+        }
+
+        void cpc(uint8_t r1, uint8_t r2)
+        {
+            // The carry is subtracted too, and the zero flag can only be cleared
+            byte_t prior = (flag(SREG_C) ? SREG_C : 0) | (flag(SREG_Z) ? SREG_Z : 0);
+            set_flags(flag_op::cpc, memory[r2], memory[r1], prior);
+        }
+
+        void eor(uint8_t r1, uint8_t r2)
+        {
+            auto & rr = memory[r1];
+            auto & rd = memory[r2];
+            rd ^= rr;
+            set_flags(flag_op::eor, rd, 0);
+        }
+
+        void ldi(uint8_t reg, uint8_t val)
+        {
+            memory[reg] = val;
+        }
+
+        void cpi(uint8_t reg, uint8_t val)
+        {
+            // cpi leaves N alone, but S is still recomputed from it
+            byte_t prior = flag(SREG_N) ? SREG_N : 0;
+            set_flags(flag_op::cpi, memory[reg], val, prior);
+        }
+
+        void subi(uint8_t reg, uint8_t val)
+        {
+            sub_from_reg(memory[reg], val);
+        }
+
+        void lds(uint8_t reg, address_t address)
+        {
+            memory[reg] = load(address);
+        }
+
+        // Conditional branches return whether they were taken, which decides how long they take
+        bool brge(int8_t offset)
+        {
+            if (!flag(SREG_S)) {
+                pc = (pc + offset) & pc_mask;
+                return true;
+            }
+            return false;
+        }
+
+        bool brne(int8_t offset)
+        {
+            if (!flag(SREG_Z)) {
+                pc = (pc + offset) & pc_mask;
+                return true;
+            }
+            return false;
+        }
+
+        void rjmp(int16_t offset)
+        {
+            pc = (pc + offset) & pc_mask;
+        }
+
+        // Move on past an instruction of `words` words
+        void advance(uint8_t words)
+        {
+            pc = (pc + words) & pc_mask;
+        }
+
+        void in(int8_t ioaddress, int8_t reg)
+        {
+            memory[reg] = load(ioaddress + 0x20);
+        }
+
+        void out(int8_t ioaddress, int8_t reg)
+        {
+            store(ioaddress + 0x20, memory[reg]);
+        }
+
+        void lpm(uint8_t reg)
+        {
+            uint16_t z = word_at(Z_LO);
+            uint16_t word = flash[z & 0x7FFF];
+            memory[reg] = (z & (1 << 15)) ? (word & 0xFF00) >> 8 : word & 0xFF;
+            set_word_at(Z_LO, z + 1);
+        }
+
+        void stx(uint8_t reg)
+        {
+            uint16_t x = word_at(X_LO);
+            store(x, memory[reg]);
+            set_word_at(X_LO, x + 1);
+        }
+
+    private:
+
+        // The flags an operation sets. The rest are left as they were.
+        static byte_t flag_mask(flag_op op)
+        {
+            switch (op) {
+            case flag_op::add:
+            case flag_op::sub:
+                return SREG_H | SREG_S | SREG_V | SREG_N | SREG_Z | SREG_C;
+            case flag_op::cp:
+            case flag_op::cpc:
+                return SREG_S | SREG_V | SREG_N | SREG_Z | SREG_C;
+            case flag_op::cpi:
+                return SREG_S | SREG_V | SREG_Z | SREG_C;
+            case flag_op::eor:
+                return SREG_S | SREG_V | SREG_N | SREG_Z;
+            case flag_op::none:
+                break;
+            }
+            return 0;
+        }
+
+        // Record a flag-producing operation. For add and sub, `prior` holds the old half-carry flag,
+        // which adiw and sbiw can only ever clear, and Z unless the low byte of adiw or sbiw is
+        // non-zero.
+        void set_flags(flag_op op, uint8_t lhs, uint8_t rhs, byte_t prior = SREG_H | SREG_Z)
+        {
+            // Flags the previous operation set and this one does not have to be kept
+            auto kept = flag_mask(last_flags.op) & ~flag_mask(op);
+            if (kept) {
+                sreg() = (sreg() & ~kept) | (pending_flags() & kept);
+            }
+            last_flags.op = op;
+            last_flags.lhs = lhs;
+            last_flags.rhs = rhs;
+            last_flags.prior = prior;
+        }
+
+        static byte_t sign_flag(byte_t flags)
+        {
+            // SREG should obey the invariant that S = N XOR V
+            return !(flags & SREG_N) != !(flags & SREG_V) ? SREG_S : 0;
+        }
+
+        static byte_t add_flags(uint8_t reg, uint8_t del)
+        {
+            uint16_t result = reg + del;
+            byte_t flags = 0;
+
+            // Check for signed overflow
+            int8_t signed_reg = static_cast<int16_t>(reg);
+            int8_t signed_del = static_cast<int16_t>(del);
+            int8_t signed_result = result & 0xFF;
+            if ((signed_reg > 0 && signed_del > 0 && signed_result <= 0) ||
+                (signed_reg < 0 && signed_del < 0 && signed_result >= 0))
+            {
+                flags |= SREG_V;
+            }
+
+            // Half-carry flag
+            if ((result & (1<<4)) ? !(!!(reg & (1<<4)) ^ !!(del & (1<<4)))
+                                  :  (!!(reg & (1<<4)) ^ !!(del & (1<<4))))
+            {
+                flags |= SREG_H;
+            }
+
+            // Check MSB of result
+            if (result & (1<<7)) {
+                flags |= SREG_N;
+            }
+
+            // Check for zero result
+            if (!(result & 0xFF)) {
+                flags |= SREG_Z;
+            }
+
+            // Check for carry
+            if (result & (1<<8)) {
+                flags |= SREG_C;
+            }
+
+            return flags | sign_flag(flags);
+        }
+
+        static byte_t compare_flags(int16_t res)
+        {
+            // TODO implement half-carry flag
+            byte_t flags = 0;
+            if (res < std::numeric_limits<int8_t>::min() || res > std::numeric_limits<int8_t>::max()) {
+                flags |= SREG_V;
+            }
+            if (!(res & 0xFF)) {
+                flags |= SREG_Z;
+            }
+            if (res & (1<<7)) {
+                flags |= SREG_N;
+            }
+            return flags;
+        }
+
+        // The flags set by the last flag-producing operation. Only the bits in its flag_mask mean
+        // anything.
+        byte_t pending_flags() const
+        {
+            auto lhs = last_flags.lhs;
+            auto rhs = last_flags.rhs;
+            auto prior = last_flags.prior;
+
+            switch (last_flags.op) {
+            case flag_op::add:
+                return add_flags(lhs, rhs) & (prior | ~(SREG_H | SREG_Z));
+            case flag_op::sub:
+                {
+                    // Subtraction is addition of the two's complement, except for the carry
+                    byte_t flags = add_flags(lhs, ~rhs + 1) & (prior | ~(SREG_H | SREG_Z)) & ~SREG_C;
+                    return flags | (rhs > lhs ? SREG_C : 0);
+                }
+            case flag_op::cp:
+                {
+                    byte_t flags = compare_flags((int16_t)lhs - (int16_t)rhs);
+                    flags |= rhs > lhs ? SREG_C : 0;
+                    return flags | sign_flag(flags);
+                }
+            case flag_op::cpc:
+                {
+                    bool carry = prior & SREG_C;
+                    byte_t flags = compare_flags((int16_t)lhs - (int16_t)rhs - (int16_t)carry);
+                    flags &= prior | ~SREG_Z;
+                    flags |= rhs + carry > lhs ? SREG_C : 0;
+                    return flags | sign_flag(flags);
+                }
+            case flag_op::cpi:
+                {
+                    byte_t flags = compare_flags((int16_t)lhs - (int16_t)rhs) & ~SREG_N;
+                    flags |= rhs > lhs ? SREG_C : 0;
+                    return flags | sign_flag(flags | prior);
+                }
+            case flag_op::eor:
+                {
+                    byte_t flags = (lhs & (1 << 7)) ? SREG_N : 0;
+                    flags |= lhs ? 0 : SREG_Z;
+                    return flags | sign_flag(flags);
+                }
+            case flag_op::none:
+                break;
+            }
+            return 0;
+        }
+
+    public:
+        std::vector<uint16_t>   text;       // flash, unless it is shared
+        const uint16_t *        flash;
+
+        // Flash sizes are powers of two, and the program counter wraps around the end of flash as
+        // it does on the hardware, so pc always indexes flash and the tables made from it
+        const uint16_t          pc_mask;
+
+        // Flags up to the last flag-producing operation; see flag()
+        byte_t & sreg()
+        {
+            return memory[reg::SREG];
+        }
+
+        byte_t sreg() const
+        {
+            return memory[reg::SREG];
+        }
+    };
+
+}
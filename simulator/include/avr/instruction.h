@@ -16,12 +16,17 @@ namespace avr {
         JMP  = 0b1001'0100'0000'1100,
         STS  = 0b1001'0010'0000'0000,
         RET  = 0b1001'0101'0000'1000,
+        RETI = 0b1001'0101'0001'1000,
+        SEI  = 0b1001'0100'0111'1000,
+        CLI  = 0b1001'0100'1111'1000,
+        SLEEP= 0b1001'0101'1000'1000,
         CP   = 0b0001'0100'0000'0000,
         CPC  = 0b0000'0100'0000'0000,
         ADD  = 0b0000'1100'0000'0000,
         ADC  = 0b0001'1100'0000'0000,
         LDI  = 0b1110'0000'0000'0000,
         CPI  = 0b0011'0000'0000'0000,
+        SUBI = 0b0101'0000'0000'0000,
         LDS  = 0b1001'0000'0000'0000,
         STX  = 0b1001'0010'0000'1101,
         BRGE = 0b1111'0100'0000'0100,
@@ -119,10 +124,38 @@ namespace avr {
 
     instruction decode(const uint16_t *pc);
 
+    // Like decode, but reports an invalid instruction by returning false instead of throwing.
+    // instr is left unspecified in that case.
+    bool try_decode(const uint16_t *pc, instruction & instr);
+
     // bits are read LEFT TO RIGHT, indexed at 0
-    uint16_t bits_at(uint16_t bits, const std::vector<size_t>& locations);
+    template<size_t location>
+    constexpr uint16_t bits_at(uint16_t bits)
+    {
+        return (bits >> (15 - location)) & 1;
+    }
+
+    template<size_t location, size_t next, size_t... rest>
+    constexpr uint16_t bits_at(uint16_t bits)
+    {
+        return (bits_at<location>(bits) << (1 + sizeof...(rest))) | bits_at<next, rest...>(bits);
+    }
+
     // returns bits in range [min, max)
-    uint16_t bits_range(uint16_t bits, size_t min, size_t max);
+    template<size_t min, size_t max>
+    constexpr uint16_t bits_range(uint16_t bits)
+    {
+        static_assert(min < max && max <= 16, "bit range out of bounds");
+        return (bits >> (16 - max)) & ((1u << (max - min)) - 1);
+    }
+
+    // interprets the low `width` bits as a two's complement number
+    template<size_t width>
+    constexpr int16_t sign_extend(uint16_t bits)
+    {
+        static_assert(0 < width && width <= 16, "bit width out of bounds");
+        return static_cast<int16_t>((bits ^ (1 << (width - 1))) - (1 << (width - 1)));
+    }
 
     std::string mnemonic(const instruction &);
 
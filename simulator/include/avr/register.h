@@ -15,6 +15,7 @@ namespace avr {
         R29 = 0x1D,
         R30 = 0x1E,
         R31 = 0x1F,
+        SMCR = 0x53,
         SPL = 0x5D,
         SPH = 0x5E
     };
@@ -30,6 +31,7 @@ namespace avr {
     enum sreg_flag
         : byte_t
     {
+        SREG_I = 0b1000'0000,
         SREG_H = 0b0010'0000,
         SREG_S = 0b0001'0000,
         SREG_V = 0b0000'1000,
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+#include "avr/instruction.h"
+
+namespace avr {
+
+    // Clock cycles an instruction takes. Conditional branches take `cycles` when they fall through
+    // and `taken` when they branch; for everything else the two are the same.
+    struct timing
+    {
+        uint8_t         cycles;
+        uint8_t         taken;
+    };
+
+    // Timings for the classic AVR core with a 16-bit program counter (ATmega48/88/168/328 and
+    // similar), from the AVR instruction set manual
+    timing classic_timing(opcode op);
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+#include "avr/core.h"
+
+namespace avr {
+
+    // A program translated to C++ by `avr-db translate`. The generated translation unit defines
+    // these functions; compile it against this header and link it with the simulator library.
+    // Only the CPU is translated: there are no peripherals, so nothing raises an interrupt.
+    namespace translated {
+
+        // Copy the program into flash
+        void load(core & c);
+
+        // Run translated code from c.pc until c.cycle_count reaches `cycle`. Returns false if
+        // execution reaches code that was not translated (an invalid or unimplemented instruction,
+        // or a return to somewhere other than just after a call), leaving c.pc there.
+        bool run(core & c, uint64_t cycle);
+
+    }
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "simulator.h"
+
+namespace simulator {
+
+    // Bytes written into the data space after loading, before a job starts. They are written
+    // straight into memory, without the side effects a store by the program would have.
+    struct memory_patch
+    {
+        address_t                   address;
+        std::vector<byte_t>         bytes;
+    };
+
+    // Consecutive jobs on a thread which run the same image share a simulator, which is put back to
+    // its state after loading between them
+    struct batch_job
+    {
+        image_handle                image;
+        std::vector<memory_patch>   patches;
+        uint64_t                    cycles;     // the job stops once it has run this many
+    };
+
+    struct batch_result
+    {
+        stop_reason                 reason;
+        std::vector<byte_t>         memory;     // the registers, I/O space and SRAM, up to RAMEND
+    };
+
+    // Run every job, spread over `threads` threads, or one for each core if it is 0. Threads which
+    // run out of jobs take them from the others. The results are in the same order as the jobs.
+    std::vector<batch_result> run_batch(
+        const std::vector<batch_job> & jobs, unsigned threads = 0, engine engine = engine::switched);
+
+    // Run jobs which all use the same image on one thread, in lockstep: where they are at the same
+    // instruction, and it is add, adc, eor, cp, cpi or ldi, it is run for all of them at once with
+    // vector instructions. They keep together through jumps, branches which all of them take the same
+    // way, and lds and sts of plain memory. Suits sweeps over inputs which take most jobs down the
+    // same path. Every job has a simulator of its own for the whole run.
+    std::vector<batch_result> run_lockstep(
+        const std::vector<batch_job> & jobs, engine engine = engine::switched);
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "simulator.h"
+
+namespace simulator {
+
+    // A program to fuzz, and where it takes its input from
+    struct fuzz_target
+    {
+        image_handle            image;
+        address_t               entry;          // each input runs from here until the function returns,
+                                                // or the program comes back here
+        address_t               input;          // the buffer in the data space each input is written to
+        size_t                  input_size;
+        uint64_t                cycles = 1000000;   // inputs running longer are cut short; not a crash
+        uint64_t                init_cycles = 100000000;    // from reset to the entry point, at most
+        address_t               stack_limit = 0;    // the stack pointer going below this is a crash
+        std::vector<address_t>  watchpoints;    // and so is a store to any of these
+    };
+
+    // An input which crashed the program: it ran into an invalid instruction, overflowed the stack
+    // or stored to a watchpoint
+    struct fuzz_crash
+    {
+        stop_reason             reason;
+        std::vector<byte_t>     input;
+    };
+
+    // Runs the program over mutated inputs, keeping those which take it along jumps it has not taken
+    // before, or has not taken as many times, to mutate further. The program runs from reset to the
+    // entry point once, and each input runs from a snapshot taken there, in the same process.
+    struct fuzzer
+    {
+        virtual ~fuzzer() {}
+
+        // Add an input to mutate. It is cut short or padded with zeros to the size of the buffer.
+        virtual void add_input(std::vector<byte_t> input) = 0;
+
+        // Run `count` inputs. Returns those which crashed the program, other than at a pc where it
+        // has crashed in the same way before.
+        virtual std::vector<fuzz_crash> run(uint64_t count) = 0;
+
+        virtual uint64_t executions() const = 0;
+        virtual size_t corpus_size() const = 0;     // inputs kept to mutate
+        virtual size_t edges_covered() const = 0;
+    };
+
+    // Throws std::invalid_argument if the input buffer is empty or runs off the end of the data
+    // space, or if the program does not reach the entry point
+    std::unique_ptr<fuzzer> make_fuzzer(const fuzz_target & target, uint64_t seed = 1);
+
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "types.h"
 
@@ -34,4 +37,23 @@ namespace simulator {
 
     std::unique_ptr<segment> map_segment(
         std::string fname, section_type_t section);
+
+    // Every segment, indexed by section_type_t, from one read of the file
+    std::vector<std::unique_ptr<segment>> map_segments(std::string fname);
+
+    // A symbol's value and size. Values are as the linker sees them: byte addresses in flash for
+    // code, and 0x800000 plus the address in the data space for variables.
+    struct symbol
+    {
+        uint64_t    value = 0;
+        uint64_t    size = 0;
+    };
+
+    // Every symbol in an ELF file by name, from one read of the file. Empty if the file cannot be
+    // read.
+    std::map<std::string, symbol> read_symbols(std::string fname);
+
+    // Copy the text segment, and then any other segments, into a flash image at their addresses
+    void load_flash(
+        std::vector<uint16_t> & flash, const segment & text, const std::vector<segment *> & other_segs);
 }
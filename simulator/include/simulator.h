@@ -1,8 +1,6 @@
 #pragma once
 
-#include <exception>
 #include <memory>
-#include <string>
 #include <vector>
 
 #include "avr/boards.h"
@@ -11,29 +9,132 @@
 
 namespace simulator {
 
-    struct unimplemented_error
-        : std::exception
+    // Why a run returned
+    enum class stop_kind
+        : uint8_t
     {
-        unimplemented_error(const avr::instruction & instr);
+        done,                       // did what was asked, such as stepping
+        breakpoint,
+        cycle_limit,                // reached the cycle given to run_for or run_until_cycle
+        asleep,                     // sleeping, with nothing left which could wake the CPU
+        halted,                     // spinning in a loop, with nothing left which could end it
+        invalid_instruction,        // pc is at a word which is not an instruction
+        unimplemented_instruction,  // pc is at an instruction the simulator cannot execute
+        history_start,              // went back as far as the history kept goes
+        watchpoint,                 // an instruction stored to a watched address
+        stack_overflow,             // the stack grew below its limit
+    };
 
-        const char *what() const noexcept override;
+    const char *describe(stop_kind kind);
 
-    private:
-        std::string desc;
+    struct stop_reason
+    {
+        stop_kind   kind;
+        address_t   pc;
+        uint64_t    cycle;
     };
 
+    // Ways of executing instructions. All engines behave identically; they differ only in speed.
+    enum class engine
+    {
+        switched,   // switch on the opcode of every instruction
+        threaded,   // each instruction's handler dispatches directly to the next
+        jit,        // translate basic blocks to native code (x86-64 only; elsewhere same as switched)
+    };
+
+    // Saved state of a simulator; see simulator::snapshot
+    struct saved_state;
+    using snapshot_handle = std::shared_ptr<const saved_state>;
+
     struct simulator
     {
+        virtual ~simulator() {}
+
         virtual void set_breakpoint(address_t) = 0;
         virtual void delete_breakpoint(address_t) = 0;
+
+        // A store to a watched address in the data space stops the run after the instruction which
+        // made it. Watching any address makes the JIT engine interpret instead.
+        virtual void set_watchpoint(address_t) = 0;
+        virtual void delete_watchpoint(address_t) = 0;
+
+        // Reading an I/O register this way has none of the side effects it has for firmware
         virtual byte_t read(address_t) const = 0;
         virtual avr::instruction next_instruction() const = 0;
-        virtual void step() = 0;
-        virtual void next() = 0;
-        virtual void run() = 0;
+
+        // The runs stop in front of an instruction which cannot be executed, instead of throwing.
+        // The stop_reason says why they returned.
+        virtual stop_reason step() = 0;
+        virtual stop_reason next() = 0;
+        virtual stop_reason run() = 0;
+
+        // Step `count` times, stopping early at a breakpoint
+        virtual stop_reason step(uint64_t count) = 0;
+
+        // Run until the program counter reaches `address` or a breakpoint is reached
+        virtual stop_reason run_until_pc(address_t address) = 0;
+
+        // Clock cycles executed since the program started
+        virtual uint64_t cycles() const = 0;
+
+        // Drive the pins of port B, C or D in `mask` from outside, to the levels in `levels`. The
+        // other pins of the port are left floating.
+        virtual void drive_pins(char port, byte_t mask, byte_t levels) = 0;
+
+        // Bytes for USART0 to receive, after any it has not read yet
+        virtual void serial_receive(const std::vector<byte_t> & bytes) = 0;
+
+        // Everything USART0 has transmitted since the last call
+        virtual std::vector<byte_t> serial_transmitted() = 0;
+
+        // Save everything which changes as the program runs: the registers, data space, pc, cycle
+        // counter, interrupts, scheduled events and peripherals. Breakpoints are left out.
+        virtual snapshot_handle snapshot() = 0;
+
+        // Go back to a snapshot of this simulator, which can be restored any number of times. Only
+        // the pages of the data space written since the snapshot are copied back.
+        virtual void restore(const snapshot_handle & saved) = 0;
+
+        // Go back to the state the program was loaded in, as a hardware reset would: the pc at 0, the
+        // I/O registers at their reset values and the stack pointer at RAMEND. Only the pages of the
+        // data space written since are cleared, so it is much cheaper than loading the program
+        // again. Breakpoints and watchpoints are kept.
+        virtual void reset() = 0;
+
+        // Keep a history of execution from here on, so that it can be run backwards, or forget it.
+        // Single steps are logged so that they can be undone one at a time; anything else is found
+        // by replaying from a checkpoint, which is taken every so often while running.
+        virtual void keep_history(bool keep) = 0;
+
+        // Go back over the last instruction, or the entry to an interrupt handler, as if it had never
+        // run
+        virtual stop_reason reverse_step() = 0;
+
+        // Go back to the last time a breakpoint was reached, or to the start of the history
+        virtual stop_reason reverse_continue() = 0;
+
+        // Run until `cycles` more clock cycles have passed or a breakpoint is reached. Execution
+        // stops between instructions, so it can overrun by part of an instruction.
+        virtual stop_reason run_for(uint64_t cycles) = 0;
+
+        // Run until the cycle counter reaches `cycle` or a breakpoint is reached
+        virtual stop_reason run_until_cycle(uint64_t cycle) = 0;
     };
 
     std::unique_ptr<simulator> program_with_segments(
+        const avr::board & board, const segment & text, const std::vector<segment *> & other_segs,
+        engine engine = engine::switched);
+
+    // A program loaded into flash and decoded, which never changes. Any number of simulators, on any
+    // threads, can run one image, each keeping only the registers, data space and peripherals.
+    struct program_image;
+    using image_handle = std::shared_ptr<const program_image>;
+
+    image_handle load_program(
         const avr::board & board, const segment & text, const std::vector<segment *> & other_segs);
 
+    // A simulator of an image starts in the state reset() puts it back to, with the stack pointer at
+    // RAMEND
+    std::unique_ptr<simulator> program_with_image(image_handle image, engine engine = engine::switched);
+
 }
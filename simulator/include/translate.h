@@ -0,0 +1,17 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+
+#include "avr/boards.h"
+#include "segment.h"
+
+namespace simulator {
+
+    // Write a C++ translation unit to `out` which implements the program with one function per basic
+    // block, starting from the reset vector. The result implements the interface in avr/translated.h.
+    void translate(
+        const avr::board & board, const segment & text, const std::vector<segment *> & other_segs,
+        std::ostream & out);
+
+}
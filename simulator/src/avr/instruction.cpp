@@ -1,19 +1,12 @@
 #include <bitset>
 #include <cstring>
 #include <string>
-#include <vector>
 #include <iostream>
-#include "math.h"
 
 #include "avr/instruction.h"
 
 using namespace avr;
 
-static opcode to_opcode(std::underlying_type_t<opcode> raw)
-{
-    return static_cast<opcode>(raw);
-}
-
 static register_pair to_reg_pair(std::underlying_type_t<register_pair> raw)
 {
     return static_cast<register_pair>(raw);
@@ -54,162 +47,160 @@ address_t avr::register_pair_address(register_pair pair)
     return 24 + 2*pair;
 }
 
-uint16_t avr::bits_at(uint16_t bits, const std::vector<size_t>& locations)
+instruction avr::decode(const uint16_t *pc)
 {
-    uint16_t new_bits = 0;
-    for (auto location : locations) {
-        uint16_t new_bit = (bits >> (15 - location)) & 1;
-        new_bits = (new_bits << 1) | new_bit;
+    instruction instr;
+    if (!try_decode(pc, instr)) {
+        throw invalid_instruction_error(pc);
     }
-    return new_bits;
+    return instr;
 }
 
-uint16_t avr::bits_range(uint16_t bits, size_t min, size_t max)
-{
-    size_t range = max - min;
-    uint16_t mask = 0;
-    for (size_t i = 0; i < range; ++i) {
-        mask <<= 1;
-        mask |= 1;
-    }
-    return (bits >> (16 - max)) & mask;
-}
+namespace {
 
-instruction avr::decode(const uint16_t *pc)
-{
-    instruction instr;
-    bzero(&instr, sizeof(instr));
+    // Fills in the operands of an instruction whose opcode has already been identified.
+    using extractor = void (*)(const uint16_t *pc, instruction & instr);
 
-    // 16-bit contiguous opcodes
-    std::underlying_type_t<opcode> opcode16 = *pc;
-    switch(opcode16) {
-    case opcode::RET:
-        instr.op = to_opcode(opcode16);
-        instr.size = 1;
-        return instr;
-    }
+    void extract_none(const uint16_t *, instruction &)
+    {}
 
-    // 8-bit contiguous opcodes
-    std::underlying_type_t<opcode> opcode8 = *pc & 0xFF00;
-    switch (opcode8) {
-    case opcode::ADIW:
-    case opcode::SBIW:
-        instr.op = to_opcode(opcode8);
-        instr.size = 1;
-        instr.args.constant_register_pair.pair = to_reg_pair(bits_range(*pc, 10, 12));
-        instr.args.constant_register_pair.constant = bits_at(*pc, std::vector<size_t>{8,9,12,13,14,15});
-        return instr;
+    void extract_constant_register_pair(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.constant_register_pair.pair = to_reg_pair(bits_range<10, 12>(*pc));
+        instr.args.constant_register_pair.constant = bits_at<8,9,12,13,14,15>(*pc);
+    }
 
-    // Not an 8-bit opcode, try to match the next opcode type
+    void extract_register1_register2(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.register1_register2.register1 = bits_at<6,12,13,14,15>(*pc);
+        instr.args.register1_register2.register2 = bits_range<7, 12>(*pc);
     }
 
-    // contiguous 6-bit opcodes for cp, cpc, sub, subc, etc.
-    std::underlying_type_t<opcode> opcode6 = *pc & 0xFC00;
-    switch (opcode6) {
-    case opcode::CP:
-    case opcode::CPC:
-    case opcode::ADD:
-    case opcode::ADC:
-    case opcode::EOR:
-        instr.op = to_opcode(opcode6);
-        instr.size = 1;
-        instr.args.register1_register2.register1 = bits_at(*pc, std::vector<size_t>{6,12,13,14,15});
-        instr.args.register1_register2.register2 = bits_range(*pc, 7, 12);
-        return instr;
+    void extract_constant_register(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.constant_register.constant = bits_at<4,5,6,7,12,13,14,15>(*pc);
+        instr.args.constant_register.reg = bits_range<8, 12>(*pc) + 16;
     }
 
-    // contiguous 4-bit opcode
-    std::underlying_type_t<opcode> opcode4 = *pc & 0xF000;
-    switch (opcode4) {
-    case opcode::LDI:
-    case opcode::CPI:
-        instr.op = to_opcode(opcode4);
-        instr.size = 1;
-        instr.args.constant_register.constant = bits_at(*pc, std::vector<size_t>{4,5,6,7,12,13,14,15});
-        instr.args.constant_register.reg = bits_range(*pc, 8, 12) + 16;
-        return instr;
-    case opcode::RJMP:
-    case opcode::RCALL:
-        {
-            instr.op = to_opcode(opcode4);
-            instr.size = 1;
-            uint16_t signed_offset = bits_range(*pc, 4, 16);
-            bool sign_bit = signed_offset >> 11;
-            uint16_t sign_mask = sign_bit << 11;
-            if (sign_bit)
-                instr.args.offset12.offset = (~sign_mask & signed_offset) + -1*pow(2,11);
-            else
-                instr.args.offset12.offset = signed_offset;
-        }
-        return instr;
+    void extract_offset12(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.offset12.offset = sign_extend<12>(bits_range<4, 16>(*pc));
     }
 
-    // discontiguous 9-bit branch opcodes
-    std::underlying_type_t<opcode> opcode9 = *pc & 0b1111'1100'0000'0111;
-    switch (opcode9) {
-    case opcode::BRGE:
-    case opcode::BRNE:
-        {
-            instr.op = to_opcode(opcode9);
-            instr.size = 1;
-            uint8_t signed_offset = bits_range(*pc, 6, 13);
-            bool sign_bit = signed_offset >> 6;
-            uint8_t sign_mask = sign_bit << 6;
-            if (sign_bit)
-                instr.args.offset.offset = (~sign_mask & signed_offset) + -1*pow(2,6);
-            else
-                instr.args.offset.offset = signed_offset;
-        }
-        return instr;
+    void extract_offset(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.offset.offset = sign_extend<7>(bits_range<6, 13>(*pc));
     }
 
-    // contiguous 5-bit opcode
-    std::underlying_type_t<opcode> opcode5 = *pc & 0xF800;
-    switch (opcode5) {
-    case opcode::IN:
-    case opcode::OUT:
-        instr.op = to_opcode(opcode5);
-        instr.size = 1;
-        instr.args.ioaddress_register.ioaddress = bits_at(*pc, std::vector<size_t>{5,6,12,13,14,15});
-        instr.args.ioaddress_register.reg = bits_range(*pc, 7, 12);
-        return instr;
+    void extract_ioaddress_register(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.ioaddress_register.ioaddress = bits_at<5,6,12,13,14,15>(*pc);
+        instr.args.ioaddress_register.reg = bits_range<7, 12>(*pc);
     }
 
-    // 10-bit discontiguous opcodes (CALL and JMP)
-    std::underlying_type_t<opcode> opcode10 = *pc & 0b1111'1110'0000'1110;
-    switch (opcode10) {
-    case opcode::CALL:
-    case opcode::JMP:
+    void extract_address(const uint16_t *pc, instruction & instr)
+    {
         // TODO assumes address is at most 16 bits (true on ATmega168, not on all AVR boards)
-        instr.op = to_opcode(opcode10);
-        instr.size = 2;
         instr.args.address.address = *(pc + 1);
-        return instr;
-
-    // Not a 10-bit discontiguous opcode
     }
 
-    // 11-bit discontinuous opcodes (LDS and STS)
-    std::underlying_type_t<opcode> opcode11 = *pc & 0b1111'1110'0000'1111;
-    switch (opcode11) {
-    case opcode::STS:
-    case opcode::LDS:
-        instr.op = to_opcode(opcode11);
-        instr.size = 2;
-        instr.args.reg_address.reg = bits_range(*pc, 7, 12);
+    void extract_register_address(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.reg_address.reg = bits_range<7, 12>(*pc);
         instr.args.reg_address.address = *(pc + 1);
-        return instr;
-    case opcode::LPM:
-    case opcode::STX:
-    case opcode::PUSH:
-    case opcode::POP:
-        instr.op = to_opcode(opcode11);
-        instr.size = 1;
-        instr.args.reg.reg = bits_range(*pc, 7, 12);
-        return instr;
     }
 
-    throw invalid_instruction_error(pc);
+    void extract_register(const uint16_t *pc, instruction & instr)
+    {
+        instr.args.reg.reg = bits_range<7, 12>(*pc);
+    }
+
+    struct opcode_class
+    {
+        opcode      op;
+        uint16_t    mask;       // bits of the first word which are part of the opcode
+        uint8_t     size;
+        extractor   extract;
+    };
+
+    // Every opcode the decoder knows about. Index 0 is reserved for invalid instructions. Where two
+    // encodings overlap, the one which appears first wins.
+    constexpr opcode_class opcode_classes[] = {
+        { static_cast<opcode>(0), 0, 0, extract_none },
+        { RET,   0xFFFF,                1, extract_none },
+        { RETI,  0xFFFF,                1, extract_none },
+        { SEI,   0xFFFF,                1, extract_none },
+        { CLI,   0xFFFF,                1, extract_none },
+        { SLEEP, 0xFFFF,                1, extract_none },
+        { ADIW,  0xFF00,                1, extract_constant_register_pair },
+        { SBIW,  0xFF00,                1, extract_constant_register_pair },
+        { CP,    0xFC00,                1, extract_register1_register2 },
+        { CPC,   0xFC00,                1, extract_register1_register2 },
+        { ADD,   0xFC00,                1, extract_register1_register2 },
+        { ADC,   0xFC00,                1, extract_register1_register2 },
+        { EOR,   0xFC00,                1, extract_register1_register2 },
+        { LDI,   0xF000,                1, extract_constant_register },
+        { CPI,   0xF000,                1, extract_constant_register },
+        { SUBI,  0xF000,                1, extract_constant_register },
+        { RJMP,  0xF000,                1, extract_offset12 },
+        { RCALL, 0xF000,                1, extract_offset12 },
+        { BRGE,  0b1111'1100'0000'0111, 1, extract_offset },
+        { BRNE,  0b1111'1100'0000'0111, 1, extract_offset },
+        { IN,    0xF800,                1, extract_ioaddress_register },
+        { OUT,   0xF800,                1, extract_ioaddress_register },
+        { CALL,  0b1111'1110'0000'1110, 2, extract_address },
+        { JMP,   0b1111'1110'0000'1110, 2, extract_address },
+        { STS,   0b1111'1110'0000'1111, 2, extract_register_address },
+        { LDS,   0b1111'1110'0000'1111, 2, extract_register_address },
+        { LPM,   0b1111'1110'0000'1111, 1, extract_register },
+        { STX,   0b1111'1110'0000'1111, 1, extract_register },
+        { PUSH,  0b1111'1110'0000'1111, 1, extract_register },
+        { POP,   0b1111'1110'0000'1111, 1, extract_register },
+    };
+
+    constexpr size_t num_opcode_classes = sizeof(opcode_classes) / sizeof(opcode_classes[0]);
+    static_assert(num_opcode_classes <= 256, "opcode class index must fit in a byte");
+
+    // Maps every possible first word of an instruction to its index in opcode_classes.
+    struct decode_table
+    {
+        uint8_t classes[1 << 16];
+
+        constexpr decode_table()
+            : classes{}
+        {
+            // Walk the classes from lowest to highest priority, so that where encodings overlap the
+            // higher priority class overwrites the lower. For each class, enumerate every word which
+            // matches it by counting through the subsets of its operand (non-opcode) bits.
+            for (size_t i = num_opcode_classes - 1; i > 0; --i) {
+                uint16_t operand_bits = ~opcode_classes[i].mask;
+                uint16_t operands = operand_bits;
+                while (true) {
+                    classes[opcode_classes[i].op | operands] = i;
+                    if (!operands) {
+                        break;
+                    }
+                    operands = (operands - 1) & operand_bits;
+                }
+            }
+        }
+    };
+
+    constexpr decode_table table;
+}
+
+bool avr::try_decode(const uint16_t *pc, instruction & instr)
+{
+    auto & cls = opcode_classes[table.classes[*pc]];
+    if (!cls.size) {
+        return false;
+    }
+
+    bzero(&instr, sizeof(instr));
+    instr.op = cls.op;
+    instr.size = cls.size;
+    cls.extract(pc, instr);
+    return true;
 }
 
 std::string avr::mnemonic(const instruction & instr)
@@ -227,6 +218,14 @@ std::string avr::mnemonic(const instruction & instr)
         return "sts";
     case RET:
         return "ret";
+    case RETI:
+        return "reti";
+    case SEI:
+        return "sei";
+    case CLI:
+        return "cli";
+    case SLEEP:
+        return "sleep";
     case CP:
         return "cp";
     case CPC:
@@ -251,8 +250,12 @@ std::string avr::mnemonic(const instruction & instr)
         return "out";
     case BRNE:
         return "brne";
+    case BRGE:
+        return "brge";
     case CPI:
         return "cpi";
+    case SUBI:
+        return "subi";
     case STX:
         return "stx";
     case LPM:
@@ -0,0 +1,44 @@
+#include "avr/timing.h"
+
+using namespace avr;
+
+timing avr::classic_timing(opcode op)
+{
+    switch (op) {
+    case ADD:
+    case ADC:
+    case CP:
+    case CPC:
+    case CPI:
+    case SUBI:
+    case EOR:
+    case LDI:
+    case SEI:
+    case CLI:
+    case SLEEP:
+    case IN:
+    case OUT:
+        return {1, 1};
+    case BRGE:
+    case BRNE:
+        return {1, 2};
+    case ADIW:
+    case SBIW:
+    case LDS:
+    case STS:
+    case STX:
+    case PUSH:
+    case POP:
+    case RJMP:
+        return {2, 2};
+    case JMP:
+    case RCALL:
+    case LPM:
+        return {3, 3};
+    case CALL:
+    case RET:
+    case RETI:
+        return {4, 4};
+    }
+    return {1, 1};
+}
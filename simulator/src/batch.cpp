@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "simulator_impl.h"
+
+using namespace simulator;
+
+namespace {
+
+    // The jobs a thread has yet to run. It takes them from the front, and other threads steal them
+    // from the back, so that a thread and the one stealing from it rarely want the same job.
+    struct work_queue
+    {
+        bool take(size_t & job)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (jobs.empty()) {
+                return false;
+            }
+            job = jobs.front();
+            jobs.pop_front();
+            return true;
+        }
+
+        bool steal(size_t & job)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (jobs.empty()) {
+                return false;
+            }
+            job = jobs.back();
+            jobs.pop_back();
+            return true;
+        }
+
+        std::mutex          lock;
+        std::deque<size_t>  jobs;
+    };
+
+    void check_jobs(const std::vector<batch_job> & jobs)
+    {
+        for (auto & job : jobs) {
+            if (!job.image) {
+                throw std::invalid_argument("batch job has no program image");
+            }
+            for (auto & patch : job.patches) {
+                if (patch.address + patch.bytes.size() > std::tuple_size<avr::data_space>::value) {
+                    throw std::invalid_argument("memory patch runs off the end of the data space");
+                }
+            }
+        }
+    }
+
+    void apply_patches(simulator_impl & sim, const std::vector<memory_patch> & patches)
+    {
+        for (auto & patch : patches) {
+            for (size_t i = 0; i < patch.bytes.size(); ++i) {
+                address_t address = patch.address + i;
+                sim.memory[address] = patch.bytes[i];
+                sim.written_pages[address >> 8] = 1;
+            }
+        }
+    }
+
+    batch_result result_of(const simulator_impl & sim, const batch_job & job, stop_reason reason)
+    {
+        batch_result result;
+        result.reason = reason;
+        result.memory.resize(avr::core::io_end + job.image->board.ram_end);
+        for (size_t address = 0; address < result.memory.size(); ++address) {
+            result.memory[address] = sim.read(address);
+        }
+        return result;
+    }
+
+    // One thread's simulator, kept loaded with the program of the last job it ran
+    struct worker
+    {
+        worker(engine engine_)
+            : selected_engine(engine_)
+        {}
+
+        batch_result run(const batch_job & job)
+        {
+            if (job.image != loaded) {
+                sim = std::make_unique<simulator_impl>(job.image, selected_engine);
+                after_load = sim->snapshot();
+                loaded = job.image;
+            } else {
+                sim->restore(after_load);
+            }
+
+            apply_patches(*sim, job.patches);
+            return result_of(*sim, job, sim->run_for(job.cycles));
+        }
+
+        engine                          selected_engine;
+        image_handle                    loaded;
+        std::unique_ptr<simulator_impl> sim;
+        snapshot_handle                 after_load;
+    };
+
+}
+
+std::vector<batch_result> simulator::run_batch(
+    const std::vector<batch_job> & jobs, unsigned threads, engine engine)
+{
+    check_jobs(jobs);
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min<size_t>(threads, jobs.size()));
+
+    // Each thread starts with a run of consecutive jobs, which are likely to share a program
+    std::vector<work_queue> queues(threads);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        queues[i * threads / jobs.size()].jobs.push_back(i);
+    }
+
+    std::vector<batch_result> results(jobs.size());
+    std::vector<std::exception_ptr> errors(threads);
+    auto work = [&](size_t self) {
+        try {
+            worker runner(engine);
+            size_t job;
+            for (;;) {
+                bool found = queues[self].take(job);
+                for (size_t i = 1; !found && i < threads; ++i) {
+                    found = queues[(self + i) % threads].steal(job);
+                }
+                if (!found) {
+                    // Nothing is ever added, so once every queue is empty all the jobs have started
+                    return;
+                }
+                results[job] = runner.run(jobs[job]);
+            }
+        } catch (...) {
+            errors[self] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; ++i) {
+        pool.emplace_back(work, i);
+    }
+    work(0);
+    for (auto & thread : pool) {
+        thread.join();
+    }
+
+    for (auto & error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return results;
+}
+
+std::vector<batch_result> simulator::run_lockstep(const std::vector<batch_job> & jobs, engine engine)
+{
+    check_jobs(jobs);
+    for (auto & job : jobs) {
+        if (job.image != jobs.front().image) {
+            throw std::invalid_argument("jobs run in lockstep must share one image");
+        }
+    }
+
+    std::vector<std::unique_ptr<simulator_impl>> sims;
+    std::vector<simulator_impl *> lanes;
+    std::vector<uint64_t> limits;
+    for (auto & job : jobs) {
+        sims.push_back(std::make_unique<simulator_impl>(job.image, engine));
+        apply_patches(*sims.back(), job.patches);
+        lanes.push_back(sims.back().get());
+        limits.push_back(sims.back()->cycle_count + job.cycles);
+    }
+
+    auto reasons = simulator_impl::run_lockstep(lanes, limits);
+    std::vector<batch_result> results;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        results.push_back(result_of(*sims[i], jobs[i], reasons[i]));
+    }
+    return results;
+}
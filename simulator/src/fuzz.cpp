@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "fuzz.h"
+#include "simulator_impl.h"
+
+using namespace simulator;
+
+namespace {
+
+    // xorshift64*, which is plenty for picking mutations
+    struct random_bits
+    {
+        uint64_t next()
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545F4914F6CDD1DULL;
+        }
+
+        size_t below(size_t bound)
+        {
+            return next() % bound;
+        }
+
+        uint64_t state;
+    };
+
+    // Hit counts are put in buckets, as AFL does, so that going round a loop once more only counts
+    // as new coverage when it takes the count into a bucket it has not been in before
+    uint8_t bucket(uint8_t count)
+    {
+        if (count <= 3) {
+            return count == 3 ? 1 << 2 : count;
+        }
+        if (count <= 7) {
+            return 1 << 3;
+        }
+        if (count <= 15) {
+            return 1 << 4;
+        }
+        if (count <= 31) {
+            return 1 << 5;
+        }
+        return count <= 127 ? 1 << 6 : 1 << 7;
+    }
+
+    // Values which often find edge cases, for whole bytes
+    const byte_t interesting[] = {0, 1, 0x7F, 0x80, 0xFF, 0x10, 0x20, 0x40, 0x64, 0x0A, 0x0D};
+
+    bool is_crash(stop_kind kind)
+    {
+        return kind == stop_kind::invalid_instruction || kind == stop_kind::stack_overflow ||
+            kind == stop_kind::watchpoint;
+    }
+
+    struct fuzzer_impl
+        : fuzzer
+    {
+        fuzzer_impl(const fuzz_target & target_, uint64_t seed)
+            : target(target_)
+            , sim(std::make_unique<simulator_impl>(target.image, engine::threaded))
+            , random{seed ? seed : 1}
+        {
+            // No stack limit until the program has set up its stack pointer
+            if (sim->pc != target.entry) {
+                auto stopped = sim->run_until_pc_or_cycle(target.entry, target.init_cycles);
+                if (stopped.kind != stop_kind::done) {
+                    throw std::invalid_argument("the program does not reach the fuzzing entry point");
+                }
+            }
+
+            for (auto address : target.watchpoints) {
+                sim->set_watchpoint(address);
+            }
+            sim->set_stack_limit(target.stack_limit);
+            sim->record_edges(&edges);
+            at_entry = sim->snapshot();
+            corpus.emplace_back(target.input_size);
+        }
+
+        void add_input(std::vector<byte_t> input) override
+        {
+            input.resize(target.input_size);
+            corpus.push_back(std::move(input));
+        }
+
+        std::vector<fuzz_crash> run(uint64_t count) override
+        {
+            std::vector<fuzz_crash> found;
+            std::vector<byte_t> input;
+            for (uint64_t i = 0; i < count; ++i) {
+                input = corpus[random.below(corpus.size())];
+                mutate(input);
+
+                auto stopped = run_input(input);
+                ++executed;
+                if (is_crash(stopped.kind)) {
+                    if (crashes.emplace(stopped.kind, stopped.pc).second) {
+                        found.push_back({stopped, input});
+                    }
+                } else if (new_coverage()) {
+                    corpus.push_back(input);
+                }
+            }
+            return found;
+        }
+
+        uint64_t executions() const override
+        {
+            return executed;
+        }
+
+        size_t corpus_size() const override
+        {
+            return corpus.size();
+        }
+
+        size_t edges_covered() const override
+        {
+            return covered;
+        }
+
+    private:
+
+        // Reset to the entry point, which only copies back the pages the last input wrote to
+        stop_reason run_input(const std::vector<byte_t> & input)
+        {
+            sim->restore(at_entry);
+            edges.clear();
+            std::copy(input.begin(), input.end(), sim->memory.begin() + target.input);
+            size_t last = target.input + input.size() - 1;
+            for (size_t page = target.input >> 8; page <= last >> 8; ++page) {
+                sim->written_pages[page] = 1;
+            }
+            return sim->run_until_return_or_cycle(sim->cycle_count + target.cycles);
+        }
+
+        // Whether the last input took a jump into a bucket of hit counts it has not been in before.
+        // Only the entries it hit are looked at.
+        bool new_coverage()
+        {
+            bool found = false;
+            for (auto entry : edges.touched) {
+                auto hits = bucket(edges.hits[entry]);
+                if (hits & ~seen[entry]) {
+                    covered += !seen[entry];
+                    seen[entry] |= hits;
+                    found = true;
+                }
+            }
+            return found;
+        }
+
+        // A stack of random changes, as AFL's havoc stage makes
+        void mutate(std::vector<byte_t> & input)
+        {
+            auto changes = size_t(1) << random.below(5);
+            for (size_t i = 0; i < changes; ++i) {
+                auto at = random.below(input.size());
+                switch (random.below(6)) {
+                case 0:
+                    input[at] ^= 1 << random.below(8);
+                    break;
+                case 1:
+                    input[at] = random.next();
+                    break;
+                case 2:
+                    input[at] += random.below(71) - 35;
+                    break;
+                case 3:
+                    input[at] = interesting[random.below(sizeof(interesting))];
+                    break;
+                case 4:
+                    {
+                        // Copy a block from elsewhere in the input, which it may overlap
+                        auto from = random.below(input.size());
+                        auto length = 1 + random.below(input.size() - std::max(at, from));
+                        auto block = input.begin() + from;
+                        if (from > at) {
+                            std::copy(block, block + length, input.begin() + at);
+                        } else {
+                            std::copy_backward(block, block + length, input.begin() + at + length);
+                        }
+                        break;
+                    }
+                case 5:
+                    {
+                        // Copy a block from another input in the corpus
+                        auto & other = corpus[random.below(corpus.size())];
+                        auto length = 1 + random.below(input.size() - at);
+                        std::copy_n(other.begin() + at, length, input.begin() + at);
+                        break;
+                    }
+                }
+            }
+        }
+
+        fuzz_target                         target;
+        std::unique_ptr<simulator_impl>     sim;    // allocated on its own, for its alignment
+        snapshot_handle                     at_entry;
+        edge_counts                         edges;  // hit counts for the input being run
+        std::array<uint8_t, edge_counts::size> seen = {};   // buckets each edge's hit counts have been in
+        size_t                              covered = 0;    // edges with any bucket in seen
+        std::vector<std::vector<byte_t>>    corpus;
+        std::set<std::pair<stop_kind, address_t>> crashes;
+        uint64_t                            executed = 0;
+        random_bits                         random;
+    };
+
+}
+
+std::unique_ptr<fuzzer> simulator::make_fuzzer(const fuzz_target & target, uint64_t seed)
+{
+    if (!target.image) {
+        throw std::invalid_argument("fuzz target has no program image");
+    }
+    if (!target.input_size || target.input + target.input_size > std::tuple_size<avr::data_space>::value) {
+        throw std::invalid_argument("fuzz input buffer is empty or runs off the end of the data space");
+    }
+    return std::make_unique<fuzzer_impl>(target, seed);
+}
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <limits>
+
+#include "simulator_impl.h"
+
+using namespace avr;
+using namespace simulator;
+
+// Running backwards is running forwards again from an earlier point. Checkpoints are snapshots taken
+// every checkpoint_interval cycles, and since execution is deterministic, replaying from one always
+// arrives at the same states as the first time round. Whatever the host does to the simulator, such
+// as driving pins, cannot be replayed, so a checkpoint is taken after it. Single steps are also
+// logged with what they changed, so that the usual way of going back, one step at a time, does not
+// have to replay anything.
+
+void simulator_impl::keep_history(bool keep)
+{
+    keeping_history = keep;
+    if (keep) {
+        start_history();
+    } else {
+        checkpoints.clear();
+        undo_log.clear();
+    }
+}
+
+stop_reason simulator_impl::reverse_step()
+{
+    if (!keeping_history) {
+        return reason(stop_kind::history_start);
+    }
+    if (undo_log.empty()) {
+        rebuild_undo_log();
+        if (undo_log.empty()) {
+            return reason(stop_kind::history_start);
+        }
+    }
+    undo(undo_log.back());
+    undo_log.pop_back();
+    return reason(stop_kind::done);
+}
+
+stop_reason simulator_impl::reverse_continue()
+{
+    if (!keeping_history) {
+        return reason(stop_kind::history_start);
+    }
+    undo_log.clear();
+
+    // Replay from each checkpoint in turn, latest first, up to where the one after it begins, and stop
+    // at the last breakpoint reached on the way
+    auto target = cycle_count;
+    for (size_t i = checkpoints.size(); i-- > 0;) {
+        auto & checkpoint = *checkpoints[i];
+        if (checkpoint.machine->cycle_count >= target) {
+            continue;
+        }
+
+        load_snapshot(checkpoint);
+        bool starts_at_breakpoint = breakpoint_at(pc) && !sleeping && !interrupt_due();
+        auto last_breakpoint = std::numeric_limits<uint64_t>::max();
+        replay(target, &last_breakpoint);
+
+        if (last_breakpoint != std::numeric_limits<uint64_t>::max()) {
+            load_snapshot(checkpoint);
+            replay(last_breakpoint, nullptr);
+            return reason(stop_kind::breakpoint);
+        }
+        if (starts_at_breakpoint) {
+            load_snapshot(checkpoint);
+            return reason(stop_kind::breakpoint);
+        }
+        target = checkpoint.machine->cycle_count;
+    }
+
+    load_snapshot(*checkpoints.front());
+    return reason(stop_kind::history_start);
+}
+
+void simulator_impl::start_history()
+{
+    checkpoints.clear();
+    undo_log.clear();
+    take_checkpoint();
+}
+
+// Once the simulator runs forwards from an earlier point, anything after it may not happen again
+void simulator_impl::going_forward()
+{
+    while (checkpoints.size() > 1 && checkpoints.back()->machine->cycle_count > cycle_count) {
+        checkpoints.pop_back();
+    }
+}
+
+void simulator_impl::host_changed_state()
+{
+    if (!keeping_history) {
+        return;
+    }
+
+    // Replaying to here from a checkpoint before the change would arrive at the state without it
+    going_forward();
+    if (checkpoints.size() > 1 && checkpoints.back()->machine->cycle_count == cycle_count) {
+        checkpoints.pop_back();
+    }
+    take_checkpoint();
+}
+
+void simulator_impl::take_checkpoint()
+{
+    checkpoints.push_back(snapshot());
+
+    // Keep history going back to the start, with the older half more and more sparse
+    if (checkpoints.size() > max_checkpoints) {
+        size_t half = checkpoints.size() / 2;
+        size_t kept = 0;
+        for (size_t i = 0; i < checkpoints.size(); ++i) {
+            if (i >= half || i % 2 == 0) {
+                checkpoints[kept++] = std::move(checkpoints[i]);
+            }
+        }
+        checkpoints.resize(kept);
+    }
+}
+
+// Start logging a step, before it runs. Stores to SRAM are added to the record as they happen.
+void simulator_impl::log_step()
+{
+    undo_log.emplace_back();
+    auto & record = undo_log.back();
+    record.cycle_count = cycle_count;
+    record.pc = pc;
+    record.last_flags = last_flags;
+    std::copy(memory.begin(), memory.begin() + record.low.size(), record.low.begin());
+    record.devices = save_devices();
+    if (undo_log.size() > undo_capacity) {
+        undo_log.pop_front();
+    }
+    log_stores(true);
+}
+
+void simulator_impl::undo(const undo_record & record)
+{
+    for (auto store = record.stores.rbegin(); store != record.stores.rend(); ++store) {
+        memory[store->first] = store->second;
+        written_pages[store->first >> 8] = 1;
+    }
+    std::copy(record.low.begin(), record.low.end(), memory.begin());
+    written_pages[0] = 1;
+
+    cycle_count = record.cycle_count;
+    pc = record.pc;
+    last_flags = record.last_flags;
+    restore_devices(record.devices);
+}
+
+// Log the steps which led to where the simulator is now, by replaying from the latest checkpoint
+// before it. Only the last stretch is logged, since replaying without logging is much faster; it is
+// made longer if it does not take in a single step.
+void simulator_impl::rebuild_undo_log()
+{
+    auto target = cycle_count;
+    auto checkpoint = std::find_if(checkpoints.rbegin(), checkpoints.rend(),
+        [target](const snapshot_handle & saved) { return saved->machine->cycle_count < target; });
+    if (checkpoint == checkpoints.rend()) {
+        return;
+    }
+
+    for (uint64_t stretch = undo_capacity; undo_log.empty(); stretch *= 2) {
+        load_snapshot(**checkpoint);
+        bool from_checkpoint = target - cycle_count <= stretch;
+        if (!from_checkpoint) {
+            replay(target - stretch, nullptr);
+        }
+        log_until(target);
+        if (from_checkpoint) {
+            break;
+        }
+    }
+}
+
+// Step forward to `target`, logging each step. The entry to an interrupt handler is a step of its
+// own, so that every point a run could have stopped at is reached.
+void simulator_impl::log_until(uint64_t target)
+{
+    stepping = true;
+    run_limit = target;
+    while (cycle_count < target) {
+        log_step();
+        if (interrupt_due()) {
+            take_interrupt();
+        } else {
+            run_until([]() { return true; });
+        }
+        log_stores(false);
+    }
+}
+
+// Run forward to `target`, which has to be a point the simulator stopped at before, not stopping at
+// breakpoints on the way, but noting the cycle of the last one reached
+void simulator_impl::replay(uint64_t target, uint64_t *last_breakpoint)
+{
+    stepping = false;
+    run_limit = target;
+    while (cycle_count < target) {
+        auto kind = run_until([this, target]() { return cycle_count >= target; });
+        if (kind != stop_kind::breakpoint) {
+            break;
+        }
+        if (last_breakpoint) {
+            *last_breakpoint = cycle_count;
+        }
+    }
+}
@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+
+#include "avr/instruction.h"
+#include "avr/register.h"
+#include "simulator_impl.h"
+
+using namespace avr;
+using namespace simulator;
+
+// Longest loop body considered, in words
+static constexpr address_t max_idle_loop_words = 16;
+
+// How many times `value` can have `step` taken away before it reaches zero, modulo 2^bits, or 0 if it
+// never does
+static uint64_t countdown_iterations(uint32_t value, uint32_t step, unsigned bits)
+{
+    if (!step) {
+        return value ? 0 : 1;
+    }
+
+    // Only multiples of the largest power of two dividing the step can be reached
+    unsigned shift = 0;
+    while (!(step & (1u << shift))) {
+        ++shift;
+    }
+    if (value & ((1u << shift) - 1)) {
+        return 0;
+    }
+
+    // Divide by what remains of the step, which is odd and so has an inverse. Each round of Newton's
+    // method doubles the number of correct bits, starting from 3.
+    uint32_t odd = step >> shift;
+    uint32_t inverse = odd;
+    for (int i = 0; i < 4; ++i) {
+        inverse *= 2 - odd * inverse;
+    }
+    unsigned width = bits - shift;
+    uint32_t n = ((value >> shift) * inverse) & ((1u << width) - 1);
+    return n ? n : uint64_t(1) << width;
+}
+
+std::vector<idle_loop> simulator_impl::find_idle_loops() const
+{
+    std::vector<idle_loop> loops(program->decoded.size());
+
+    // Whether an instruction leaves the data space alone, and only reads memory that stays the same
+    // from one cycle to the next. Registers owned by peripherals, such as TCNT0, do not.
+    auto harmless = [this](const instruction & instr) {
+        auto plain = [this](address_t address) {
+            return !has_side_effects(address);
+        };
+        switch (instr.op) {
+        case LDS:
+            return plain(instr.args.reg_address.address);
+        case IN:
+            return plain(instr.args.ioaddress_register.ioaddress + 0x20);
+        case LDI:
+        case CP:
+        case CPC:
+        case CPI:
+        case BRNE:
+        case BRGE:
+        case RJMP:
+        case JMP:
+            return true;
+        default:
+            return false;
+        }
+    };
+
+    for (address_t end = 0; end < program->decoded.size(); ++end) {
+        auto & instr = decoded[end];
+
+        // A countdown is a single sbiw or subi with a brne straight back to it
+        if (instr.op == BRNE && instr.args.offset.offset == -2 && end > 0
+            && (decoded[end - 1].op == SBIW || decoded[end - 1].op == SUBI))
+        {
+            auto & loop = loops[end - 1];
+            loop.kind = idle_loop::countdown;
+            loop.end = end;
+            loop.worst_cycles = timings[index_of(decoded[end - 1].op)].cycles + timings[BRNE_INDEX].taken;
+            continue;
+        }
+
+        address_t start;
+        switch (instr.op) {
+        case BRNE:
+        case BRGE:
+            start = end + instr.size + instr.args.offset.offset;
+            break;
+        case RJMP:
+            start = end + instr.size + instr.args.offset12.offset;
+            break;
+        case JMP:
+            start = instr.args.address.address;
+            break;
+        default:
+            continue;
+        }
+        if (!instr.size || start > end || end - start >= max_idle_loop_words) {
+            continue;
+        }
+
+        // The body has to be a run of whole instructions ending at the jump back
+        uint32_t worst_cycles = 0;
+        address_t addr = start;
+        while (addr < end && decoded[addr].size && harmless(decoded[addr])) {
+            auto t = timings[index_of(decoded[addr].op)];
+            worst_cycles += std::max(t.cycles, t.taken);
+            addr += decoded[addr].size;
+        }
+        if (addr != end || !harmless(instr)) {
+            continue;
+        }
+        auto t = timings[index_of(instr.op)];
+        worst_cycles += std::max(t.cycles, t.taken);
+
+        // Where several jumps go back to the same place, the body runs to the furthest
+        auto & loop = loops[start];
+        if (loop.kind != idle_loop::countdown && end >= loop.end) {
+            loop.kind = idle_loop::wait;
+            loop.end = end;
+            loop.worst_cycles = worst_cycles;
+        }
+    }
+    return loops;
+}
+
+void simulator_impl::skip_idle_loop()
+{
+    auto & loop = idle_loops[pc];
+
+    // Skip no further than the next event, which might change what the loop does, or the end of the
+    // run. There has to be time for a few iterations to make it worthwhile.
+    auto limit = std::min(run_limit, events.deadline());
+    if (cycle_count + 2*loop.worst_cycles > limit) {
+        return;
+    }
+
+    // Nor past a breakpoint or the pc the run stops at, which the loop would reach on every iteration
+    for (address_t addr = pc; addr <= loop.end; ++addr) {
+        if (breakpoint_at(addr) || addr == run_to) {
+            return;
+        }
+    }
+
+    switch (loop.kind) {
+    case idle_loop::wait:
+        skip_wait(loop, limit);
+        break;
+    case idle_loop::countdown:
+        skip_countdown(loop, limit);
+        break;
+    case idle_loop::none:
+        break;
+    }
+}
+
+void simulator_impl::skip_wait(const idle_loop & loop, uint64_t limit)
+{
+    address_t start = pc;
+
+    // Run one iteration. The loop only writes registers and flags, and only reads memory which
+    // nothing changes before the next event. So if the iteration comes back to the start with them
+    // as they were, every iteration up to the event would do exactly the same.
+    std::array<byte_t, 32> registers;
+    std::memcpy(registers.data(), memory.data(), registers.size());
+    byte_t flags = sreg_value();
+    uint64_t before = cycle_count;
+
+    // Jumps back within the iteration must not start another check
+    stepping = true;
+    do {
+        execute(decoded[pc]);
+    } while (pc > start && pc <= loop.end);
+    stepping = false;
+
+    if (pc != start || sreg_value() != flags
+        || std::memcmp(registers.data(), memory.data(), registers.size()))
+    {
+        return;
+    }
+
+    // With nothing coming to end the loop, it never will
+    if (limit == std::numeric_limits<uint64_t>::max()) {
+        stop_run(stop_kind::halted);
+        return;
+    }
+
+    auto period = cycle_count - before;
+    cycle_count += (limit - cycle_count) / period * period;
+}
+
+void simulator_impl::skip_countdown(const idle_loop & loop, uint64_t limit)
+{
+    auto & instr = decoded[pc];
+    bool pair = instr.op == SBIW;
+    address_t address = pair
+        ? register_pair_address(instr.args.constant_register_pair.pair)
+        : instr.args.constant_register.reg;
+    uint32_t step = pair ? instr.args.constant_register_pair.constant : instr.args.constant_register.constant;
+    unsigned bits = pair ? 16 : 8;
+    uint32_t value = pair ? memory[address] | (memory[address + 1] << 8) : memory[address];
+
+    // Every iteration but the one which reaches zero branches back
+    uint32_t period = loop.worst_cycles;
+    auto to_zero = countdown_iterations(value, step, bits);
+    if (!to_zero && limit == std::numeric_limits<uint64_t>::max()) {
+        stop_run(stop_kind::halted);
+        return;
+    }
+    uint64_t iterations = (limit - cycle_count) / period;
+    if (to_zero) {
+        iterations = std::min(iterations, to_zero - 1);
+    }
+    if (iterations < 3) {
+        return;
+    }
+
+    // Work out all but the last of the iterations
+    value -= (iterations - 1) * step;
+    memory[address] = value & 0xFF;
+    if (pair) {
+        memory[address + 1] = (value >> 8) & 0xFF;
+
+        // sbiw can only ever clear the half-carry flag, and at least every other iteration leaves the
+        // high byte alone, which clears it
+        sync_sreg();
+        sreg() &= ~SREG_H;
+    }
+    cycle_count += (iterations - 1) * period;
+
+    // Run the last, which leaves the flags as the whole loop would have
+    stepping = true;
+    execute(instr);
+    execute(decoded[loop.end]);
+    stepping = false;
+}
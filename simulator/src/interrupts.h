@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+#include "peripheral.h"
+
+namespace simulator {
+
+    // Interrupts which peripherals are requesting, one bit per vector. Nothing polls this: the
+    // simulator only looks at it when a request is raised or firmware sets the I flag in SREG.
+    struct interrupt_controller
+    {
+        // Raise or withdraw the request for `vector`. A request stays pending until `source`
+        // withdraws it, which it usually does when the interrupt is acknowledged.
+        void request(unsigned vector, bool requested, peripheral & source)
+        {
+            uint32_t bit = uint32_t(1) << vector;
+            sources[vector] = &source;
+            if (!requested) {
+                pending &= ~bit;
+            } else if (!(pending & bit)) {
+                pending |= bit;
+                if (raised) {
+                    raised();
+                }
+            }
+        }
+
+        // The pending vector with the highest priority, which is the one with the lowest number
+        unsigned next() const
+        {
+            unsigned vector = 0;
+            while (!(pending & (uint32_t(1) << vector))) {
+                ++vector;
+            }
+            return vector;
+        }
+
+        void acknowledge(unsigned vector, uint64_t cycle)
+        {
+            sources[vector]->acknowledge(vector, cycle);
+        }
+
+        uint32_t                        pending = 0;
+        // Called when a new request is raised, so that the engines stop to look at it
+        std::function<void()>           raised;
+
+    private:
+        std::array<peripheral *, 32>    sources = {};
+    };
+
+}
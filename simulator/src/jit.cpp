@@ -0,0 +1,550 @@
+#include <cstddef>
+#include <cstring>
+
+#include "avr/instruction.h"
+#include "avr/register.h"
+#include "jit.h"
+#include "simulator_impl.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+using namespace avr;
+using namespace simulator;
+
+// Generated code keeps the simulator_impl in r12 and the AVR data space in rbx. Both registers are
+// callee-saved, so they survive calls to the helpers which implement the more complex opcodes.
+
+// Size of the executable buffer
+static constexpr size_t code_size = 1 << 20;
+
+// Longest block to translate, in instructions, and an upper bound on the bytes it can take
+static constexpr size_t max_block_instructions = 32;
+static constexpr size_t max_block_bytes = 4096;
+
+jit_cache::jit_cache(
+    size_t flash_words, ptrdiff_t pc_offset_, ptrdiff_t cycles_offset_, ptrdiff_t deadline_offset_)
+    : blocks(flash_words, nullptr)
+    , block_cycles(flash_words, 0)
+    , size(code_size)
+    , pc_offset(pc_offset_)
+    , cycles_offset(cycles_offset_)
+    , deadline_offset(deadline_offset_)
+    , pending(flash_words)
+{
+#if JIT_SUPPORTED
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return;
+    }
+    code = static_cast<uint8_t *>(mem);
+    flush();
+#endif
+}
+
+jit_cache::~jit_cache()
+{
+#if JIT_SUPPORTED
+    if (code) {
+        munmap(code, size);
+    }
+#endif
+}
+
+bool jit_cache::usable() const
+{
+    return code != nullptr;
+}
+
+void jit_cache::flush()
+{
+    if (!code) {
+        return;
+    }
+
+    std::fill(blocks.begin(), blocks.end(), nullptr);
+    for (auto & jumps : pending) {
+        jumps.clear();
+    }
+    free = code;
+    emit_trampolines();
+}
+
+void jit_cache::emit_trampolines()
+{
+    // void enter(simulator_impl *sim, uint8_t *memory, const uint8_t *block)
+    enter = reinterpret_cast<entry_point>(free);
+    emit({0x53});               // push rbx
+    emit({0x41, 0x54});         // push r12
+    emit({0x41, 0x55});         // push r13 (keeps the stack 16-byte aligned for helper calls)
+    emit({0x49, 0x89, 0xFC});   // mov r12, rdi
+    emit({0x48, 0x89, 0xF3});   // mov rbx, rsi
+    emit({0xFF, 0xE2});         // jmp rdx
+
+    leave = free;
+    emit({0x41, 0x5D});         // pop r13
+    emit({0x41, 0x5C});         // pop r12
+    emit({0x5B});               // pop rbx
+    emit({0xC3});               // ret
+}
+
+bool jit_cache::begin_block(address_t address)
+{
+    if (static_cast<size_t>(code + size - free) < max_block_bytes) {
+        return false;
+    }
+    current_block = address;
+    block_start = free;
+    return true;
+}
+
+void jit_cache::end_block()
+{
+    blocks[current_block] = block_start;
+    for (auto displacement : pending[current_block]) {
+        point_at(displacement, block_start);
+    }
+    pending[current_block].clear();
+}
+
+void jit_cache::emit_exit(address_t target)
+{
+    if (target < blocks.size() && blocks[target]) {
+        // Chain straight to the translated block
+        auto displacement = emit_forward_jump({0xE9});
+        point_at(displacement, blocks[target]);
+        return;
+    }
+
+    // Until the target is translated, the jump lands on the stub right after it
+    auto displacement = emit_forward_jump({0xE9});
+    bind(displacement);
+    if (target < blocks.size()) {
+        pending[target].push_back(displacement);
+    }
+    emit_set_pc(target);
+    emit_leave();
+}
+
+void jit_cache::emit_set_pc(address_t pc)
+{
+    // mov word [r12 + pc_offset], pc
+    emit({0x66, 0x41, 0xC7, 0x84, 0x24});
+    emit_value<int32_t>(pc_offset);
+    emit_value<uint16_t>(pc);
+}
+
+uint8_t *jit_cache::emit_deadline_check(uint8_t *& out_of_time)
+{
+    // mov rax, qword [r12 + cycles_offset]
+    emit({0x49, 0x8B, 0x84, 0x24});
+    emit_value<int32_t>(cycles_offset);
+
+    // add rax, cycles
+    emit({0x48, 0x05});
+    auto immediate = free;
+    emit_value<uint32_t>(0);
+
+    // cmp rax, qword [r12 + deadline_offset]
+    // ja out_of_time
+    emit({0x49, 0x3B, 0x84, 0x24});
+    emit_value<int32_t>(deadline_offset);
+    out_of_time = emit_forward_jump({0x0F, 0x87});
+
+    return immediate;
+}
+
+void jit_cache::patch_cycles(uint8_t *immediate, uint32_t cycles)
+{
+    std::memcpy(immediate, &cycles, sizeof(cycles));
+}
+
+void jit_cache::emit_add_cycles(uint32_t cycles)
+{
+    if (!cycles) {
+        return;
+    }
+
+    // add qword [r12 + cycles_offset], cycles
+    emit({0x49, 0x81, 0x84, 0x24});
+    emit_value<int32_t>(cycles_offset);
+    emit_value<uint32_t>(cycles);
+}
+
+void jit_cache::emit_leave()
+{
+    auto displacement = emit_forward_jump({0xE9});
+    point_at(displacement, leave);
+}
+
+uint8_t *jit_cache::emit_forward_jump(std::initializer_list<uint8_t> opcode)
+{
+    emit(opcode);
+    auto displacement = free;
+    emit_value<int32_t>(0);
+    return displacement;
+}
+
+void jit_cache::bind(uint8_t *displacement)
+{
+    point_at(displacement, free);
+}
+
+void jit_cache::emit(std::initializer_list<uint8_t> bytes)
+{
+    for (auto b : bytes) {
+        *free++ = b;
+    }
+}
+
+void jit_cache::point_at(uint8_t *displacement, const uint8_t *target)
+{
+    int32_t rel = static_cast<int32_t>(target - (displacement + sizeof(int32_t)));
+    std::memcpy(displacement, &rel, sizeof(rel));
+}
+
+// mov al, byte [rbx + address]
+static void emit_load(jit_cache & jit, address_t address)
+{
+    jit.emit({0x8A, 0x83});
+    jit.emit_value<int32_t>(address);
+}
+
+// mov byte [rbx + address], al
+static void emit_store(jit_cache & jit, address_t address)
+{
+    jit.emit({0x88, 0x83});
+    jit.emit_value<int32_t>(address);
+
+    // Stores outside of the registers and I/O space mark their page as written, as core::store does
+    if (address >= core::io_end) {
+        constexpr auto written_pages = offsetof(state, written_pages) - offsetof(state, memory);
+        jit.emit({0xC6, 0x83});     // mov byte [rbx + written_pages + page], 1
+        jit.emit_value<int32_t>(written_pages + (address >> 8));
+        jit.emit_value<uint8_t>(1);
+    }
+}
+
+// mov byte [rbx + address], value
+static void emit_store_constant(jit_cache & jit, address_t address, uint8_t value)
+{
+    jit.emit({0xC6, 0x83});
+    jit.emit_value<int32_t>(address);
+    jit.emit_value<uint8_t>(value);
+}
+
+// test byte [rbx + address], mask
+static void emit_test(jit_cache & jit, address_t address, uint8_t mask)
+{
+    jit.emit({0xF6, 0x83});
+    jit.emit_value<int32_t>(address);
+    jit.emit_value<uint8_t>(mask);
+}
+
+// helper(sim, instr)
+static void emit_call(
+    jit_cache & jit, void (*helper)(simulator_impl &, const instruction &), const instruction & instr)
+{
+    jit.emit({0x4C, 0x89, 0xE7});   // mov rdi, r12
+    jit.emit({0x48, 0xBE});         // mov rsi, &instr
+    jit.emit_value<uint64_t>(reinterpret_cast<uintptr_t>(&instr));
+    jit.emit({0x48, 0xB8});         // mov rax, helper
+    jit.emit_value<uint64_t>(reinterpret_cast<uintptr_t>(helper));
+    jit.emit({0xFF, 0xD0});         // call rax
+}
+
+// Brings the flags in SREG up to date so that generated code can test them
+static void sync_sreg_helper(simulator_impl & sim, const instruction &)
+{
+    sim.sync_sreg();
+}
+
+stop_kind simulator_impl::run_jit(uint64_t deadline)
+{
+    if (!jit) {
+        auto offset_of = [this](void *member) {
+            return reinterpret_cast<uint8_t *>(member) - reinterpret_cast<uint8_t *>(this);
+        };
+        jit = std::make_unique<jit_cache>(
+            program->decoded.size(), offset_of(&pc), offset_of(&cycle_count), offset_of(&jit_deadline));
+    }
+    if (!jit->usable()) {
+        return run_until([this, deadline]() { return cycle_count >= deadline; });
+    }
+    resume_from = pc;
+    if (interrupt_due()) {
+        take_interrupt();
+    }
+
+    do {
+        if (sleeping) {
+            if (!doze()) {
+                return stop_kind::asleep;
+            }
+        } else {
+            // Translated code also has to stop for the next scheduled event
+            jit_deadline = std::min(deadline, events.deadline());
+
+            auto block = jit->blocks[pc];
+            if (!block) {
+                block = compile_block(pc);
+            }
+
+            // Blocks only run if they are sure to finish by the deadline, so that it is not overshot
+            // by more than the interpreter would
+            if (block && cycle_count + jit->block_cycles[pc] <= jit_deadline) {
+                jit->enter(this, memory.data(), block);
+            } else {
+                // Breakpoints, opcodes the translator does not handle, and the last few instructions
+                // before the deadline are interpreted
+                execute(decoded[pc]);
+            }
+        }
+
+        if (cycle_count >= events.deadline()) {
+            events.run_due(cycle_count);
+        }
+        // An interrupt which became due as the run stopped is left for the next run
+        if (stopped_for == stop_kind::done && interrupt_due()) {
+            take_interrupt();
+        }
+    } while (stopped_for == stop_kind::done && cycle_count < deadline);
+
+    auto kind = stopped_for;
+    stopped_for = stop_kind::done;
+    return kind;
+}
+
+const uint8_t *simulator_impl::compile_block(address_t start)
+{
+    // Whether generated code can access an address directly. SREG only holds the flags once they are
+    // brought up to date, and peripherals have to be told about accesses to their registers.
+    auto plain_memory = [this](address_t address) {
+        return !has_side_effects(address);
+    };
+
+    // Whether the translator can handle an instruction. Anything else ends the block, and is left
+    // to the interpreter.
+    auto translatable = [this, &plain_memory](const instruction & instr) {
+        switch (instr.op) {
+        case LDS:
+        case STS:
+            // Addresses outside of the data space are left to the interpreter, as are I/O registers
+            // with side effects
+            return instr.args.reg_address.address < memory.size()
+                && plain_memory(instr.args.reg_address.address);
+        case IN:
+        case OUT:
+            return plain_memory(instr.args.ioaddress_register.ioaddress + 0x20);
+        case LDI:
+        case RJMP:
+        case JMP:
+        case BRNE:
+        case BRGE:
+        case CALL:
+        case RCALL:
+        case RET:
+        case RETI:
+        case SEI:
+        case CLI:
+        case ADIW:
+        case SBIW:
+        case CP:
+        case CPC:
+        case ADD:
+        case ADC:
+        case CPI:
+        case SUBI:
+        case EOR:
+        case LPM:
+        case STX:
+        case PUSH:
+        case POP:
+            return true;
+        default:
+            return false;
+        }
+    };
+
+    // Breakpoints are traps, which are never translatable
+    if (!translatable(decoded[start])) {
+        return nullptr;
+    }
+    if (!jit->begin_block(start)) {
+        jit->flush();
+        jit->begin_block(start);
+    }
+
+    uint8_t *out_of_time;
+    auto block_cycles = jit->emit_deadline_check(out_of_time);
+
+    // Cycles taken by the instructions translated natively so far. Instructions implemented by
+    // helpers count their own cycles; the rest are added up here and counted once at each exit.
+    uint32_t native_cycles = 0;
+    // The most cycles any path through the block can take
+    uint32_t worst_cycles = 0;
+
+    // A jump back to the start of an idle loop returns to the dispatcher after seeing whether the
+    // loop can be skipped, instead of chaining straight to the next iteration
+    auto emit_jump = [this](address_t target, address_t from, const instruction & instr) {
+        if (target <= from && idle_loops[target].kind != idle_loop::none) {
+            jit->emit_set_pc(target);
+            emit_call(*jit, jumped_back_helper, instr);
+            jit->emit_leave();
+        } else {
+            jit->emit_exit(target);
+        }
+    };
+
+    address_t addr = start;
+    for (size_t count = 0; ; ++count) {
+        if (count == max_block_instructions || addr >= program->decoded.size()
+            || (addr != start && !translatable(decoded[addr])))
+        {
+            jit->emit_add_cycles(native_cycles);
+            jit->emit_exit(addr);
+            break;
+        }
+
+        // Targets wrap around the end of flash, as pc does
+        auto & instr = decoded[addr];
+        address_t next = (addr + instr.size) & pc_mask;
+        auto relative = [this, next](int16_t offset) { return address_t((next + offset) & pc_mask); };
+        auto absolute = instr.args.address.address & pc_mask;
+        bool end_of_block = false;
+        auto timing = timings[index_of(instr.op)];
+        worst_cycles += std::max(timing.cycles, timing.taken);
+
+        switch (instr.op) {
+        case LDI:
+            emit_store_constant(*jit, instr.args.constant_register.reg, instr.args.constant_register.constant);
+            native_cycles += timing.cycles;
+            break;
+        case LDS:
+            emit_load(*jit, instr.args.reg_address.address);
+            emit_store(*jit, instr.args.reg_address.reg);
+            native_cycles += timing.cycles;
+            break;
+        case STS:
+            emit_load(*jit, instr.args.reg_address.reg);
+            emit_store(*jit, instr.args.reg_address.address);
+            native_cycles += timing.cycles;
+            break;
+        case IN:
+            emit_load(*jit, instr.args.ioaddress_register.ioaddress + 0x20);
+            emit_store(*jit, instr.args.ioaddress_register.reg);
+            native_cycles += timing.cycles;
+            break;
+        case OUT:
+            emit_load(*jit, instr.args.ioaddress_register.reg);
+            emit_store(*jit, instr.args.ioaddress_register.ioaddress + 0x20);
+            native_cycles += timing.cycles;
+            break;
+        case RJMP:
+            jit->emit_add_cycles(native_cycles + timing.cycles);
+            emit_jump(relative(instr.args.offset12.offset), addr, instr);
+            end_of_block = true;
+            break;
+        case JMP:
+            jit->emit_add_cycles(native_cycles + timing.cycles);
+            emit_jump(absolute, addr, instr);
+            end_of_block = true;
+            break;
+        case BRNE:
+        case BRGE:
+            {
+                // Branch if the flag is clear
+                emit_call(*jit, sync_sreg_helper, instr);
+                emit_test(*jit, reg::SREG, instr.op == BRNE ? SREG_Z : SREG_S);
+                auto not_taken = jit->emit_forward_jump({0x0F, 0x85});
+                jit->emit_add_cycles(native_cycles + timing.taken);
+                emit_jump(relative(instr.args.offset.offset), addr, instr);
+                jit->bind(not_taken);
+                jit->emit_add_cycles(native_cycles + timing.cycles);
+                jit->emit_exit(next);
+                end_of_block = true;
+            }
+            break;
+        case CALL:
+            jit->emit_set_pc(addr);
+            emit_call(*jit, execute_opcode<CALL>, instr);
+            jit->emit_add_cycles(native_cycles);
+            jit->emit_exit(absolute);
+            end_of_block = true;
+            break;
+        case RCALL:
+            jit->emit_set_pc(addr);
+            emit_call(*jit, execute_opcode<RCALL>, instr);
+            jit->emit_add_cycles(native_cycles);
+            jit->emit_exit(relative(instr.args.offset12.offset));
+            end_of_block = true;
+            break;
+        case RET:
+            // The return address is only known at run time, so go back to the dispatcher
+            emit_call(*jit, execute_opcode<RET>, instr);
+            jit->emit_add_cycles(native_cycles);
+            jit->emit_leave();
+            end_of_block = true;
+            break;
+        case RETI:
+            emit_call(*jit, execute_opcode<RETI>, instr);
+            jit->emit_add_cycles(native_cycles);
+            jit->emit_leave();
+            end_of_block = true;
+            break;
+        case SEI:
+            // Setting I may make an interrupt due, which the block's successor checks the deadline
+            // for. Interrupts raised by stores in the middle of a block wait for the block to end.
+            emit_call(*jit, execute_opcode<SEI>, instr);
+            jit->emit_add_cycles(native_cycles);
+            jit->emit_exit(next);
+            end_of_block = true;
+            break;
+
+        // Opcodes with side effects on SREG or the stack reuse the interpreter's implementation.
+        // They only ever advance pc, which is overwritten when the block exits.
+#define TRANSLATE_WITH_HELPER(op) \
+        case op: \
+            emit_call(*jit, execute_opcode<op>, instr); \
+            break;
+
+        TRANSLATE_WITH_HELPER(ADIW)
+        TRANSLATE_WITH_HELPER(SBIW)
+        TRANSLATE_WITH_HELPER(CP)
+        TRANSLATE_WITH_HELPER(CPC)
+        TRANSLATE_WITH_HELPER(ADD)
+        TRANSLATE_WITH_HELPER(ADC)
+        TRANSLATE_WITH_HELPER(CPI)
+        TRANSLATE_WITH_HELPER(SUBI)
+        TRANSLATE_WITH_HELPER(EOR)
+        TRANSLATE_WITH_HELPER(LPM)
+        TRANSLATE_WITH_HELPER(STX)
+        TRANSLATE_WITH_HELPER(PUSH)
+        TRANSLATE_WITH_HELPER(POP)
+        TRANSLATE_WITH_HELPER(CLI)
+#undef TRANSLATE_WITH_HELPER
+
+        default:
+            break;
+        }
+
+        if (end_of_block) {
+            break;
+        }
+        addr = next;
+    }
+
+    jit->bind(out_of_time);
+    jit->emit_set_pc(start);
+    jit->emit_leave();
+
+    jit->patch_cycles(block_cycles, worst_cycles);
+    jit->block_cycles[start] = worst_cycles;
+
+    jit->end_block();
+    return jit->blocks[start];
+}
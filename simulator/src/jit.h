@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+#include "types.h"
+
+namespace simulator {
+
+    struct simulator_impl;
+
+    // Native x86-64 code translated from basic blocks of AVR code, and the bookkeeping needed to
+    // chain blocks together. The code itself is generated by simulator_impl::compile_block.
+    struct jit_cache
+    {
+        // Calls into generated code: runs the block at `block` (and any blocks chained to it) with
+        // `memory` as the AVR data space, until one of them exits back to the caller.
+        using entry_point = void (*)(simulator_impl *sim, uint8_t *memory, const uint8_t *block);
+
+        // The offsets are the locations of simulator_impl::pc, the cycle counter and the deadline
+        // relative to the start of the object
+        jit_cache(size_t flash_words, ptrdiff_t pc_offset, ptrdiff_t cycles_offset, ptrdiff_t deadline_offset);
+        ~jit_cache();
+
+        jit_cache(const jit_cache &) = delete;
+        jit_cache & operator=(const jit_cache &) = delete;
+
+        // False if executable memory could not be allocated on this host
+        bool usable() const;
+
+        // Discard every translated block
+        void flush();
+
+        // Start a new block at `address`. Returns false if the buffer is too full to hold another
+        // block, in which case the caller should flush and try again.
+        bool begin_block(address_t address);
+
+        // Make the block started by begin_block available, and point every exit waiting for it at it
+        void end_block();
+
+        // Emit a jump to the block at `target`, which leaves generated code with pc set to `target`
+        // until that block is translated.
+        void emit_exit(address_t target);
+
+        // Emit a store of `pc` to simulator_impl::pc
+        void emit_set_pc(address_t pc);
+
+        // Emit a jump to `out_of_time` (to be bound later) if the block cannot run for `cycles` more
+        // cycles without passing the deadline. Returns the location of the immediate holding
+        // `cycles`, to be passed to patch_cycles once the block is complete.
+        uint8_t *emit_deadline_check(uint8_t *& out_of_time);
+        void patch_cycles(uint8_t *immediate, uint32_t cycles);
+
+        // Emit an addition of `cycles` to the cycle counter
+        void emit_add_cycles(uint32_t cycles);
+
+        // Emit a jump back to the caller of enter. pc must already have been set.
+        void emit_leave();
+
+        // Emit a rel32 jump or conditional jump to a label not yet known. Returns the location of
+        // the displacement, to be passed to bind.
+        uint8_t *emit_forward_jump(std::initializer_list<uint8_t> opcode);
+
+        // Point a jump emitted by emit_forward_jump at the current position
+        void bind(uint8_t *displacement);
+
+        void emit(std::initializer_list<uint8_t> bytes);
+
+        template<class T>
+        void emit_value(T value)
+        {
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                *free++ = static_cast<uint8_t>(value >> (8*i));
+            }
+        }
+
+        uint8_t *position() const
+        {
+            return free;
+        }
+
+        entry_point                     enter = nullptr;
+        std::vector<const uint8_t *>    blocks;     // translation of each flash word, or null
+        std::vector<uint32_t>           block_cycles;   // most cycles each block can take
+
+    private:
+        void emit_trampolines();
+        void point_at(uint8_t *displacement, const uint8_t *target);
+
+        uint8_t *                       code = nullptr;
+        uint8_t *                       free = nullptr;
+        const uint8_t *                 leave = nullptr;
+        size_t                          size;
+        ptrdiff_t                       pc_offset;
+        ptrdiff_t                       cycles_offset;
+        ptrdiff_t                       deadline_offset;
+        address_t                       current_block = 0;
+        const uint8_t *                 block_start = nullptr;
+
+        // Displacements of the jumps waiting for a block at each flash word
+        std::vector<std::vector<uint8_t *>> pending;
+    };
+
+}
@@ -0,0 +1,629 @@
+#include <algorithm>
+#include <bitset>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "simulator_impl.h"
+
+using namespace avr;
+using namespace simulator;
+
+// Many simulators running one program with different inputs mostly follow the same path through it.
+// In lockstep, the registers of every lane are laid out side by side, so that an instruction can be
+// run for sixteen lanes at once with vector instructions. Each run takes the instruction most lanes
+// are at, and follows the program from there, through branches which every lane takes the same way,
+// until it reaches an instruction which cannot run in lockstep. A branch which goes different ways
+// splits the lanes, which wait where their way took them for the others to catch up.
+//
+// A lane's registers stay packed while it runs together with others or waits for them, and are only
+// moved back into its simulator when it has to run on its own: at an instruction other than the few
+// ALU instructions, plain loads and stores and jumps which can run in lockstep, or in front of an
+// event. It then runs until it gets back to where the others started, which for a loop is its top.
+// Once the lanes have gone separate ways, or if they only get short stretches together between
+// instructions which cannot run in lockstep, running them together gains nothing, so they run on
+// their own for a while before trying again.
+
+namespace {
+
+    constexpr size_t block_lanes = 16;
+
+#if defined(__SSE2__)
+
+    using block = __m128i;
+
+    block load(const uint8_t *from)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const block *>(from));
+    }
+
+    void store(uint8_t *to, block value)
+    {
+        _mm_storeu_si128(reinterpret_cast<block *>(to), value);
+    }
+
+    block splat(uint8_t value)
+    {
+        return _mm_set1_epi8(static_cast<char>(value));
+    }
+
+    block add(block a, block b) { return _mm_add_epi8(a, b); }
+    block sub(block a, block b) { return _mm_sub_epi8(a, b); }
+    block saturating_sub(block a, block b) { return _mm_subs_epu8(a, b); }
+    block minimum(block a, block b) { return _mm_min_epu8(a, b); }
+    block bit_and(block a, block b) { return _mm_and_si128(a, b); }
+    block bit_or(block a, block b) { return _mm_or_si128(a, b); }
+    block bit_xor(block a, block b) { return _mm_xor_si128(a, b); }
+    block and_not(block a, block b) { return _mm_andnot_si128(a, b); }
+
+    // Comparisons give 0xFF in the lanes where they hold, and 0 elsewhere
+    block equal(block a, block b) { return _mm_cmpeq_epi8(a, b); }
+    block negative(block a) { return _mm_cmplt_epi8(a, _mm_setzero_si128()); }
+
+    bool any(block mask)
+    {
+        return _mm_movemask_epi8(mask) != 0;
+    }
+
+    size_t count(block mask)
+    {
+        return std::bitset<block_lanes>(_mm_movemask_epi8(mask)).count();
+    }
+
+#else
+
+    // Without SSE2, a block is worked through one lane at a time
+    struct block
+    {
+        uint8_t lane[block_lanes];
+    };
+
+    template<typename Op>
+    block each(block a, block b, Op op)
+    {
+        block result;
+        for (size_t i = 0; i < block_lanes; ++i) {
+            result.lane[i] = op(a.lane[i], b.lane[i]);
+        }
+        return result;
+    }
+
+    block load(const uint8_t *from)
+    {
+        block result;
+        std::copy(from, from + block_lanes, result.lane);
+        return result;
+    }
+
+    void store(uint8_t *to, block value)
+    {
+        std::copy(value.lane, value.lane + block_lanes, to);
+    }
+
+    block splat(uint8_t value)
+    {
+        block result;
+        std::fill(result.lane, result.lane + block_lanes, value);
+        return result;
+    }
+
+    block add(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(x + y); });
+    }
+
+    block sub(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(x - y); });
+    }
+
+    block saturating_sub(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(x > y ? x - y : 0); });
+    }
+
+    block minimum(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return std::min(x, y); });
+    }
+
+    block bit_and(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(x & y); });
+    }
+
+    block bit_or(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(x | y); });
+    }
+
+    block bit_xor(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(x ^ y); });
+    }
+
+    block and_not(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(~x & y); });
+    }
+
+    block equal(block a, block b)
+    {
+        return each(a, b, [](uint8_t x, uint8_t y) { return uint8_t(x == y ? 0xFF : 0); });
+    }
+
+    block negative(block a)
+    {
+        return each(a, a, [](uint8_t x, uint8_t) { return uint8_t(x & 0x80 ? 0xFF : 0); });
+    }
+
+    bool any(block mask)
+    {
+        return std::any_of(mask.lane, mask.lane + block_lanes, [](uint8_t x) { return x != 0; });
+    }
+
+    size_t count(block mask)
+    {
+        return std::count_if(mask.lane, mask.lane + block_lanes, [](uint8_t x) { return x != 0; });
+    }
+
+#endif
+
+    // `bit` in the lanes where `mask` is set, or where it is not
+    block flag_if(block mask, byte_t bit) { return bit_and(mask, splat(bit)); }
+    block flag_unless(block mask, byte_t bit) { return and_not(mask, splat(bit)); }
+
+    // The lanes of `a` where `mask` is set, and of `b` elsewhere
+    block select(block mask, block a, block b)
+    {
+        return bit_or(bit_and(mask, a), and_not(mask, b));
+    }
+
+    // The flags core works out for add and adc, from the operands and their sum
+    block add_flags(block rd, block rr, block sum)
+    {
+        block sign = negative(sum);
+        block overflow = negative(bit_and(bit_xor(rd, sum), bit_xor(rr, sum)));
+        block half_carry = bit_and(bit_xor(bit_xor(rd, rr), sum), splat(1 << 4));
+        return bit_or(bit_or(bit_or(
+            flag_if(equal(half_carry, splat(1 << 4)), SREG_H),
+            flag_if(bit_xor(sign, overflow), SREG_S)),
+            bit_or(flag_if(overflow, SREG_V), flag_if(sign, SREG_N))),
+            bit_or(flag_if(equal(sum, splat(0)), SREG_Z),
+                flag_unless(equal(minimum(sum, rd), rd), SREG_C)));
+    }
+
+    // The flags core works out for cp and cpi, except N and S. Like core, it sets V when lhs - rhs
+    // is out of the range of a signed byte.
+    block compare_flags(block lhs, block rhs, block & overflow)
+    {
+        overflow = bit_or(negative(saturating_sub(lhs, rhs)),
+            and_not(equal(saturating_sub(saturating_sub(rhs, lhs), splat(128)), splat(0)), splat(0xFF)));
+        return bit_or(bit_or(flag_if(overflow, SREG_V), flag_if(equal(lhs, rhs), SREG_Z)),
+            flag_unless(equal(minimum(lhs, rhs), rhs), SREG_C));
+    }
+
+    // The registers and SREG of a set of lanes, with each one's values for every lane side by side
+    struct lane_registers
+    {
+        explicit lane_registers(size_t lanes)
+            : width((lanes + block_lanes - 1) / block_lanes * block_lanes)
+            , bytes(33 * width)
+        {}
+
+        uint8_t *reg(unsigned r)
+        {
+            return &bytes[r * width];
+        }
+
+        uint8_t *sreg()
+        {
+            return &bytes[32 * width];
+        }
+
+        size_t                  width;  // the number of lanes, rounded up to whole blocks
+        std::vector<uint8_t>    bytes;
+    };
+
+    // Run an instruction in the lanes where `selected` is 0xFF
+    void run_selected(lane_registers & regs, const instruction & instr, const uint8_t *selected)
+    {
+        bool immediate = instr.op == LDI || instr.op == CPI;
+        auto r1 = immediate ? 0 : instr.args.register1_register2.register1;
+        auto r2 = immediate ? 0 : instr.args.register1_register2.register2;
+        auto reg = immediate ? instr.args.constant_register.reg : 0;
+        auto constant = immediate ? instr.args.constant_register.constant : 0;
+
+        for (size_t at = 0; at < regs.width; at += block_lanes) {
+            block mask = load(selected + at);
+            if (!any(mask)) {
+                continue;
+            }
+
+            block sreg = load(regs.sreg() + at);
+            block flags = splat(0);
+            byte_t changed = 0;
+            switch (instr.op) {
+            case LDI:
+                store(regs.reg(reg) + at, select(mask, splat(constant), load(regs.reg(reg) + at)));
+                continue;
+            case ADD:
+            case ADC:
+                {
+                    block rd = load(regs.reg(r2) + at);
+                    block rr = load(regs.reg(r1) + at);
+                    if (instr.op == ADC) {
+                        // C is bit 0, so the flag is the carry
+                        rr = add(rr, bit_and(sreg, splat(SREG_C)));
+                    }
+                    block sum = add(rd, rr);
+                    flags = add_flags(rd, rr, sum);
+                    changed = SREG_H | SREG_S | SREG_V | SREG_N | SREG_Z | SREG_C;
+                    store(regs.reg(r2) + at, select(mask, sum, rd));
+                    break;
+                }
+            case EOR:
+                {
+                    block rd = load(regs.reg(r2) + at);
+                    block result = bit_xor(rd, load(regs.reg(r1) + at));
+                    block sign = negative(result);
+                    flags = bit_or(bit_or(flag_if(sign, SREG_S), flag_if(sign, SREG_N)),
+                        flag_if(equal(result, splat(0)), SREG_Z));
+                    changed = SREG_S | SREG_V | SREG_N | SREG_Z;
+                    store(regs.reg(r2) + at, select(mask, result, rd));
+                    break;
+                }
+            case CP:
+                {
+                    block lhs = load(regs.reg(r2) + at);
+                    block rhs = load(regs.reg(r1) + at);
+                    block overflow;
+                    block sign = negative(sub(lhs, rhs));
+                    flags = compare_flags(lhs, rhs, overflow);
+                    flags = bit_or(flags, flag_if(sign, SREG_N));
+                    flags = bit_or(flags, flag_if(bit_xor(sign, overflow), SREG_S));
+                    changed = SREG_S | SREG_V | SREG_N | SREG_Z | SREG_C;
+                    break;
+                }
+            case CPI:
+                {
+                    // N is left alone, but S is worked out from it
+                    block overflow;
+                    flags = compare_flags(load(regs.reg(reg) + at), splat(constant), overflow);
+                    block sign = equal(bit_and(sreg, splat(SREG_N)), splat(SREG_N));
+                    flags = bit_or(flags, flag_if(bit_xor(sign, overflow), SREG_S));
+                    changed = SREG_S | SREG_V | SREG_Z | SREG_C;
+                    break;
+                }
+            default:
+                return;
+            }
+
+            block updated = bit_or(and_not(splat(changed), sreg), flags);
+            store(regs.sreg() + at, select(mask, updated, sreg));
+        }
+    }
+
+    // Mark in `taken` the selected lanes where `flag` is clear, which is where a branch on it being
+    // clear goes. Returns how many there are.
+    size_t clear_in(lane_registers & regs, byte_t flag, const uint8_t *selected, uint8_t *taken)
+    {
+        size_t lanes = 0;
+        for (size_t at = 0; at < regs.width; at += block_lanes) {
+            block set = equal(bit_and(load(regs.sreg() + at), splat(flag)), splat(flag));
+            block clear = and_not(set, load(selected + at));
+            store(taken + at, clear);
+            lanes += count(clear);
+        }
+        return lanes;
+    }
+
+}
+
+namespace simulator {
+
+    // The lanes of a lockstep run. Those which are running together, or waiting to, have their
+    // registers and SREG in `regs` rather than in their simulator's memory.
+    struct lockstep_lanes
+    {
+        lockstep_lanes(const std::vector<simulator_impl *> & sims, const std::vector<uint64_t> & limits)
+            : sims(sims)
+            , limits(limits)
+            , regs(sims.size())
+            , packed(sims.size())
+            , selected(regs.width)
+            , taken(regs.width)
+        {}
+
+        void pack(size_t k)
+        {
+            if (packed[k]) {
+                return;
+            }
+            auto & lane = *sims[k];
+            lane.sync_sreg();
+            for (unsigned r = 0; r < 32; ++r) {
+                regs.reg(r)[k] = lane.memory[r];
+            }
+            regs.sreg()[k] = lane.sreg();
+            packed[k] = 1;
+        }
+
+        void unpack(size_t k)
+        {
+            if (!packed[k]) {
+                return;
+            }
+            auto & lane = *sims[k];
+            for (unsigned r = 0; r < 32; ++r) {
+                lane.memory[r] = regs.reg(r)[k];
+            }
+            lane.sreg() = regs.sreg()[k];
+            packed[k] = 0;
+        }
+
+        const std::vector<simulator_impl *> &   sims;
+        const std::vector<uint64_t> &           limits;
+        lane_registers                          regs;
+        std::vector<uint8_t>                    packed;
+        std::vector<uint8_t>                    selected;   // 0xFF for the lanes running together
+        std::vector<uint8_t>                    taken;      // 0xFF where they take a branch
+    };
+
+}
+
+std::vector<stop_reason> simulator_impl::run_lockstep(
+    const std::vector<simulator_impl *> & sims, const std::vector<uint64_t> & limits)
+{
+    lockstep_lanes lanes(sims, limits);
+    std::vector<stop_reason> reasons(sims.size());
+    std::vector<size_t> running(sims.size());
+    std::iota(running.begin(), running.end(), 0);
+    std::vector<address_t> waiting;
+
+    // Cycles a lane runs on its own for before it gives up on meeting the others, and the most it
+    // runs on its own for while the lanes keep going separate ways
+    constexpr uint64_t stretch = 1 << 12;
+    constexpr uint64_t longest_stretch = 1 << 16;
+
+    // Moving registers in and out of the lanes costs about as much as running this many cycles of
+    // instructions on their own. Runs together which are shorter than that are not worth it.
+    constexpr uint64_t worth_running_together = 64;
+
+    address_t meet_at = no_address;     // where the last lanes to run together started
+    uint64_t alone_for = 0;             // while the lanes have gone separate ways
+    while (!running.empty()) {
+        // Lanes which cannot run in lockstep yet run on their own until they can
+        auto finished = std::remove_if(running.begin(), running.end(), [&](size_t k) {
+            auto & lane = *sims[k];
+            if (!alone_for && lane.ready_for_lockstep(limits[k])) {
+                return false;
+            }
+            lanes.unpack(k);
+            auto give_up = lane.cycle_count + (alone_for ? alone_for : meet_at != no_address ? stretch : 0);
+            return !lane.run_alone(limits[k], meet_at, give_up, reasons[k]);
+        });
+        running.erase(finished, running.end());
+        if (running.empty()) {
+            break;
+        }
+
+        // Every lane left is ready; take the instruction the most of them are at
+        waiting.clear();
+        for (auto k : running) {
+            waiting.push_back(sims[k]->pc);
+        }
+        std::sort(waiting.begin(), waiting.end());
+        address_t start = waiting.front();
+        size_t most = 0;
+        for (auto at = waiting.begin(); at != waiting.end();) {
+            auto end = std::upper_bound(at, waiting.end(), *at);
+            if (size_t(end - at) > most) {
+                start = *at;
+                most = end - at;
+            }
+            at = end;
+        }
+
+        bool separate = most < 2 || most * 4 < running.size();
+        if (!separate) {
+            auto leader = running.front();
+            std::fill(lanes.selected.begin(), lanes.selected.end(), 0);
+            for (auto k : running) {
+                if (sims[k]->pc == start) {
+                    lanes.pack(k);
+                    lanes.selected[k] = 0xFF;
+                    leader = k;
+                }
+            }
+
+            // If they soon have to run on their own again, they might as well keep to that
+            auto ran = run_together(lanes, start);
+            separate = ran < worth_running_together && !sims[leader]->ready_for_lockstep(limits[leader]);
+        }
+        if (separate) {
+            meet_at = no_address;
+            alone_for = alone_for ? std::min(2 * alone_for, longest_stretch) : stretch;
+        } else {
+            meet_at = start;
+            alone_for = 0;
+        }
+    }
+    return reasons;
+}
+
+bool simulator_impl::runs_in_lockstep(const instruction & instr) const
+{
+    switch (instr.op) {
+    case ADD:
+    case ADC:
+    case EOR:
+    case CP:
+    case CPI:
+    case LDI:
+    case BRGE:
+    case BRNE:
+    case RJMP:
+    case JMP:
+        return instr.size != 0;
+    case LDS:
+    case STS:
+        {
+            // Only plain memory, not the registers or an I/O register with side effects
+            auto address = instr.args.reg_address.address;
+            return instr.size != 0 && address >= io_begin && !has_side_effects(address);
+        }
+    default:
+        return false;
+    }
+}
+
+// Whether the next instruction can run in lockstep. It has to finish before the next event, which
+// is the only way an interrupt can become due. Idle loops are left to the lane, which skips them.
+bool simulator_impl::ready_for_lockstep(uint64_t limit) const
+{
+    auto & instr = decoded[pc];
+    auto & timing = timings[index_of(instr.op)];
+    return runs_in_lockstep(instr) && idle_loops[pc].kind == idle_loop::none && !sleeping &&
+        !interrupt_due() && cycle_count < limit &&
+        cycle_count + std::max(timing.cycles, timing.taken) < events.deadline();
+}
+
+// Run until the lane is ready to run in lockstep at `meet_at`, or at any instruction once the cycle
+// counter reaches `give_up`. Returns false if it finishes first, with the reason it stopped in
+// `finished`.
+bool simulator_impl::run_alone(
+    uint64_t limit, address_t meet_at, uint64_t give_up, stop_reason & finished)
+{
+    stepping = false;
+    run_limit = limit;
+    auto until = std::min(limit, give_up);
+    while (!(pc == meet_at || cycle_count >= give_up) || !ready_for_lockstep(limit)) {
+        if (cycle_count >= limit) {
+            finished = reason(stop_kind::cycle_limit);
+            return false;
+        }
+        // Without anywhere to meet, run just as up to a cycle limit
+        if (meet_at == no_address && cycle_count < until) {
+            auto stopped = run_until_cycle(until);
+            if (stopped.kind != stop_kind::cycle_limit) {
+                finished = stopped;
+                return false;
+            }
+            continue;
+        }
+        auto kind = run_until([this, meet_at, until]() { return pc == meet_at || cycle_count >= until; });
+        if (kind != stop_kind::done) {
+            finished = reason(kind);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Run the selected lanes, which are all ready at `start`, in lockstep for as long as they can: up to
+// the limit of any one of them, not past the next event of any, and until an instruction which cannot
+// run in lockstep. A branch which goes different ways for different lanes leaves each where its own
+// way takes it. Returns the number of cycles they ran for together.
+uint64_t simulator_impl::run_together(lockstep_lanes & lanes, address_t start)
+{
+    auto before_limit = std::numeric_limits<uint64_t>::max();
+    auto before_event = std::numeric_limits<uint64_t>::max();
+    size_t together = 0;
+    for (size_t k = 0; k < lanes.sims.size(); ++k) {
+        if (lanes.selected[k]) {
+            auto & lane = *lanes.sims[k];
+            before_limit = std::min(before_limit, lanes.limits[k] - lane.cycle_count);
+            before_event = std::min(before_event, lane.events.deadline() - lane.cycle_count);
+            ++together;
+        }
+    }
+
+    // Every lane runs the same program, with no breakpoints
+    auto & first = *lanes.sims.front();
+    auto decoded = first.decoded;
+    auto idle_loops = first.idle_loops;
+    auto & timings = first.timings;
+    auto pc_mask = first.pc_mask;
+
+    uint64_t elapsed = 0;
+    address_t pc = start;
+    while (elapsed < before_limit) {
+        auto & instr = decoded[pc];
+        auto & timing = timings[index_of(instr.op)];
+        if (!first.runs_in_lockstep(instr) || idle_loops[pc].kind != idle_loop::none ||
+            elapsed + std::max(timing.cycles, timing.taken) >= before_event) {
+            break;
+        }
+
+        address_t next = (pc + instr.size) & pc_mask;
+        switch (instr.op) {
+        case LDS:
+        case STS:
+            for (size_t k = 0; k < lanes.sims.size(); ++k) {
+                if (lanes.selected[k]) {
+                    auto & lane = *lanes.sims[k];
+                    auto reg = lanes.regs.reg(instr.args.reg_address.reg) + k;
+                    if (instr.op == LDS) {
+                        *reg = lane.memory[instr.args.reg_address.address];
+                    } else {
+                        lane.store(instr.args.reg_address.address, *reg);
+                    }
+                }
+            }
+            elapsed += timing.cycles;
+            pc = next;
+            break;
+        case RJMP:
+            elapsed += timing.cycles;
+            pc = (next + instr.args.offset12.offset) & pc_mask;
+            break;
+        case JMP:
+            elapsed += timing.cycles;
+            pc = instr.args.address.address & pc_mask;
+            break;
+        case BRGE:
+        case BRNE:
+            {
+                auto flag = instr.op == BRNE ? SREG_Z : SREG_S;
+                auto taken = clear_in(lanes.regs, flag, lanes.selected.data(), lanes.taken.data());
+                address_t target = (next + instr.args.offset.offset) & pc_mask;
+                if (taken == together) {
+                    elapsed += timing.taken;
+                    pc = target;
+                } else if (taken == 0) {
+                    elapsed += timing.cycles;
+                    pc = next;
+                } else {
+                    for (size_t k = 0; k < lanes.sims.size(); ++k) {
+                        if (lanes.selected[k]) {
+                            auto & lane = *lanes.sims[k];
+                            lane.pc = lanes.taken[k] ? target : next;
+                            lane.cycle_count += elapsed + (lanes.taken[k] ? timing.taken : timing.cycles);
+                        }
+                    }
+                    return elapsed;
+                }
+                break;
+            }
+        default:
+            run_selected(lanes.regs, instr, lanes.selected.data());
+            elapsed += timing.cycles;
+            pc = next;
+            break;
+        }
+    }
+
+    for (size_t k = 0; k < lanes.sims.size(); ++k) {
+        if (lanes.selected[k]) {
+            auto & lane = *lanes.sims[k];
+            lane.pc = pc;
+            lane.cycle_count += elapsed;
+        }
+    }
+    return elapsed;
+}
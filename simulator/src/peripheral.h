@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "types.h"
+
+namespace simulator {
+
+    // A device on the data bus, such as a timer. Rather than being updated on every cycle,
+    // peripherals work their registers out from the cycle counter when firmware reads them, and use
+    // the scheduler for anything which has to happen at a particular time.
+    struct peripheral
+    {
+        virtual ~peripheral() {}
+
+        // Data-space addresses of the registers the peripheral owns
+        virtual std::vector<address_t> registers() const = 0;
+
+        // Bring a register up to date before it is read at `cycle`
+        virtual void read(address_t address, uint64_t cycle) = 0;
+
+        // What a register holds at `cycle`, for a debugger. Unlike read, this changes nothing:
+        // reading UDR0, for one, would take a byte out of the receive buffer.
+        virtual byte_t peek(address_t address, uint64_t cycle) const = 0;
+
+        // React to firmware having written a register at `cycle`
+        virtual void write(address_t address, uint64_t cycle) = 0;
+
+        // The CPU has started to handle an interrupt the peripheral requested. Flags which the
+        // hardware clears on entry to the handler should be cleared here.
+        virtual void acknowledge(unsigned /* vector */, uint64_t /* cycle */) {}
+
+        // Whether an event the peripheral has scheduled can raise an interrupt which firmware has
+        // enabled. Interrupts which are already requested are pending in the controller instead.
+        virtual bool can_interrupt() const { return false; }
+
+        // The I/O clock has been stopped or started at `cycle`, by a sleep mode deeper than Idle
+        virtual void io_clock(bool /* running */, uint64_t /* cycle */) {}
+
+        // Copy whatever the peripheral keeps outside of the data space, for a snapshot, and put a
+        // copy back
+        virtual std::shared_ptr<const void> save() const = 0;
+        virtual void restore(const void *saved) = 0;
+
+    protected:
+        // save and restore, for peripherals which keep that state in one copyable member
+        template<typename T>
+        static std::shared_ptr<const void> save_copy(const T & value)
+        {
+            return std::make_shared<T>(value);
+        }
+
+        template<typename T>
+        static void restore_copy(T & value, const void *saved)
+        {
+            value = *static_cast<const T *>(saved);
+        }
+    };
+
+}
@@ -0,0 +1,63 @@
+#include "port.h"
+
+using namespace simulator;
+
+// Passed by reference to make_unique, so they need definitions before C++17
+constexpr address_t port::PINB;
+constexpr address_t port::PINC;
+constexpr address_t port::PIND;
+
+port::port(avr::data_space & memory_, address_t pin_address)
+    : memory(memory_)
+    , pin(pin_address)
+    , ddr(pin_address + 1)
+    , out(pin_address + 2)
+{}
+
+std::vector<address_t> port::registers() const
+{
+    return {pin, ddr, out};
+}
+
+void port::read(address_t address, uint64_t)
+{
+    if (address == pin) {
+        memory[pin] = levels();
+    }
+}
+
+byte_t port::peek(address_t address, uint64_t) const
+{
+    return address == pin ? levels() : memory[address];
+}
+
+void port::write(address_t address, uint64_t)
+{
+    if (address == pin) {
+        memory[out] ^= memory[pin];
+        memory[pin] = levels();
+    }
+}
+
+byte_t port::levels() const
+{
+    byte_t outputs = memory[ddr];
+    byte_t inputs = (driven.mask & driven.levels) | (~driven.mask & memory[out]);
+    return (outputs & memory[out]) | (~outputs & inputs);
+}
+
+void port::drive(byte_t mask, byte_t value)
+{
+    driven.mask = mask;
+    driven.levels = value;
+}
+
+std::shared_ptr<const void> port::save() const
+{
+    return save_copy(driven);
+}
+
+void port::restore(const void *saved)
+{
+    restore_copy(driven, saved);
+}
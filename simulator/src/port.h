@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "avr/core.h"
+#include "peripheral.h"
+#include "types.h"
+
+namespace simulator {
+
+    // A digital I/O port, such as port B: the PINx, DDRx and PORTx registers at three consecutive
+    // addresses. Pins set as outputs by DDRx are driven to the level in PORTx. Inputs read as the
+    // level applied from outside, or high if nothing drives them and the pull-up is on. Writing ones
+    // to PINx toggles those bits of PORTx.
+    struct port
+        : peripheral
+    {
+        // Data-space address of PINx for ports B, C and D. DDRx and PORTx follow it.
+        static constexpr address_t PINB = 0x23;
+        static constexpr address_t PINC = 0x26;
+        static constexpr address_t PIND = 0x29;
+
+        port(avr::data_space & memory, address_t pin_address);
+
+        std::vector<address_t> registers() const override;
+        void read(address_t address, uint64_t cycle) override;
+        byte_t peek(address_t address, uint64_t cycle) const override;
+        void write(address_t address, uint64_t cycle) override;
+        std::shared_ptr<const void> save() const override;
+        void restore(const void *saved) override;
+
+        // The level on each pin
+        byte_t levels() const;
+
+        // Drive the pins in `mask` from outside, to the levels in `value`. Pins outside the mask
+        // are left floating.
+        void drive(byte_t mask, byte_t value);
+
+    private:
+        avr::data_space &       memory;
+        address_t               pin;
+        address_t               ddr;
+        address_t               out;
+
+        // Pins driven from outside
+        struct drive_state
+        {
+            byte_t              mask = 0;
+            byte_t              levels = 0;
+        };
+
+        drive_state             driven;
+    };
+
+}
@@ -0,0 +1,37 @@
+#include <utility>
+
+#include "scheduler.h"
+
+using namespace simulator;
+
+scheduler::event_id scheduler::schedule(uint64_t cycle, callback fn)
+{
+    auto id = next_id++;
+    queue.push({cycle, id, std::move(fn)});
+    update_deadline();
+    return id;
+}
+
+void scheduler::cancel(event_id id)
+{
+    // Removing from the middle of a heap is awkward, so the event is skipped when it comes up
+    cancelled.insert(id);
+}
+
+void scheduler::run_due(uint64_t cycle)
+{
+    while (!queue.empty() && queue.top().cycle <= cycle) {
+        auto e = queue.top();
+        queue.pop();
+        if (cancelled.erase(e.id)) {
+            continue;
+        }
+        e.fn(e.cycle);
+    }
+    update_deadline();
+}
+
+void scheduler::update_deadline()
+{
+    next_deadline = queue.empty() ? std::numeric_limits<uint64_t>::max() : queue.top().cycle;
+}
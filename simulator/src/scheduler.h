@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <unordered_set>
+#include <vector>
+
+namespace simulator {
+
+    // Things which have to happen at a particular clock cycle, such as a timer overflowing. The
+    // engines run straight through to the next deadline, and only then hand over to the scheduler.
+    struct scheduler
+    {
+        // Called with the cycle the event was due on, which may be a little earlier than the cycle
+        // counter if an instruction ran past it
+        using callback = std::function<void(uint64_t cycle)>;
+        using event_id = uint64_t;
+
+        // Run `fn` once the cycle counter reaches `cycle`
+        event_id schedule(uint64_t cycle, callback fn);
+
+        // Forget an event which has not run yet
+        void cancel(event_id id);
+
+        // Cycle of the earliest pending event, or the largest possible cycle if there are none
+        uint64_t deadline() const
+        {
+            return next_deadline;
+        }
+
+        // Run every event due by `cycle`, earliest first. Events may schedule more events.
+        void run_due(uint64_t cycle);
+
+    private:
+        struct event
+        {
+            uint64_t    cycle;
+            event_id    id;
+            callback    fn;
+        };
+
+        // Orders the queue earliest first, and events due on the same cycle in the order they were
+        // scheduled
+        struct later
+        {
+            bool operator()(const event & a, const event & b) const
+            {
+                return a.cycle > b.cycle || (a.cycle == b.cycle && a.id > b.id);
+            }
+        };
+
+        void update_deadline();
+
+        std::priority_queue<event, std::vector<event>, later> queue;
+        std::unordered_set<event_id>    cancelled;      // still in the queue, but not to be run
+        event_id                        next_id = 0;
+        uint64_t                        next_deadline = std::numeric_limits<uint64_t>::max();
+    };
+
+}
@@ -1,23 +1,17 @@
 #include "segment.h"
 #include "elfio/elfio.hpp"
+#include <algorithm>
 #include <vector>
 
 using namespace simulator;
 
 struct segment_impl : segment {
 
-    segment_impl(std::string path, simulator::section_type_t section_type)
+    segment_impl(const ELFIO::elfio & reader, simulator::section_type_t section_type)
     {
-        ELFIO::elfio reader;
-        if (!reader.load(path)) {
-            std::cout << "loading file failed" << std::endl;
-        } else {
-            std::cout << "successfully loaded " << path << std::endl;
-        }
-
         // TODO: THIS IS BAD!!! relies on the segments being ordered the same
         // way each time.  Eventually we should fis this.
-        ELFIO::segment* elf_segment;
+        ELFIO::segment* elf_segment = nullptr;
         switch (section_type) {
             case TEXT:
                 elf_segment = reader.segments[0];
@@ -30,6 +24,9 @@ struct segment_impl : segment {
                 break;
             default:
                 std::cout << "ERROR: no name for this type" << std::endl;
+                size_ = 0;
+                address_ = 0;
+                return;
         }
 
         const char* segment_start = elf_segment->get_data();
@@ -67,11 +64,77 @@ private:
 };
 
 
+static void load_elf(ELFIO::elfio & reader, const std::string & path)
+{
+    if (!reader.load(path)) {
+        std::cout << "loading file failed" << std::endl;
+    } else {
+        std::cout << "successfully loaded " << path << std::endl;
+    }
+}
+
 std::unique_ptr<simulator::segment> simulator::map_segment(
     std::string fname, simulator::section_type_t section)
 {
-    return std::make_unique<segment_impl>(fname, section);
+    ELFIO::elfio reader;
+    load_elf(reader, fname);
+    return std::make_unique<segment_impl>(reader, section);
+}
+
+std::vector<std::unique_ptr<simulator::segment>> simulator::map_segments(std::string fname)
+{
+    ELFIO::elfio reader;
+    load_elf(reader, fname);
+
+    std::vector<std::unique_ptr<segment>> segments;
+    for (auto section : {DATA, TEXT, BSS}) {
+        segments.push_back(std::make_unique<segment_impl>(reader, section));
+    }
+    return segments;
 }
 
+std::map<std::string, symbol> simulator::read_symbols(std::string fname)
+{
+    std::map<std::string, symbol> found_symbols;
+    ELFIO::elfio reader;
+    if (!reader.load(fname)) {
+        return found_symbols;
+    }
 
+    for (auto section : reader.sections) {
+        if (section->get_type() != SHT_SYMTAB) {
+            continue;
+        }
+        ELFIO::symbol_section_accessor symbols(reader, section);
+        for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); ++i) {
+            std::string symbol_name;
+            ELFIO::Elf64_Addr symbol_value = 0;
+            ELFIO::Elf_Xword symbol_size = 0;
+            unsigned char bind = 0, type = 0, other = 0;
+            ELFIO::Elf_Half section_index = 0;
+            bool found = symbols.get_symbol(
+                i, symbol_name, symbol_value, symbol_size, bind, type, section_index, other);
+            // Where a name appears twice, the first one is kept
+            if (found && !symbol_name.empty()) {
+                found_symbols.emplace(symbol_name, symbol{symbol_value, symbol_size});
+            }
+        }
+    }
+    return found_symbols;
+}
 
+void simulator::load_flash(
+    std::vector<uint16_t> & flash, const segment & text, const std::vector<segment *> & other_segs)
+{
+    auto text_it = flash.begin();
+    std::advance(text_it, text.address());
+    auto text_words = text.data<uint16_t>();
+    std::copy(text_words, text_words + text.count<uint16_t>(), text_it);
+
+    for (auto other_seg : other_segs) {
+        auto flash_it = flash.begin();
+        std::advance(flash_it, other_seg->address());
+        auto data_words = other_seg->data<uint16_t>();
+        std::copy(data_words, data_words + other_seg->count<uint16_t>(), flash_it);
+    }
+}
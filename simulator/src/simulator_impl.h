@@ -0,0 +1,1330 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "avr/boards.h"
+#include "avr/core.h"
+#include "avr/instruction.h"
+#include "avr/register.h"
+#include "avr/timing.h"
+#include "interrupts.h"
+#include "jit.h"
+#include "peripheral.h"
+#include "port.h"
+#include "scheduler.h"
+#include "segment.h"
+#include "simulator.h"
+#include "timer0.h"
+#include "usart0.h"
+
+// Invokes X(op) for every opcode in avr::opcode which the simulator can execute
+#define SIMULATOR_OPCODES(X) \
+    X(ADIW) X(SBIW) X(CALL) X(RCALL) X(RET) X(JMP) X(STS) X(CP) X(CPC) X(ADD) X(ADC) X(LDI) \
+    X(CPI) X(LDS) X(BRGE) X(BRNE) X(RJMP) X(EOR) X(IN) X(OUT) X(LPM) X(STX) X(PUSH) X(POP) \
+    X(RETI) X(SEI) X(CLI) X(SUBI) X(SLEEP)
+
+namespace simulator {
+
+    // Dense numbering of the opcodes in SIMULATOR_OPCODES, for tables indexed by opcode
+    enum opcode_index
+        : uint8_t
+    {
+#define OPCODE_INDEX(op) op##_INDEX,
+        SIMULATOR_OPCODES(OPCODE_INDEX)
+#undef OPCODE_INDEX
+        OPCODE_COUNT
+    };
+
+    constexpr opcode_index index_of(avr::opcode op)
+    {
+        switch (op) {
+#define OPCODE_INDEX(op) \
+        case avr::op: \
+            return op##_INDEX;
+
+        SIMULATOR_OPCODES(OPCODE_INDEX)
+#undef OPCODE_INDEX
+        default:
+            return OPCODE_COUNT;
+        }
+    }
+
+    // Stands in for the instruction at a breakpoint in the table of decoded instructions. Every opcode
+    // has its operand bits clear, so no instruction decodes to this.
+    constexpr avr::opcode TRAP = static_cast<avr::opcode>(0xFFFF);
+
+    // Selects the overload of simulator_impl::execute which implements a particular opcode
+    template<avr::opcode op>
+    struct opcode_tag
+    {};
+
+    // Loops which spin until an interrupt changes something, such as the one in delay(), can be
+    // skipped to the next event instead of being run, and countdown loops such as the ones in
+    // _delay_ms() can be worked out in one go
+    struct idle_loop
+    {
+        enum kind_t
+            : uint8_t
+        {
+            none,
+            wait,       // reads memory until an event changes it
+            countdown,  // sbiw or subi, then brne back to it
+        };
+
+        kind_t      kind = none;
+        address_t   end = 0;            // the jump back to the start
+        uint32_t    worst_cycles = 0;   // longest an iteration can take
+    };
+
+    // Hit counts of jumps, for coverage-guided fuzzing. A jump is counted at the entry for where it
+    // goes from and to; counts wrap around. The entries which have been hit since the last clear()
+    // are listed in `touched`, so that they can be read and cleared without going through the map.
+    struct edge_counts
+    {
+        static constexpr size_t size = 1 << 14;
+
+        void hit(size_t entry)
+        {
+            if (!hits[entry]++) {
+                touched.push_back(entry);
+            }
+        }
+
+        void clear()
+        {
+            for (auto entry : touched) {
+                hits[entry] = 0;
+            }
+            touched.clear();
+        }
+
+        std::array<uint8_t, size>       hits = {};
+        std::vector<uint16_t>           touched;    // an entry can be listed twice if its count wraps
+    };
+
+    // A program loaded into flash, and everything worked out from it. It never changes once it is
+    // made, so any number of simulators, on any threads, can share one.
+    struct program_image
+    {
+        program_image(const avr::board & board_)
+            // One word of padding, as in avr::core
+            : board(board_)
+            , flash(board_.flash_end + 1)
+            , decoded(board_.flash_end)
+        {}
+
+        const avr::board &              board;
+        std::vector<uint16_t>           flash;
+        std::vector<avr::instruction>   decoded;    // with a size of 0 where there is no instruction
+        std::vector<idle_loop>          idle_loops; // indexed by the address the loop starts at
+    };
+
+    // Everything outside of avr::state which changes as the program runs
+    struct device_state
+    {
+        scheduler                       events;
+        interrupt_controller            interrupts;
+        uint64_t                        enabled_at;
+        bool                            sleeping;
+        bool                            io_clock_running;
+        std::vector<std::shared_ptr<const void>> peripherals;
+    };
+
+    struct saved_state
+    {
+        const simulator *               owner;
+        std::unique_ptr<avr::state>     machine;
+        uint64_t                        epoch;      // pages written at or after this have changed
+        device_state                    devices;
+    };
+
+    // How to go back over one step: what it changed, as it was before
+    struct undo_record
+    {
+        uint64_t                        cycle_count;
+        address_t                       pc;
+        avr::flag_record                last_flags;
+        std::array<byte_t, 0x100>       low;        // the registers and I/O space
+        std::vector<std::pair<address_t, byte_t>> stores;  // SRAM bytes, in the order they were stored to
+        device_state                    devices;
+    };
+
+    // The state of a lockstep run, shared by its lanes. Defined in lockstep.cpp.
+    struct lockstep_lanes;
+
+    struct simulator_impl
+        : simulator
+        , avr::core
+    {
+        simulator_impl(std::shared_ptr<const program_image> image, engine engine_)
+            : core(image->flash.data(), image->decoded.size())
+            , program(std::move(image))
+            , decoded(program->decoded.data())
+            , selected_engine(engine_)
+            , io_owners(io_end, nullptr)
+            , vector_words(program->board.vector_words)
+            , idle_loops(program->idle_loops.data())
+        {
+#define OPCODE_TIMING(op) \
+            timings[op##_INDEX] = program->board.instruction_timing(avr::op);
+
+            SIMULATOR_OPCODES(OPCODE_TIMING)
+#undef OPCODE_TIMING
+
+            interrupts.raised = [this]() {
+                if (sreg() & avr::SREG_I) {
+                    return_at(cycle_count);
+                }
+            };
+            attach(std::make_unique<timer0>(memory, events, interrupts));
+            ports[0] = attach(std::make_unique<port>(memory, port::PINB));
+            ports[1] = attach(std::make_unique<port>(memory, port::PINC));
+            ports[2] = attach(std::make_unique<port>(memory, port::PIND));
+            usart = attach(std::make_unique<usart0>(memory, interrupts));
+
+            // The I/O registers hold their reset values, which the peripherals have set, and the stack
+            // pointer starts at RAMEND, the last byte of the SRAM after the I/O space
+            set_word_at(avr::reg::SPL, io_end + program->board.ram_end - 1);
+            std::copy(memory.begin(), memory.begin() + page_size, low_at_load.begin());
+            devices_at_load = save_devices();
+            power_on();
+        }
+
+        // Load a program into flash and decode it, for simulators to share
+        static std::shared_ptr<const program_image> load(
+            const avr::board & board, const segment & text, const std::vector<segment *> & other_segs)
+        {
+            auto image = std::make_shared<program_image>(board);
+            load_flash(image->flash, text, other_segs);
+
+            // Flash never changes once it is loaded, so decode every word up front. Words which do not
+            // hold a valid instruction (data, or the second word of a two-word instruction) are marked
+            // with a size of 0 and only reported if execution actually reaches them.
+            for (size_t i = 0; i < image->decoded.size(); ++i) {
+                if (!avr::try_decode(&image->flash[i], image->decoded[i])) {
+                    image->decoded[i].size = 0;
+                }
+            }
+
+            // Which loops are idle depends on the registers the peripherals own, which takes a
+            // simulator to know
+            image->idle_loops = simulator_impl(image, engine::switched).find_idle_loops();
+            return image;
+        }
+
+        // Run simulators of one image side by side, each until it stops or reaches its cycle limit.
+        // Those at the same instruction run it together, if it is one of the few which can be. The
+        // simulators must not have breakpoints. Defined in lockstep.cpp.
+        static std::vector<stop_reason> run_lockstep(
+            const std::vector<simulator_impl *> & lanes, const std::vector<uint64_t> & limits);
+
+        // A breakpoint replaces the decoded instruction with a trap, so running costs nothing extra
+        // until one is reached. The image is shared, so the traps go in a copy of its instructions.
+        // Addresses wrap around the end of flash, as the program counter does.
+        void set_breakpoint(address_t address) override
+        {
+            address &= pc_mask;
+            if (breakpoints.emplace(address, decoded[address]).second) {
+                if (patched.empty()) {
+                    patched = program->decoded;
+                    decoded = patched.data();
+                }
+                patched[address].op = TRAP;
+                dispatch_changed();
+            }
+        }
+
+        void delete_breakpoint(address_t address) override
+        {
+            address &= pc_mask;
+            auto found = breakpoints.find(address);
+            if (found != breakpoints.end()) {
+                patched[address] = found->second;
+                breakpoints.erase(found);
+                if (breakpoints.empty()) {
+                    decoded = program->decoded.data();
+                    patched = std::vector<avr::instruction>();
+                }
+                dispatch_changed();
+            }
+        }
+
+        void set_watchpoint(address_t address) override
+        {
+            watchpoints.insert(address);
+            watch_stores();
+        }
+
+        void delete_watchpoint(address_t address) override
+        {
+            watchpoints.erase(address);
+            watch_stores();
+        }
+
+        // Stop with a stack overflow once the stack pointer goes below `limit`, or never if it is 0.
+        // It is checked on each store, which includes every push.
+        void set_stack_limit(address_t limit)
+        {
+            stack_limit = limit;
+            watch_stores();
+        }
+
+        // Count each jump, call, return and branch in `edges`, or stop counting if it is null
+        void record_edges(edge_counts *edges_)
+        {
+            edges = edges_;
+        }
+
+        byte_t read(address_t address) const override
+        {
+            if (address == avr::reg::SREG) {
+                return sreg_value();
+            }
+            if (address < io_end && io_owners[address]) {
+                return io_owners[address]->peek(address, cycle_count);
+            }
+            return memory[address];
+        }
+
+        avr::instruction next_instruction() const override
+        {
+            auto & instr = instruction_at(pc);
+            if (!instr.size) {
+                throw avr::invalid_instruction_error(&flash[pc]);
+            }
+            return instr;
+        }
+
+        stop_reason step() override
+        {
+            stepping = true;
+            run_limit = std::numeric_limits<uint64_t>::max();
+            if (!keeping_history) {
+                return reason(run_until([]() { return true; }));
+            }
+
+            // Log the step so that it can be undone, unless it did nothing
+            going_forward();
+            auto before = cycle_count;
+            log_step();
+            auto kind = run_until([]() { return true; });
+            log_stores(false);
+            if (cycle_count == before) {
+                undo_log.pop_back();
+            }
+            if (cycle_count >= next_checkpoint()) {
+                take_checkpoint();
+            }
+            return reason(kind);
+        }
+
+        stop_reason step(uint64_t count) override
+        {
+            if (!count) {
+                return reason(stop_kind::done);
+            }
+            stepping = true;
+            run_limit = std::numeric_limits<uint64_t>::max();
+            return reason(run_recorded([&count]() { return --count == 0; }));
+        }
+
+        stop_reason next() override
+        {
+            auto & instr = instruction_at(pc);
+            stepping = true;
+            run_limit = std::numeric_limits<uint64_t>::max();
+            switch (instr.op) {
+            case avr::CALL:
+                {
+                    address_t after = (pc + instr.size) & pc_mask;
+                    return reason(run_recorded([this, after]() { return pc == after; }));
+                }
+            default:
+                return reason(run_recorded([]() { return true; }));
+            }
+        }
+
+        stop_reason run() override
+        {
+            stepping = false;
+            run_limit = std::numeric_limits<uint64_t>::max();
+            if (translating()) {
+                return reason(run_jit_recorded(std::numeric_limits<uint64_t>::max()));
+            }
+            return reason(run_recorded([]() { return false; }));
+        }
+
+        stop_reason run_until_pc(address_t address) override
+        {
+            stepping = false;
+            run_limit = std::numeric_limits<uint64_t>::max();
+            run_to = address;
+            auto kind = run_recorded([this, address]() { return pc == address; });
+            run_to = no_address;
+            return reason(kind);
+        }
+
+        uint64_t cycles() const override
+        {
+            return cycle_count;
+        }
+
+        void drive_pins(char port_name, byte_t mask, byte_t levels) override
+        {
+            if (port_name < 'B' || port_name > 'D') {
+                throw std::invalid_argument(std::string("no port ") + port_name);
+            }
+            ports[port_name - 'B']->drive(mask, levels);
+            host_changed_state();
+        }
+
+        void serial_receive(const std::vector<byte_t> & bytes) override
+        {
+            usart->receive(bytes);
+            host_changed_state();
+        }
+
+        std::vector<byte_t> serial_transmitted() override
+        {
+            auto bytes = usart->take_transmitted();
+            host_changed_state();
+            return bytes;
+        }
+
+        snapshot_handle snapshot() override
+        {
+            // Writes so far are older than the snapshot
+            note_written_pages();
+            ++write_epoch;
+
+            auto saved = std::make_shared<saved_state>();
+            saved->owner = this;
+            saved->machine = std::make_unique<avr::state>(static_cast<const avr::state &>(*this));
+            saved->epoch = write_epoch;
+            saved->devices = save_devices();
+            return saved;
+        }
+
+        void restore(const snapshot_handle & saved) override
+        {
+            if (!saved || saved->owner != this) {
+                throw std::invalid_argument("snapshot is not of this simulator");
+            }
+            load_snapshot(*saved);
+
+            // There is no telling how the snapshot relates to the history, so it starts again here
+            if (keeping_history) {
+                start_history();
+            }
+        }
+
+        // SRAM is clear after load, so the pages written since the load or the last reset are cleared,
+        // and the CPU and peripherals go back to their state at power on
+        void reset() override
+        {
+            note_written_pages();
+            ++write_epoch;
+
+            power_on();
+            for (size_t page = 1; page < page_stamps.size(); ++page) {
+                if (page_stamps[page] >= loaded_epoch) {
+                    std::fill_n(memory.begin() + page*page_size, page_size, 0);
+                    page_stamps[page] = write_epoch;
+                }
+            }
+            restore_devices(devices_at_load);
+
+            // The pages just cleared are as they were at load, but have changed since any snapshot
+            loaded_epoch = ++write_epoch;
+            if (keeping_history) {
+                start_history();
+            }
+        }
+
+        // Defined in history.cpp
+        void keep_history(bool keep) override;
+        stop_reason reverse_step() override;
+        stop_reason reverse_continue() override;
+
+        stop_reason run_for(uint64_t cycles) override
+        {
+            return run_until_cycle(cycle_count + cycles);
+        }
+
+        stop_reason run_until_cycle(uint64_t cycle) override
+        {
+            if (cycle_count >= cycle) {
+                return reason(stop_kind::cycle_limit);
+            }
+            stepping = false;
+            run_limit = cycle;
+            auto kind = translating()
+                ? run_jit_recorded(cycle)
+                : run_recorded([this, cycle]() { return cycle_count >= cycle; });
+            return reason(kind == stop_kind::done ? stop_kind::cycle_limit : kind);
+        }
+
+        // Run until the program counter comes to `address`, or the cycle counter reaches `cycle`
+        stop_reason run_until_pc_or_cycle(address_t address, uint64_t cycle)
+        {
+            stepping = false;
+            run_limit = cycle;
+            run_to = address;
+            auto kind = run_recorded([this, address, cycle]() {
+                return pc == address || cycle_count >= cycle;
+            });
+            run_to = no_address;
+            return reason(kind == stop_kind::done && pc != address ? stop_kind::cycle_limit : kind);
+        }
+
+        // Run until the function the pc is in returns, which is when the stack pointer rises above
+        // where it is now, or until the pc comes back here, or the cycle counter reaches `cycle`.
+        // Returning is reported as done.
+        stop_reason run_until_return_or_cycle(uint64_t cycle)
+        {
+            address_t address = pc;
+            address_t stack = word_at(avr::reg::SPL);
+            stepping = false;
+            run_limit = cycle;
+            run_to = address;
+            auto kind = run_recorded([this, address, stack, cycle]() {
+                return pc == address || word_at(avr::reg::SPL) > stack || cycle_count >= cycle;
+            });
+            run_to = no_address;
+            bool returned = pc == address || word_at(avr::reg::SPL) > stack;
+            return reason(kind == stop_kind::done && !returned ? stop_kind::cycle_limit : kind);
+        }
+
+    private:
+
+        // The CPU as it comes out of a reset, on load and on reset(): the pc and cycle counter at 0,
+        // and the registers and I/O space as they were saved at load
+        void power_on()
+        {
+            cycle_count = 0;
+            pc = 0;
+            last_flags = avr::flag_record();
+            std::copy(low_at_load.begin(), low_at_load.end(), memory.begin());
+            resume_from = no_address;
+        }
+
+        stop_reason reason(stop_kind kind) const
+        {
+            return {kind, pc, cycle_count};
+        }
+
+        void load_snapshot(const saved_state & saved)
+        {
+            note_written_pages();
+            ++write_epoch;
+
+            // The registers and I/O space are always copied. Other pages only need to be if they have
+            // been written since the snapshot, and once they are, they differ from any later one.
+            auto & machine = *saved.machine;
+            cycle_count = machine.cycle_count;
+            pc = machine.pc;
+            last_flags = machine.last_flags;
+            std::copy(machine.memory.begin(), machine.memory.begin() + page_size, memory.begin());
+            for (size_t page = 1; page < page_stamps.size(); ++page) {
+                if (page_stamps[page] >= saved.epoch) {
+                    auto from = machine.memory.begin() + page*page_size;
+                    std::copy(from, from + page_size, memory.begin() + page*page_size);
+                    page_stamps[page] = write_epoch;
+                }
+            }
+
+            restore_devices(saved.devices);
+        }
+
+        device_state save_devices() const
+        {
+            device_state saved;
+            saved.events = events;
+            saved.interrupts = interrupts;
+            saved.enabled_at = enabled_at;
+            saved.sleeping = sleeping;
+            saved.io_clock_running = io_clock_running;
+            for (auto & device : peripherals) {
+                saved.peripherals.push_back(device->save());
+            }
+            return saved;
+        }
+
+        void restore_devices(const device_state & saved)
+        {
+            events = saved.events;
+            interrupts = saved.interrupts;
+            enabled_at = saved.enabled_at;
+            sleeping = saved.sleeping;
+            io_clock_running = saved.io_clock_running;
+            for (size_t i = 0; i < peripherals.size(); ++i) {
+                peripherals[i]->restore(saved.peripherals[i].get());
+            }
+        }
+
+        // run_until, cut into pieces wherever a checkpoint is due if history is being kept
+        template<typename Stop>
+        stop_kind run_recorded(Stop stop)
+        {
+            if (!keeping_history) {
+                return run_until(stop);
+            }
+            going_forward();
+            undo_log.clear();
+
+            bool finished = false;
+            for (;;) {
+                auto due = next_checkpoint();
+                auto kind = run_until([&]() {
+                    finished = stop();
+                    return finished || cycle_count >= due;
+                });
+                if (kind != stop_kind::done || finished) {
+                    return kind;
+                }
+                take_checkpoint();
+                if (breakpoint_reached()) {
+                    return stop_kind::breakpoint;
+                }
+            }
+        }
+
+        // run_jit, cut into pieces in the same way
+        stop_kind run_jit_recorded(uint64_t deadline)
+        {
+            if (!keeping_history) {
+                return run_jit(deadline);
+            }
+            going_forward();
+            undo_log.clear();
+
+            for (;;) {
+                auto kind = run_jit(std::min(deadline, next_checkpoint()));
+                if (kind != stop_kind::done || cycle_count >= deadline) {
+                    return kind;
+                }
+                take_checkpoint();
+                if (breakpoint_reached()) {
+                    return stop_kind::breakpoint;
+                }
+            }
+        }
+
+        // Whether a run which was cut short here would have gone on to stop at a breakpoint, before
+        // executing anything else
+        bool breakpoint_reached() const
+        {
+            return breakpoint_at(pc) && pc != resume_from && !sleeping && !interrupt_due();
+        }
+
+        // History, for running backwards. Defined in history.cpp.
+        void start_history();
+        void going_forward();
+        void host_changed_state();
+        void take_checkpoint();
+        void log_step();
+        void undo(const undo_record & record);
+        void rebuild_undo_log();
+        void log_until(uint64_t target);
+        void replay(uint64_t target, uint64_t *last_breakpoint);
+
+        // Lockstep execution. Defined in lockstep.cpp.
+        bool runs_in_lockstep(const avr::instruction & instr) const;
+        bool ready_for_lockstep(uint64_t limit) const;
+        bool run_alone(uint64_t limit, address_t meet_at, uint64_t give_up, stop_reason & finished);
+        static uint64_t run_together(lockstep_lanes & lanes, address_t start);
+
+        // Where the next checkpoint is due
+        uint64_t next_checkpoint() const
+        {
+            return checkpoints.back()->machine->cycle_count + checkpoint_interval;
+        }
+
+        static constexpr uint64_t checkpoint_interval = 1 << 20;
+        static constexpr size_t max_checkpoints = 64;   // older ones are thinned out beyond this
+        static constexpr size_t undo_capacity = 1024;   // steps which can be undone without replaying
+
+        // Execute at least one instruction, and keep going until stop() returns true, which is
+        // reported as done, or something else stops the run. stop() is called after every
+        // instruction and on entering an interrupt handler. It is compiled into the engines' dispatch
+        // loops, so it should be cheap; running freely is stop() returning false. The engines run
+        // straight through to the next scheduled event, which is handled between instructions.
+        template<typename Stop>
+        stop_kind run_until(Stop stop)
+        {
+            resume_from = pc;
+            if (interrupt_due()) {
+                take_interrupt();
+            }
+
+            bool stopped = false;
+            do {
+                if (sleeping) {
+                    // Whatever the engine would stop for cannot happen until the CPU wakes
+                    if (!doze()) {
+                        return stop_kind::asleep;
+                    }
+                    stopped = cycle_count >= run_limit;
+                } else {
+                    switch (selected_engine) {
+                    case engine::switched:
+                        stopped = run_switched(stop);
+                        break;
+                    case engine::threaded:
+                        stopped = run_threaded(stop);
+                        break;
+                    case engine::jit:
+                        // Translated blocks only know how to stop at breakpoints, so single steps and
+                        // other stop conditions are interpreted
+                        stopped = run_switched(stop);
+                        break;
+                    }
+                }
+                events.run_due(cycle_count);
+                if (stopped_for != stop_kind::done) {
+                    auto kind = stopped_for;
+                    stopped_for = stop_kind::done;
+                    return kind;
+                }
+
+                // An interrupt which became due while stopped is left for the next run
+                if (!stopped && interrupt_due()) {
+                    take_interrupt();
+                    stopped = stop();
+                }
+            } while (!stopped);
+            return stop_kind::done;
+        }
+
+        // The engines return true if stop() returned true, and false if they stopped because an
+        // event is due. Anything else which stops the run, such as a breakpoint, makes an event due.
+        template<typename Stop>
+        bool run_switched(Stop & stop)
+        {
+            do {
+                execute(decoded[pc]);
+                if (stop()) {
+                    return true;
+                }
+            } while (cycle_count < events.deadline());
+            return false;
+        }
+
+        // Defined in threaded.h
+        template<typename Stop>
+        bool run_threaded(Stop & stop);
+        void index_threaded();
+
+        // Run until a breakpoint, or until the cycle counter reaches `deadline`, using translated code
+        // where possible. Reaching the deadline is reported as done. Defined in jit.cpp.
+        stop_kind run_jit(uint64_t deadline);
+        const uint8_t *compile_block(address_t start);
+
+        // Loops which spin until an interrupt changes something can be skipped, and countdown loops
+        // worked out in one go; see idle_loop. Defined in idle_loops.cpp.
+        std::vector<idle_loop> find_idle_loops() const;
+        void skip_idle_loop();
+        void skip_wait(const idle_loop & loop, uint64_t limit);
+        void skip_countdown(const idle_loop & loop, uint64_t limit);
+
+        // Called after a jump backwards to pc, which may be the start of an idle loop
+        void jumped_back()
+        {
+            if (!stepping && idle_loops[pc].kind != idle_loop::none) {
+                skip_idle_loop();
+            }
+        }
+
+        // jumped_back, for translated code
+        static void jumped_back_helper(simulator_impl & sim, const avr::instruction &)
+        {
+            sim.jumped_back();
+        }
+
+        // The instruction at an address, looking through any breakpoint
+        const avr::instruction & instruction_at(address_t address) const
+        {
+            auto found = breakpoints.find(address);
+            return found != breakpoints.end() ? found->second : decoded[address];
+        }
+
+        bool breakpoint_at(address_t address) const
+        {
+            return decoded[address].op == TRAP;
+        }
+
+        // Reached a breakpoint. The run stops before the instruction there, unless the run started
+        // from it, in which case the breakpoint has already been reported and the instruction runs.
+        void trap()
+        {
+            if (pc == resume_from) {
+                resume_from = no_address;
+                execute(breakpoints.find(pc)->second);
+                return;
+            }
+            stop_run(stop_kind::breakpoint);
+        }
+
+        // Get the engines to return, and the run to report why
+        void stop_run(stop_kind kind)
+        {
+            stopped_for = kind;
+            return_at(cycle_count);
+        }
+
+        // The threaded engine's handlers and translated blocks are derived from the decoded
+        // instructions, so they have to be worked out again when breakpoints change
+        void dispatch_changed()
+        {
+            threaded.clear();
+            if (jit) {
+                jit->flush();
+            }
+        }
+
+        void execute(const avr::instruction & instr)
+        {
+            switch (static_cast<uint16_t>(instr.op)) {   // TRAP is not one of avr::opcode
+#define EXECUTE_OPCODE(op) \
+            case avr::op: \
+                execute(instr, opcode_tag<avr::op>()); \
+                break;
+
+            SIMULATOR_OPCODES(EXECUTE_OPCODE)
+#undef EXECUTE_OPCODE
+            case TRAP:
+                trap();
+                break;
+            default:
+                unimplemented(instr);
+            }
+        }
+
+        // Executes a single opcode; used where a plain function pointer is needed
+        template<avr::opcode op>
+        static void execute_opcode(simulator_impl & sim, const avr::instruction & instr)
+        {
+            sim.execute(instr, opcode_tag<op>());
+        }
+
+        // Count the clock cycles taken by an instruction
+        template<avr::opcode op>
+        void tick()
+        {
+            constexpr auto index = index_of(op);
+            cycle_count += timings[index].cycles;
+        }
+
+        template<avr::opcode op>
+        void tick(bool taken)
+        {
+            constexpr auto index = index_of(op);
+            cycle_count += taken ? timings[index].taken : timings[index].cycles;
+        }
+
+        // Stores mark the pages they write in written_pages, which only says whether a page has been
+        // written since the last snapshot or restore. page_stamps keep the epoch of the last write
+        // to each page, so that it is known which snapshots the page has changed since.
+        void note_written_pages()
+        {
+            for (size_t page = 0; page < written_pages.size(); ++page) {
+                if (written_pages[page]) {
+                    page_stamps[page] = write_epoch;
+                    written_pages[page] = 0;
+                }
+            }
+        }
+
+        static constexpr size_t page_size = 0x100;
+
+        // Stores only call storing() while something needs to see them
+        void watch_stores()
+        {
+            logging_stores = logging_step || stack_limit || !watchpoints.empty();
+        }
+
+        void log_stores(bool log)
+        {
+            logging_step = log;
+            watch_stores();
+        }
+
+        void storing(address_t address) override
+        {
+            if (logging_step && address >= io_end) {
+                undo_log.back().stores.emplace_back(address, memory[address]);
+            }
+            if (watchpoints.count(address)) {
+                stop_run(stop_kind::watchpoint);
+            }
+            if (word_at(avr::reg::SPL) < stack_limit) {
+                stop_run(stop_kind::stack_overflow);
+            }
+        }
+
+        // Translated code does not call storing() or count edges, so it is not used when either is
+        // needed
+        bool translating() const
+        {
+            return selected_engine == engine::jit && !logging_stores && !edges;
+        }
+
+        // Count the jump from `from` to pc, if edges are being counted
+        void branched(address_t from)
+        {
+            if (edges) {
+                edges->hit(((from << 1) ^ pc) & (edge_counts::size - 1));
+            }
+        }
+
+        // Give a peripheral its registers. Accesses to them go through io_read and io_write; the rest
+        // of the data space is plain memory.
+        template<typename device_type>
+        device_type *attach(std::unique_ptr<device_type> device)
+        {
+            auto attached = device.get();
+            for (auto address : device->registers()) {
+                io_owners[address] = attached;
+                set_side_effects(address);
+            }
+            peripherals.push_back(std::move(device));
+            return attached;
+        }
+
+        void io_read(address_t address) override
+        {
+            if (auto owner = io_owners[address]) {
+                owner->read(address, cycle_count);
+            }
+        }
+
+        void io_write(address_t address) override
+        {
+            if (auto owner = io_owners[address]) {
+                owner->write(address, cycle_count);
+
+                // The write may have brought an event forward, which translated code has to stop for
+                jit_deadline = std::min(jit_deadline, events.deadline());
+            }
+        }
+
+        // Get the engines to return to run_until or run_jit by `cycle`, to take an interrupt or go to
+        // sleep
+        void return_at(uint64_t cycle)
+        {
+            events.schedule(cycle, [](uint64_t) {});
+            jit_deadline = std::min(jit_deadline, events.deadline());
+        }
+
+        void interrupts_enabled() override
+        {
+            // The instruction after the one which set I always runs before any interrupt
+            enabled_at = cycle_count;
+            if (interrupts.pending) {
+                return_at(cycle_count + 1);
+            }
+        }
+
+        bool interrupt_due() const
+        {
+            return interrupts.pending && (sreg() & avr::SREG_I) && cycle_count > enabled_at;
+        }
+
+        // Enter the handler for the pending interrupt with the highest priority, as the hardware does
+        // between instructions
+        void take_interrupt()
+        {
+            if (sleeping) {
+                wake_up();
+            }
+
+            // Coming back from the handler to where the run started is reaching a breakpoint there
+            resume_from = no_address;
+
+            auto vector = interrupts.next();
+            interrupts.acknowledge(vector, cycle_count);
+            sreg() &= ~avr::SREG_I;
+            call(vector * vector_words, pc);
+            cycle_count += interrupt_cycles;
+        }
+
+        // Cycles from an interrupt being taken to the first instruction of its vector, on devices
+        // with a 16-bit program counter
+        static constexpr uint32_t interrupt_cycles = 4;
+
+        // Sleep mode control register bits
+        static constexpr byte_t SMCR_SE = 1 << 0;
+        static constexpr byte_t SMCR_SM = 0b111 << 1;
+
+        // The CPU stops until an interrupt wakes it. Idle mode is the only one which leaves the I/O
+        // clock, and so Timer0, running.
+        void fall_asleep(byte_t mode)
+        {
+            sleeping = true;
+            if (mode) {
+                set_io_clock(false);
+            }
+            return_at(cycle_count);
+        }
+
+        void wake_up()
+        {
+            sleeping = false;
+            set_io_clock(true);
+            cycle_count += wake_cycles;
+        }
+
+        // The CPU is halted for this many cycles on waking, on top of the oscillator's start-up time,
+        // which depends on the fuses and is not modelled
+        static constexpr uint32_t wake_cycles = 4;
+
+        void set_io_clock(bool running)
+        {
+            if (io_clock_running == running) {
+                return;
+            }
+            io_clock_running = running;
+            for (auto & device : peripherals) {
+                device->io_clock(running, cycle_count);
+            }
+        }
+
+        // Nothing runs while asleep, so time passes straight to the next event, which may wake the
+        // CPU, or to the end of the run. Returns false if nothing is left which could wake it.
+        bool doze()
+        {
+            auto until = can_wake() ? std::min(run_limit, events.deadline()) : run_limit;
+            if (until == std::numeric_limits<uint64_t>::max()) {
+                return false;
+            }
+            cycle_count = std::max(cycle_count, until);
+            return true;
+        }
+
+        // Only an interrupt wakes the CPU, so it sleeps for good with I clear, or if no peripheral
+        // can raise an interrupt which is enabled
+        bool can_wake() const
+        {
+            if (!(sreg() & avr::SREG_I)) {
+                return false;
+            }
+            if (interrupts.pending) {
+                return true;
+            }
+            for (auto & device : peripherals) {
+                if (device->can_interrupt()) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Stop in front of an instruction which cannot be executed
+        void unimplemented(const avr::instruction & instr)
+        {
+            stop_run(instr.size ? stop_kind::unimplemented_instruction : stop_kind::invalid_instruction);
+        }
+
+        // The effect of each opcode, shared by all of the execution engines
+        void execute(const avr::instruction & instr, opcode_tag<avr::ADIW>)
+        {
+            tick<avr::ADIW>();
+            adiw(instr.args.constant_register_pair.pair, instr.args.constant_register_pair.constant);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::SBIW>)
+        {
+            tick<avr::SBIW>();
+            sbiw(instr.args.constant_register_pair.pair, instr.args.constant_register_pair.constant);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::CALL>)
+        {
+            tick<avr::CALL>();
+            address_t from = pc;
+            call(instr.args.address.address, pc + instr.size);
+            branched(from);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::RCALL>)
+        {
+            tick<avr::RCALL>();
+            address_t from = pc;
+            rcall(instr.args.offset12.offset, pc + instr.size);
+            advance(instr.size);
+            branched(from);
+        }
+
+        void execute(const avr::instruction &, opcode_tag<avr::RET>)
+        {
+            tick<avr::RET>();
+            address_t from = pc;
+            ret();
+            branched(from);
+        }
+
+        void execute(const avr::instruction &, opcode_tag<avr::RETI>)
+        {
+            tick<avr::RETI>();
+            address_t from = pc;
+            reti();
+            branched(from);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::SEI>)
+        {
+            tick<avr::SEI>();
+            sei();
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::CLI>)
+        {
+            tick<avr::CLI>();
+            cli();
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::JMP>)
+        {
+            tick<avr::JMP>();
+            address_t from = pc;
+            jmp(instr.args.address.address);
+            bool backwards = pc <= from;
+            branched(from);
+            if (backwards) {
+                jumped_back();
+            }
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::STS>)
+        {
+            tick<avr::STS>();
+            sts(instr.args.reg_address.reg, instr.args.reg_address.address);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::CP>)
+        {
+            tick<avr::CP>();
+            cp(instr.args.register1_register2.register1, instr.args.register1_register2.register2);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::CPC>)
+        {
+            tick<avr::CPC>();
+            cpc(instr.args.register1_register2.register1, instr.args.register1_register2.register2);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::ADD>)
+        {
+            tick<avr::ADD>();
+            add(instr.args.register1_register2.register1, instr.args.register1_register2.register2);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::ADC>)
+        {
+            tick<avr::ADC>();
+            adc(instr.args.register1_register2.register1, instr.args.register1_register2.register2);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::LDI>)
+        {
+            tick<avr::LDI>();
+            ldi(instr.args.constant_register.reg, instr.args.constant_register.constant);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::CPI>)
+        {
+            tick<avr::CPI>();
+            cpi(instr.args.constant_register.reg, instr.args.constant_register.constant);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::SLEEP>)
+        {
+            tick<avr::SLEEP>();
+            advance(instr.size);
+            auto smcr = memory[avr::reg::SMCR];
+            if (smcr & SMCR_SE) {
+                fall_asleep((smcr & SMCR_SM) >> 1);
+            }
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::SUBI>)
+        {
+            tick<avr::SUBI>();
+            subi(instr.args.constant_register.reg, instr.args.constant_register.constant);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::LDS>)
+        {
+            tick<avr::LDS>();
+            lds(instr.args.reg_address.reg, instr.args.reg_address.address);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::BRGE>)
+        {
+            address_t from = pc;
+            bool taken = brge(instr.args.offset.offset);
+            tick<avr::BRGE>(taken);
+            advance(instr.size);
+            branched(from);
+            if (taken && instr.args.offset.offset < 0) {
+                jumped_back();
+            }
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::BRNE>)
+        {
+            address_t from = pc;
+            bool taken = brne(instr.args.offset.offset);
+            tick<avr::BRNE>(taken);
+            advance(instr.size);
+            branched(from);
+            if (taken && instr.args.offset.offset < 0) {
+                jumped_back();
+            }
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::RJMP>)
+        {
+            tick<avr::RJMP>();
+            address_t from = pc;
+            rjmp(instr.args.offset12.offset);
+            advance(instr.size);
+            branched(from);
+            if (instr.args.offset12.offset < 0) {
+                jumped_back();
+            }
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::EOR>)
+        {
+            tick<avr::EOR>();
+            eor(instr.args.register1_register2.register1, instr.args.register1_register2.register2);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::IN>)
+        {
+            tick<avr::IN>();
+            in(instr.args.ioaddress_register.ioaddress, instr.args.ioaddress_register.reg);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::OUT>)
+        {
+            tick<avr::OUT>();
+            out(instr.args.ioaddress_register.ioaddress, instr.args.ioaddress_register.reg);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::LPM>)
+        {
+            tick<avr::LPM>();
+            lpm(instr.args.reg.reg);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::STX>)
+        {
+            tick<avr::STX>();
+            stx(instr.args.reg.reg);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::PUSH>)
+        {
+            tick<avr::PUSH>();
+            push(memory[instr.args.reg.reg]);
+            advance(instr.size);
+        }
+
+        void execute(const avr::instruction & instr, opcode_tag<avr::POP>)
+        {
+            tick<avr::POP>();
+            memory[instr.args.reg.reg] = pop();
+            advance(instr.size);
+        }
+
+        // Indexes into the threaded engine's handlers, after those in opcode_index
+        static constexpr uint8_t TRAP_INDEX = OPCODE_COUNT;
+        static constexpr uint8_t UNIMPLEMENTED_INDEX = OPCODE_COUNT + 1;
+
+#if !defined(__GNUC__)
+        using threaded_handler = void (*)(simulator_impl &, const avr::instruction &);
+
+        static void execute_unimplemented(simulator_impl & sim, const avr::instruction & instr)
+        {
+            sim.unimplemented(instr);
+        }
+
+        static void execute_trap(simulator_impl & sim, const avr::instruction &)
+        {
+            sim.trap();
+        }
+#endif
+
+        std::shared_ptr<const program_image> program;
+        const avr::instruction *        decoded;        // the image's, or patched if there are breakpoints
+        std::vector<avr::instruction>   patched;        // the image's, with traps at breakpoints
+        // The threaded engine's handler for each word of flash, filled in the first time it runs
+        std::vector<uint8_t>            threaded;
+        std::map<address_t, avr::instruction> breakpoints;  // instructions replaced by traps
+        std::set<address_t>             watchpoints;
+        address_t                       stack_limit = 0;    // no stack overflows below this if 0
+        edge_counts *                   edges = nullptr;    // hit counts of jumps, if they are counted
+        bool                            logging_step = false;   // stores go in the last undo record
+        static constexpr address_t      no_address = std::numeric_limits<address_t>::max();
+        address_t                       resume_from = no_address;   // breakpoint not to stop at
+        address_t                       run_to = no_address;    // pc the run stops at, if it has one
+        stop_kind                       stopped_for = stop_kind::done;  // why the run has to stop, if it does
+        engine                          selected_engine;
+        std::array<avr::timing, OPCODE_COUNT> timings;  // from the board, for each opcode
+        std::unique_ptr<jit_cache>      jit;            // created the first time the JIT engine runs
+        uint64_t                        jit_deadline = 0;   // translated code exits before passing this cycle
+        scheduler                       events;
+        std::vector<std::unique_ptr<peripheral>> peripherals;
+        std::array<port *, 3>           ports;          // B, C and D
+        usart0 *                        usart;
+        std::array<uint64_t, 0x100>     page_stamps = {};   // epoch of the last write to each page
+        uint64_t                        write_epoch = 1;    // advanced by snapshots, restores and resets
+        uint64_t                        loaded_epoch = 1;   // pages written at or after this differ from load
+        std::array<byte_t, 0x100>       low_at_load;    // the registers and I/O space after load
+        device_state                    devices_at_load;
+        bool                            keeping_history = false;
+        std::vector<snapshot_handle>    checkpoints;    // oldest first; history starts at the first
+        std::deque<undo_record>         undo_log;       // the latest steps, oldest first
+        std::vector<peripheral *>       io_owners;      // peripheral owning each I/O address, if any
+        size_t                          vector_words;   // flash words per interrupt vector
+        interrupt_controller            interrupts;
+        uint64_t                        enabled_at = 0; // cycle at which I was last set
+        const idle_loop *               idle_loops;     // the image's
+        uint64_t                        run_limit = 0;  // cycle the current run stops at
+        bool                            stepping = false;   // idle loops are not skipped while stepping
+        bool                            sleeping = false;
+        bool                            io_clock_running = true;
+    };
+
+}
+
+#include "threaded.h"
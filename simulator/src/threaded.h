@@ -0,0 +1,128 @@
+#pragma once
+
+#include "avr/instruction.h"
+#include "simulator_impl.h"
+
+// The threaded engine is a template over the stop condition, so that the condition is compiled into
+// every handler. This is included at the end of simulator_impl.h.
+
+namespace simulator {
+
+    inline void simulator_impl::index_threaded()
+    {
+        if (!threaded.empty()) {
+            return;
+        }
+        threaded.resize(program->decoded.size());
+        for (size_t i = 0; i < program->decoded.size(); ++i) {
+            switch (static_cast<uint16_t>(decoded[i].op)) {
+#define HANDLER_INDEX(op) \
+            case avr::op: \
+                threaded[i] = op##_INDEX; \
+                break;
+
+            SIMULATOR_OPCODES(HANDLER_INDEX)
+#undef HANDLER_INDEX
+            case TRAP:
+                threaded[i] = TRAP_INDEX;
+                break;
+            default:
+                threaded[i] = UNIMPLEMENTED_INDEX;
+            }
+        }
+    }
+
+#if defined(__GNUC__)
+
+// Labels as values and computed goto are GNU extensions, which -pedantic would otherwise reject
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+    template<typename Stop>
+    bool simulator_impl::run_threaded(Stop & stop)
+    {
+        index_threaded();
+
+        // Each instantiation has its own labels, in the order of opcode_index
+        static const void *const handlers[] = {
+#define HANDLER_ADDRESS(op) &&execute_##op,
+            SIMULATOR_OPCODES(HANDLER_ADDRESS)
+#undef HANDLER_ADDRESS
+            &&execute_trap,
+            &&execute_unimplemented,
+        };
+
+        const avr::instruction *instr;
+
+        // Every handler ends with its own copy of the indirect jump to the next handler, so the branch
+        // predictor can learn which opcodes tend to follow which.
+#define DISPATCH() \
+        do { \
+            instr = &decoded[pc]; \
+            goto *handlers[threaded[pc]]; \
+        } while (false)
+
+        DISPATCH();
+
+#define HANDLER(op) \
+    execute_##op: \
+        execute(*instr, opcode_tag<avr::op>()); \
+        if (stop()) { \
+            return true; \
+        } \
+        if (cycle_count >= events.deadline()) { \
+            return false; \
+        } \
+        DISPATCH();
+
+        SIMULATOR_OPCODES(HANDLER)
+
+    execute_trap:
+        trap();
+        if (stop()) {
+            return true;
+        }
+        if (cycle_count >= events.deadline()) {
+            return false;
+        }
+        DISPATCH();
+
+#undef HANDLER
+#undef DISPATCH
+
+    execute_unimplemented:
+        unimplemented(*instr);
+        return false;
+    }
+
+#pragma GCC diagnostic pop
+
+#else
+
+    // Without computed goto, fall back to calling through a table of handler pointers. This still
+    // avoids the switch, but all handlers are reached from the same indirect call.
+    template<typename Stop>
+    bool simulator_impl::run_threaded(Stop & stop)
+    {
+        index_threaded();
+
+        static const threaded_handler handlers[] = {
+#define HANDLER_ADDRESS(op) execute_opcode<avr::op>,
+            SIMULATOR_OPCODES(HANDLER_ADDRESS)
+#undef HANDLER_ADDRESS
+            execute_trap,
+            execute_unimplemented,
+        };
+
+        do {
+            handlers[threaded[pc]](*this, decoded[pc]);
+            if (stop()) {
+                return true;
+            }
+        } while (cycle_count < events.deadline());
+        return false;
+    }
+
+#endif
+
+}
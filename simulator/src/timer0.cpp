@@ -0,0 +1,143 @@
+#include "timer0.h"
+
+using namespace simulator;
+
+timer0::timer0(avr::data_space & memory_, scheduler & events_, interrupt_controller & interrupts_)
+    : memory(memory_)
+    , events(events_)
+    , interrupts(interrupts_)
+{
+    rebase(0, 0);
+}
+
+std::vector<address_t> timer0::registers() const
+{
+    return {TIFR0, TCCR0B, TCNT0, TIMSK0};
+}
+
+void timer0::read(address_t address, uint64_t cycle)
+{
+    catch_up(cycle);
+    if (address == TCNT0) {
+        memory[TCNT0] = count_at(cycle);
+    }
+}
+
+byte_t timer0::peek(address_t address, uint64_t cycle) const
+{
+    switch (address) {
+    case TCNT0:
+        return count_at(cycle);
+    case TIFR0:
+        // An overflow which catch_up has yet to see
+        return counter.divisor && cycle >= counter.overflow_cycle ? counter.flags | TOV0 : counter.flags;
+    default:
+        return memory[address];
+    }
+}
+
+void timer0::write(address_t address, uint64_t cycle)
+{
+    // Anything which happened before the write has to be accounted for under the old settings
+    catch_up(cycle);
+    switch (address) {
+    case TCCR0B:
+        rebase(cycle, count_at(cycle));
+        break;
+    case TCNT0:
+        rebase(cycle, memory[TCNT0]);
+        break;
+    case TIFR0:
+        set_flags(counter.flags & ~memory[TIFR0]);
+        break;
+    case TIMSK0:
+        set_flags(counter.flags);
+        break;
+    }
+}
+
+void timer0::acknowledge(unsigned, uint64_t)
+{
+    // Entering the handler clears the overflow flag
+    set_flags(counter.flags & ~TOV0);
+}
+
+std::shared_ptr<const void> timer0::save() const
+{
+    return save_copy(counter);
+}
+
+void timer0::restore(const void *saved)
+{
+    restore_copy(counter, saved);
+}
+
+bool timer0::can_interrupt() const
+{
+    // A stopped timer never overflows
+    return counter.divisor && (memory[TIMSK0] & TOIE0);
+}
+
+void timer0::io_clock(bool running, uint64_t cycle)
+{
+    // The count stays where it is for as long as the clock is stopped
+    catch_up(cycle);
+    auto count = count_at(cycle);
+    counter.clock_running = running;
+    rebase(cycle, count);
+}
+
+uint32_t timer0::prescale(byte_t tccr0b)
+{
+    static const uint32_t divisors[] = {0, 1, 8, 64, 256, 1024, 0, 0};
+    return divisors[tccr0b & 0b111];
+}
+
+uint8_t timer0::count_at(uint64_t cycle) const
+{
+    if (!counter.divisor) {
+        return counter.base_count;
+    }
+
+    // The prescaler runs all the time, so counts happen on multiples of the divisor no matter when
+    // the timer was started
+    return counter.base_count + (cycle / counter.divisor - counter.base_cycle / counter.divisor);
+}
+
+void timer0::rebase(uint64_t cycle, uint8_t count)
+{
+    counter.base_cycle = cycle;
+    counter.base_count = count;
+    counter.divisor = counter.clock_running ? prescale(memory[TCCR0B]) : 0;
+
+    if (counter.overflow_scheduled) {
+        events.cancel(counter.overflow_event);
+        counter.overflow_scheduled = false;
+    }
+    if (!counter.divisor) {
+        return;
+    }
+
+    counter.overflow_cycle = (cycle / counter.divisor + (0x100 - count)) * counter.divisor;
+    counter.overflow_event = events.schedule(counter.overflow_cycle, [this](uint64_t due) {
+        counter.overflow_scheduled = false;
+        catch_up(due);
+    });
+    counter.overflow_scheduled = true;
+}
+
+void timer0::catch_up(uint64_t cycle)
+{
+    if (!counter.divisor || cycle < counter.overflow_cycle) {
+        return;
+    }
+    set_flags(counter.flags | TOV0);
+    rebase(cycle, count_at(cycle));
+}
+
+void timer0::set_flags(byte_t flags_)
+{
+    counter.flags = flags_;
+    memory[TIFR0] = counter.flags;
+    interrupts.request(overflow_vector, (counter.flags & TOV0) && (memory[TIMSK0] & TOIE0), *this);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "avr/core.h"
+#include "interrupts.h"
+#include "peripheral.h"
+#include "scheduler.h"
+#include "types.h"
+
+namespace simulator {
+
+    // Timer/Counter0 of the ATmega48/88/168/328, in normal mode: TCNT0 counts up once every
+    // 1, 8, 64, 256 or 1024 cycles as selected by TCCR0B, and sets TOV0 in TIFR0 when it wraps
+    // around. Rather than counting, the timer remembers the count at some cycle and works the
+    // current one out from the cycle counter. The overflow is a scheduled event.
+    struct timer0
+        : peripheral
+    {
+        // Data-space addresses of the registers
+        static constexpr address_t TIFR0 = 0x35;
+        static constexpr address_t TCCR0B = 0x45;
+        static constexpr address_t TCNT0 = 0x46;
+        static constexpr address_t TIMSK0 = 0x6E;
+
+        static constexpr byte_t TOV0 = 1 << 0;
+        static constexpr byte_t TOIE0 = 1 << 0;
+
+        static constexpr unsigned overflow_vector = 16;
+
+        timer0(avr::data_space & memory, scheduler & events, interrupt_controller & interrupts);
+
+        std::vector<address_t> registers() const override;
+        void read(address_t address, uint64_t cycle) override;
+        byte_t peek(address_t address, uint64_t cycle) const override;
+        void write(address_t address, uint64_t cycle) override;
+        void acknowledge(unsigned vector, uint64_t cycle) override;
+        bool can_interrupt() const override;
+        void io_clock(bool running, uint64_t cycle) override;
+        std::shared_ptr<const void> save() const override;
+        void restore(const void *saved) override;
+
+    private:
+        // Cycles per count for a value of TCCR0B, or 0 if the timer is stopped. The external clock
+        // sources are not modelled, so they stop the timer too.
+        static uint32_t prescale(byte_t tccr0b);
+
+        uint8_t count_at(uint64_t cycle) const;
+
+        // Restart counting from `count` at `cycle`, and schedule the next overflow
+        void rebase(uint64_t cycle, uint8_t count);
+
+        // Set TOV0 for an overflow which happened by `cycle`
+        void catch_up(uint64_t cycle);
+
+        void set_flags(byte_t flags);
+
+        avr::data_space &       memory;
+        scheduler &             events;
+        interrupt_controller &  interrupts;
+
+        struct counter_state
+        {
+            // TCNT0 held `base_count` at `base_cycle`
+            uint64_t                base_cycle = 0;
+            uint8_t                 base_count = 0;
+            uint32_t                divisor = 0;        // prescale since base_cycle
+            bool                    clock_running = true;
+            uint64_t                overflow_cycle = 0;
+            bool                    overflow_scheduled = false;
+            scheduler::event_id     overflow_event = 0;
+            byte_t                  flags = 0;  // TIFR0, which firmware clears by writing ones
+        };
+
+        counter_state           counter;
+    };
+
+}
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "avr/instruction.h"
+#include "avr/timing.h"
+#include "translate.h"
+
+using namespace avr;
+using namespace simulator;
+
+namespace {
+
+    // Formats a flash address the way the generated code spells it
+    struct hex
+    {
+        address_t value;
+    };
+
+    std::ostream & operator<<(std::ostream & out, hex h)
+    {
+        auto flags = out.flags();
+        auto fill = out.fill('0');
+        out << "0x" << std::hex << std::setw(4) << h.value;
+        out.fill(fill);
+        out.flags(flags);
+        return out;
+    }
+
+    // Name of the function which implements the block starting at an address
+    struct block_name
+    {
+        address_t start;
+    };
+
+    std::ostream & operator<<(std::ostream & out, block_name b)
+    {
+        auto flags = out.flags();
+        auto fill = out.fill('0');
+        out << "block_" << std::hex << std::setw(4) << b.start;
+        out.fill(fill);
+        out.flags(flags);
+        return out;
+    }
+
+    const char *register_pair_name(register_pair pair)
+    {
+        switch (pair) {
+        case W:
+            return "W";
+        case X:
+            return "X";
+        case Y:
+            return "Y";
+        case Z:
+            return "Z";
+        }
+        return "W";
+    }
+
+    // Where control can go after an instruction, other than falling through to the next one.
+    // Addresses wrap around the end of flash, which `pc_mask` is one less than the size of.
+    struct control_flow
+    {
+        bool                    ends_block = false;
+        bool                    falls_through = false;
+        std::vector<address_t>  targets;
+    };
+
+    control_flow successors(address_t addr, const instruction & instr, address_t pc_mask)
+    {
+        address_t next = (addr + instr.size) & pc_mask;
+        control_flow flow;
+        switch (instr.op) {
+        case JMP:
+            flow.ends_block = true;
+            flow.targets = {static_cast<address_t>(instr.args.address.address & pc_mask)};
+            break;
+        case RJMP:
+            flow.ends_block = true;
+            flow.targets = {static_cast<address_t>((next + instr.args.offset12.offset) & pc_mask)};
+            break;
+        case BRNE:
+        case BRGE:
+            flow.ends_block = true;
+            flow.falls_through = true;
+            flow.targets = {static_cast<address_t>((next + instr.args.offset.offset) & pc_mask)};
+            break;
+        case CALL:
+            // The return address starts a block of its own, for ret to come back to
+            flow.ends_block = true;
+            flow.falls_through = true;
+            flow.targets = {static_cast<address_t>(instr.args.address.address & pc_mask)};
+            break;
+        case RCALL:
+            flow.ends_block = true;
+            flow.falls_through = true;
+            flow.targets = {static_cast<address_t>((next + instr.args.offset12.offset) & pc_mask)};
+            break;
+        case RET:
+        case RETI:
+            flow.ends_block = true;
+            break;
+        default:
+            flow.falls_through = true;
+            break;
+        }
+        return flow;
+    }
+
+    // The body of the function for one block
+    struct block_writer
+    {
+        std::string         body;
+        uint32_t            cycles = 0;     // taken so far, counted once at each exit
+        bool                uses_core = false;
+
+        void statement(const std::string & code, bool touches_core = true)
+        {
+            body += "        " + code + '\n';
+            uses_core |= touches_core;
+        }
+
+        // Count the cycles taken on the way to an exit, plus `extra`, and go to `target`
+        void exit(const std::string & target, uint32_t extra = 0, const char *indent = "")
+        {
+            if (cycles + extra) {
+                body += indent;
+                statement("c.cycle_count += " + std::to_string(cycles + extra) + ";");
+            }
+            body += indent;
+            statement("return " + target + ";", false);
+        }
+
+        void exit(address_t target, uint32_t extra = 0, const char *indent = "")
+        {
+            std::ostringstream s;
+            s << hex{target};
+            exit(s.str(), extra, indent);
+        }
+    };
+
+    // Write the C++ for one instruction. Returns false if it cannot be translated, in which case
+    // nothing is written and the block has to end before it.
+    bool translate_instruction(
+        block_writer & block, address_t addr, const instruction & instr, timing t, address_t pc_mask)
+    {
+        if (!instr.size) {
+            return false;
+        }
+
+        address_t next = (addr + instr.size) & pc_mask;
+        const auto & pair = instr.args.constant_register_pair;
+        const auto & regs = instr.args.register1_register2;
+        const auto & constant = instr.args.constant_register;
+        const auto & address = instr.args.reg_address;
+        const auto & io = instr.args.ioaddress_register;
+        const auto reg = static_cast<int>(instr.args.reg.reg);
+
+        std::ostringstream code;
+        auto register_operands = [&](const char *method) {
+            code << "c." << method << "(" << +regs.register1 << ", " << +regs.register2 << ");";
+        };
+        auto constant_operands = [&](const char *method) {
+            code << "c." << method << "(" << +constant.reg << ", " << +constant.constant << ");";
+        };
+
+        std::ostringstream comment;
+        comment << "// " << hex{addr} << ": " << mnemonic(instr);
+        block.statement(comment.str(), false);
+        switch (instr.op) {
+        case CALL:
+        case RCALL:
+            {
+                address_t target = (instr.op == CALL
+                    ? instr.args.address.address
+                    : next + instr.args.offset12.offset) & pc_mask;
+                code << "c.call(" << hex{target} << ", " << hex{next} << ");";
+                block.statement(code.str());
+                block.exit(target, t.cycles);
+            }
+            return true;
+        case RET:
+            block.statement("c.ret();");
+            block.exit("c.pc", t.cycles);
+            return true;
+        case RETI:
+            block.statement("c.reti();");
+            block.exit("c.pc", t.cycles);
+            return true;
+        case JMP:
+            block.exit(instr.args.address.address & pc_mask, t.cycles);
+            return true;
+        case RJMP:
+            block.exit((next + instr.args.offset12.offset) & pc_mask, t.cycles);
+            return true;
+        case BRNE:
+        case BRGE:
+            // Both branch when the flag is clear
+            code << "if (c.flag(" << (instr.op == BRNE ? "SREG_Z" : "SREG_S") << ")) {";
+            block.statement(code.str());
+            block.exit(next, t.cycles, "    ");
+            block.statement("}", false);
+            block.exit((next + instr.args.offset.offset) & pc_mask, t.taken);
+            return true;
+
+        case ADIW:
+            code << "c.adiw(" << register_pair_name(pair.pair) << ", " << +pair.constant << ");";
+            break;
+        case SBIW:
+            code << "c.sbiw(" << register_pair_name(pair.pair) << ", " << +pair.constant << ");";
+            break;
+        case STS:
+            code << "c.sts(" << +address.reg << ", " << hex{address.address} << ");";
+            break;
+        case LDS:
+            code << "c.lds(" << +address.reg << ", " << hex{address.address} << ");";
+            break;
+        case CP:
+            register_operands("cp");
+            break;
+        case CPC:
+            register_operands("cpc");
+            break;
+        case ADD:
+            register_operands("add");
+            break;
+        case ADC:
+            register_operands("adc");
+            break;
+        case EOR:
+            register_operands("eor");
+            break;
+        case LDI:
+            constant_operands("ldi");
+            break;
+        case CPI:
+            constant_operands("cpi");
+            break;
+        case SUBI:
+            constant_operands("subi");
+            break;
+        case IN:
+            code << "c.in(" << +io.ioaddress << ", " << +io.reg << ");";
+            break;
+        case OUT:
+            code << "c.out(" << +io.ioaddress << ", " << +io.reg << ");";
+            break;
+        case LPM:
+            code << "c.lpm(" << reg << ");";
+            break;
+        case STX:
+            code << "c.stx(" << reg << ");";
+            break;
+        case PUSH:
+            code << "c.push(c.memory[" << reg << "]);";
+            break;
+        case POP:
+            code << "c.memory[" << reg << "] = c.pop();";
+            break;
+        case SEI:
+            code << "c.sei();";
+            break;
+        case CLI:
+            code << "c.cli();";
+            break;
+        default:
+            return false;
+        }
+        block.statement(code.str());
+        block.cycles += t.cycles;
+        return true;
+    }
+
+}
+
+void simulator::translate(
+    const avr::board & board, const segment & text, const std::vector<segment *> & other_segs,
+    std::ostream & out)
+{
+    // One word of padding, as in the simulator, so two-word instructions at the end decode
+    std::vector<uint16_t> flash(board.flash_end + 1);
+    load_flash(flash, text, other_segs);
+
+    std::vector<instruction> decoded(board.flash_end);
+    address_t pc_mask = board.flash_end - 1;
+    for (size_t i = 0; i < decoded.size(); ++i) {
+        if (!try_decode(&flash[i], decoded[i])) {
+            decoded[i].size = 0;
+        }
+    }
+
+    // Find every block reachable from the reset vector. Each block ends at a branch, or just
+    // before the start of another block.
+    std::set<address_t> leaders;
+    std::vector<bool> visited(decoded.size(), false);
+    std::vector<address_t> work = {0};
+    while (!work.empty()) {
+        address_t addr = work.back();
+        work.pop_back();
+        if (addr >= decoded.size() || !leaders.insert(addr).second) {
+            continue;
+        }
+
+        while (addr < decoded.size() && decoded[addr].size && !visited[addr]) {
+            visited[addr] = true;
+            auto flow = successors(addr, decoded[addr], pc_mask);
+            work.insert(work.end(), flow.targets.begin(), flow.targets.end());
+            address_t next = (addr + decoded[addr].size) & pc_mask;
+            if (flow.ends_block) {
+                if (flow.falls_through) {
+                    work.push_back(next);
+                }
+                break;
+            }
+            addr = next;
+        }
+    }
+
+    // Flash is written out up to the last word in use, for lpm
+    auto flash_used = flash.size();
+    while (flash_used > 1 && !flash[flash_used - 1]) {
+        --flash_used;
+    }
+
+    out << "// Generated by avr-db translate. Do not edit.\n"
+        << "\n"
+        << "#include <algorithm>\n"
+        << "#include <iterator>\n"
+        << "\n"
+        << "#include \"avr/translated.h\"\n"
+        << "\n"
+        << "using namespace avr;\n"
+        << "\n"
+        << "namespace {\n"
+        << "\n"
+        << "    const uint16_t flash[] = {";
+    for (size_t i = 0; i < flash_used; ++i) {
+        out << (i % 8 ? " " : "\n        ") << hex{flash[i]} << ',';
+    }
+    out << "\n    };\n";
+
+    // Each block returns the address of the next block to run
+    std::vector<address_t> blocks;
+    for (auto start : leaders) {
+        block_writer block;
+        size_t translated = 0;
+        address_t addr = start;
+        while (true) {
+            if (addr != start && leaders.count(addr)) {
+                block.exit(addr);
+                break;
+            }
+
+            // The comment for an instruction which cannot be translated is dropped with it
+            auto & instr = decoded[addr];
+            auto length = block.body.size();
+            if (!translate_instruction(block, addr, instr, board.instruction_timing(instr.op), pc_mask)) {
+                // Leave pc at the untranslated instruction
+                block.body.resize(length);
+                block.exit(addr);
+                break;
+            }
+            ++translated;
+            if (successors(addr, instr, pc_mask).ends_block) {
+                break;
+            }
+            addr = (addr + instr.size) & pc_mask;
+        }
+
+        if (!translated) {
+            continue;
+        }
+        blocks.push_back(start);
+
+        // Blocks which only jump still take the core, so every block has the same signature
+        out << "\n"
+            << "    address_t " << block_name{start} << "(core &" << (block.uses_core ? " c" : "") << ")\n"
+            << "    {\n"
+            << block.body
+            << "    }\n";
+    }
+
+    out << "\n"
+        << "}\n"
+        << "\n"
+        << "void avr::translated::load(core & c)\n"
+        << "{\n"
+        << "    std::copy(std::begin(flash), std::end(flash), c.text.begin());\n"
+        << "}\n"
+        << "\n"
+        << "bool avr::translated::run(core & c, uint64_t cycle)\n"
+        << "{\n"
+        << "    while (c.cycle_count < cycle) {\n"
+        << "        switch (c.pc) {\n";
+    for (auto start : blocks) {
+        out << "        case " << hex{start} << ": c.pc = " << block_name{start} << "(c); break;\n";
+    }
+    out << "        default: return false;\n"
+        << "        }\n"
+        << "    }\n"
+        << "    return true;\n"
+        << "}\n";
+}
@@ -0,0 +1,94 @@
+#include "usart0.h"
+
+using namespace simulator;
+
+usart0::usart0(avr::data_space & memory_, interrupt_controller & interrupts_)
+    : memory(memory_)
+    , interrupts(interrupts_)
+{
+    update();
+}
+
+std::vector<address_t> usart0::registers() const
+{
+    return {UCSR0A, UCSR0B, UDR0};
+}
+
+void usart0::read(address_t address, uint64_t)
+{
+    // Reading the data register takes the byte it holds out of the receive buffer
+    if (address == UDR0 && (memory[UCSR0B] & RXEN0) && !buffers.received.empty()) {
+        memory[UDR0] = buffers.received.front();
+        buffers.received.pop_front();
+        update();
+    }
+}
+
+byte_t usart0::peek(address_t address, uint64_t) const
+{
+    // The status flags are always up to date, and UDR0 holds the byte read last
+    return memory[address];
+}
+
+void usart0::write(address_t address, uint64_t)
+{
+    switch (address) {
+    case UDR0:
+        if (memory[UCSR0B] & TXEN0) {
+            buffers.transmitted.push_back(memory[UDR0]);
+            buffers.tx_complete = true;
+        }
+        break;
+    case UCSR0A:
+        if (memory[UCSR0A] & TXC0) {
+            buffers.tx_complete = false;
+        }
+        break;
+    }
+    update();
+}
+
+void usart0::acknowledge(unsigned vector, uint64_t)
+{
+    // Entering the transmit complete handler clears its flag; the others stay set for as long as
+    // their condition holds
+    if (vector == tx_vector) {
+        buffers.tx_complete = false;
+        update();
+    }
+}
+
+std::shared_ptr<const void> usart0::save() const
+{
+    return save_copy(buffers);
+}
+
+void usart0::restore(const void *saved)
+{
+    restore_copy(buffers, saved);
+}
+
+void usart0::receive(const std::vector<byte_t> & bytes)
+{
+    buffers.received.insert(buffers.received.end(), bytes.begin(), bytes.end());
+    update();
+}
+
+std::vector<byte_t> usart0::take_transmitted()
+{
+    std::vector<byte_t> bytes;
+    bytes.swap(buffers.transmitted);
+    return bytes;
+}
+
+void usart0::update()
+{
+    auto control = memory[UCSR0B];
+    bool rx_complete = (control & RXEN0) && !buffers.received.empty();
+    memory[UCSR0A] = (memory[UCSR0A] & ~(RXC0 | TXC0 | UDRE0))
+        | (rx_complete ? RXC0 : 0) | (buffers.tx_complete ? TXC0 : 0) | UDRE0;
+
+    interrupts.request(rx_vector, rx_complete && (control & RXCIE0), *this);
+    interrupts.request(udre_vector, (control & TXEN0) && (control & UDRIE0), *this);
+    interrupts.request(tx_vector, buffers.tx_complete && (control & TXCIE0), *this);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "avr/core.h"
+#include "interrupts.h"
+#include "peripheral.h"
+#include "types.h"
+
+namespace simulator {
+
+    // USART0 of the ATmega48/88/168/328, as far as firmware moving bytes through UDR0 can tell.
+    // Frames take no time: a byte written to UDR0 is transmitted at once, so the data register is
+    // always empty, and bytes given to receive() are waiting to be read straight away. Reading UDR0
+    // takes the next one. The baud rate and frame format are not modelled.
+    struct usart0
+        : peripheral
+    {
+        // Data-space addresses of the registers
+        static constexpr address_t UCSR0A = 0xC0;
+        static constexpr address_t UCSR0B = 0xC1;
+        static constexpr address_t UDR0 = 0xC6;
+
+        // UCSR0A
+        static constexpr byte_t RXC0 = 1 << 7;
+        static constexpr byte_t TXC0 = 1 << 6;
+        static constexpr byte_t UDRE0 = 1 << 5;
+
+        // UCSR0B
+        static constexpr byte_t RXCIE0 = 1 << 7;
+        static constexpr byte_t TXCIE0 = 1 << 6;
+        static constexpr byte_t UDRIE0 = 1 << 5;
+        static constexpr byte_t RXEN0 = 1 << 4;
+        static constexpr byte_t TXEN0 = 1 << 3;
+
+        static constexpr unsigned rx_vector = 18;
+        static constexpr unsigned udre_vector = 19;
+        static constexpr unsigned tx_vector = 20;
+
+        usart0(avr::data_space & memory, interrupt_controller & interrupts);
+
+        std::vector<address_t> registers() const override;
+        void read(address_t address, uint64_t cycle) override;
+        byte_t peek(address_t address, uint64_t cycle) const override;
+        void write(address_t address, uint64_t cycle) override;
+        void acknowledge(unsigned vector, uint64_t cycle) override;
+        std::shared_ptr<const void> save() const override;
+        void restore(const void *saved) override;
+
+        // Bytes arriving on the receive pin, in order
+        void receive(const std::vector<byte_t> & bytes);
+
+        // Hand over the bytes transmitted so far
+        std::vector<byte_t> take_transmitted();
+
+    private:
+        // Bring the status flags and interrupt requests up to date
+        void update();
+
+        avr::data_space &       memory;
+        interrupt_controller &  interrupts;
+
+        struct buffer_state
+        {
+            std::deque<byte_t>  received;
+            std::vector<byte_t> transmitted;
+            bool                tx_complete = false;    // TXC0, which firmware clears by writing a one
+        };
+
+        buffer_state            buffers;
+    };
+
+}
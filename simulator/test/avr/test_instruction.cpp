@@ -2,6 +2,7 @@
 
 #include "avr/instruction.h"
 
+#include "avr/reference_decode.h"
 #include "decode.h"
 
 using namespace avr;
@@ -79,6 +80,31 @@ TEST(decode, ret)
     ASSERT_EQ(1, instr.size);
 }
 
+TEST(decode, reti)
+{
+    auto instr = decode_raw<16>(0b1001'0101'0001'1000);
+    ASSERT_EQ(opcode::RETI, instr.op);
+    ASSERT_EQ(1, instr.size);
+}
+
+TEST(decode, sei_cli)
+{
+    auto sei = decode_raw<16>(0b1001'0100'0111'1000);
+    ASSERT_EQ(opcode::SEI, sei.op);
+    ASSERT_EQ(1, sei.size);
+
+    auto cli = decode_raw<16>(0b1001'0100'1111'1000);
+    ASSERT_EQ(opcode::CLI, cli.op);
+    ASSERT_EQ(1, cli.size);
+}
+
+TEST(decode, sleep)
+{
+    auto instr = decode_raw<16>(0b1001'0101'1000'1000);
+    ASSERT_EQ(opcode::SLEEP, instr.op);
+    ASSERT_EQ(1, instr.size);
+}
+
 TEST(decode, cp)
 {   //                            oooo oo r ddddd rrrr
     auto instr = decode_raw<16>(0b0001'01'0'10101'1100);
@@ -125,6 +151,16 @@ TEST(decode, ldi)
     EXPECT_EQ(0b1001 + 16, instr.args.constant_register.reg);
 }
 
+TEST(decode, subi)
+{
+    //                            oooo KKKK dddd KKKK
+    auto instr = decode_raw<16>(0b0101'0000'0011'0001);
+    ASSERT_EQ(opcode::SUBI, instr.op);
+    ASSERT_EQ(1, instr.size);
+    EXPECT_EQ(1, instr.args.constant_register.constant);
+    EXPECT_EQ(3 + 16, instr.args.constant_register.reg);
+}
+
 TEST(decode, in)
 {
     //                            ooooo aa ddddd aaaa
@@ -177,15 +213,28 @@ TEST(decode, rjmp)
 TEST(bit_helpers, test1)
 {
     uint16_t bits = 0b0101'0000'0000'0000;
-    EXPECT_EQ(0b110, avr::bits_at(bits, std::vector<size_t>{1,3,5}));
+    EXPECT_EQ(0b110, (avr::bits_at<1,3,5>(bits)));
 }
 
 TEST(bit_helpers, test2)
 {
     uint16_t bits = 0b0110'0101'1010'1100;
-    EXPECT_EQ(0b01100, avr::bits_range(bits, 0, 5));
-    EXPECT_EQ(0b0101, avr::bits_range(bits, 4, 8));
-    EXPECT_EQ(0b100, avr::bits_range(bits, 13, 16));
+    EXPECT_EQ(0b01100, (avr::bits_range<0, 5>(bits)));
+    EXPECT_EQ(0b0101, (avr::bits_range<4, 8>(bits)));
+    EXPECT_EQ(0b100, (avr::bits_range<13, 16>(bits)));
+}
+
+TEST(bit_helpers, sign_extend)
+{
+    EXPECT_EQ(3, avr::sign_extend<7>(0b000'0011));
+    EXPECT_EQ(-1, avr::sign_extend<7>(0b111'1111));
+    EXPECT_EQ(-64, avr::sign_extend<7>(0b100'0000));
+    EXPECT_EQ(2047, avr::sign_extend<12>(0x7FF));
+    EXPECT_EQ(-2048, avr::sign_extend<12>(0x800));
+
+    // Usable in constant expressions
+    static_assert(avr::bits_at<1,3,5>(0b0101'0000'0000'0000) == 0b110, "bits_at");
+    static_assert(avr::sign_extend<12>(0xFFD) == -3, "sign_extend");
 }
 
 TEST(decode, eor)
@@ -215,3 +264,23 @@ TEST(decode, pop)
     ASSERT_EQ(1, instr.size);
     EXPECT_EQ(5, instr.args.reg.reg);
 }
+
+TEST(decode, matches_reference_decoder)
+{
+    // The operand word only matters for two-word instructions, but try a couple of patterns so
+    // that operands extracted from it are compared too.
+    for (uint16_t second : {0x0000, 0xA5C3}) {
+        for (uint32_t first = 0; first <= 0xFFFF; ++first) {
+            uint16_t words[2] = { static_cast<uint16_t>(first), second };
+
+            instruction expected, actual;
+            bool expected_valid = reference_decode(words, expected);
+            bool actual_valid = try_decode(words, actual);
+
+            ASSERT_EQ(expected_valid, actual_valid) << "first word " << std::hex << first;
+            if (expected_valid) {
+                ASSERT_EQ(expected, actual) << "first word " << std::hex << first;
+            }
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "segment.h"
+#include "types.h"
+
+namespace testing {
+
+    struct mock_segment
+        : simulator::segment
+    {
+        mock_segment(size_t size_, address_t address_, std::vector<byte_t> data_)
+            : _size(size_)
+            , _address(address_)
+            , _data(std::move(data_))
+        {}
+
+        size_t size() const override
+        {
+            return _size;
+        }
+
+        address_t address() const override
+        {
+            return _address;
+        }
+
+        const byte_t *bytes() const override
+        {
+            return _data.data();
+        }
+
+    private:
+        size_t _size;
+        address_t _address;
+        std::vector<byte_t> _data;
+    };
+
+    inline void instr_to_bytes(std::vector<byte_t> & v, uint32_t instr)
+    {
+        byte_t *bytes = reinterpret_cast<byte_t *>(&instr);
+        v.push_back(bytes[2]);
+        v.push_back(bytes[3]);
+        v.push_back(bytes[0]);
+        v.push_back(bytes[1]);
+    }
+
+    inline void instr_to_bytes(std::vector<byte_t> & v, uint16_t instr)
+    {
+        byte_t *bytes = reinterpret_cast<byte_t *>(&instr);
+        v.push_back(bytes[0]);
+        v.push_back(bytes[1]);
+    }
+
+    inline std::unique_ptr<simulator::segment> empty_segment()
+    {
+        return std::make_unique<mock_segment>(0, 0, std::vector<byte_t>());
+    }
+
+    inline std::unique_ptr<simulator::segment> text_segment(const std::vector<byte_t> & bytes)
+    {
+        auto size = bytes.size();
+        return std::make_unique<mock_segment>(size, 0, std::move(bytes));
+    }
+
+}
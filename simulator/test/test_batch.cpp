@@ -0,0 +1,242 @@
+#include <stdexcept>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "avr/boards.h"
+#include "avr/register.h"
+#include "batch.h"
+
+#include "mock_segment.h"
+
+using namespace avr;
+using namespace simulator;
+using namespace testing;
+
+TEST(batch, runs_each_job_with_its_patches)
+{
+    // lds r16,0x200   oooo ooo ddddd oooo
+    uint32_t lds16 = 0b1001'000'10000'0000'0000'0010'0000'0000;
+
+    // lds r17,0x201   oooo ooo ddddd oooo
+    uint32_t lds17 = 0b1001'000'10001'0000'0000'0010'0000'0001;
+
+    // add r16,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10000'0001;
+
+    // sts 0x202,r16   oooo ooo ddddd oooo
+    uint32_t sts = 0b1001'001'10000'0000'0000'0010'0000'0010;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, lds16);
+    instr_to_bytes(text_bytes, lds17);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, sts);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto image = load_program(atmega168, *text, {});
+
+    // A budget too short to get to the sts leaves the result unwritten
+    std::vector<batch_job> jobs;
+    for (unsigned i = 0; i < 200; ++i) {
+        jobs.push_back({image, {{0x200, {byte_t(i), byte_t(2*i + 1)}}}, i % 10 ? 100u : 3u});
+    }
+
+    auto results = run_batch(jobs, 4);
+    ASSERT_EQ(jobs.size(), results.size());
+    for (unsigned i = 0; i < jobs.size(); ++i) {
+        ASSERT_EQ(0x500u, results[i].memory.size());
+        EXPECT_EQ(stop_kind::cycle_limit, results[i].reason.kind);
+        EXPECT_GE(results[i].reason.cycle, jobs[i].cycles);
+        EXPECT_EQ(byte_t(i), results[i].memory[0x200]);
+        EXPECT_EQ(i % 10 ? byte_t(3*i + 1) : 0, results[i].memory[0x202]);
+    }
+
+    EXPECT_THROW(run_batch({{image, {{0xFFFF, {1, 2}}}, 100}}), std::invalid_argument);
+}
+
+TEST(batch, results_reach_ramend)
+{
+    // ldi r16,0xFF  oooo kkkk dddd kkkk
+    uint16_t ldi_spl = 0b1110'1111'0000'1111;
+
+    // out SPL,r16   oooo oAA r rrrr AAAA
+    uint16_t out_spl = 0b1011'1'11'1'0000'1101;
+
+    // ldi r16,4     oooo kkkk dddd kkkk
+    uint16_t ldi_sph = 0b1110'0000'0000'0100;
+
+    // out SPH,r16   oooo oAA r rrrr AAAA
+    uint16_t out_sph = 0b1011'1'11'1'0000'1110;
+
+    // ldi r16,0x5A  oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0101'0000'1010;
+
+    // push r16       oooo ooo rrrrr oooo
+    uint16_t push = 0b1001'001'10000'1111;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_spl);
+    instr_to_bytes(text_bytes, out_spl);
+    instr_to_bytes(text_bytes, ldi_sph);
+    instr_to_bytes(text_bytes, out_sph);
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, push);
+    instr_to_bytes(text_bytes, rjmp);
+
+    // The stack starts at RAMEND, the last byte of SRAM
+    auto text = text_segment(text_bytes);
+    auto results = run_batch({{load_program(atmega168, *text, {}), {}, 100}}, 1);
+    ASSERT_EQ(0x500u, results[0].memory.size());
+    EXPECT_EQ(0x5A, results[0].memory[0x4FF]);
+    EXPECT_EQ(0xFE, results[0].memory[SPL]);
+}
+
+TEST(batch, lockstep_matches_running_alone)
+{
+    // lds r16,0x200   oooo ooo ddddd oooo
+    uint32_t lds16 = 0b1001'000'10000'0000'0000'0010'0000'0000;
+
+    // lds r17,0x201   oooo ooo ddddd oooo
+    uint32_t lds17 = 0b1001'000'10001'0000'0000'0010'0000'0001;
+
+    // ldi r18,0     oooo kkkk dddd kkkk
+    uint16_t ldi18 = 0b1110'0000'0010'0000;
+
+    // ldi r19,7     oooo kkkk dddd kkkk
+    uint16_t ldi19 = 0b1110'0000'0011'0111;
+
+    // add r16,r17   oooo oo r ddddd rrrr
+    uint16_t add16 = 0b0000'11'1'10000'0001;
+
+    // adc r18,r19   oooo oo r ddddd rrrr
+    uint16_t adc = 0b0001'11'1'10010'0011;
+
+    // eor r19,r16   oooo oo r ddddd rrrr
+    uint16_t eor = 0b0010'01'1'10011'0000;
+
+    // cp r16,r17    oooo oo r ddddd rrrr
+    uint16_t cp = 0b0001'01'1'10000'0001;
+
+    // cpi r18,0x40  oooo KKKK dddd KKKK
+    uint16_t cpi = 0b0011'0100'0010'0000;
+
+    // brge +1       oooo oo kkkkkkk ooo
+    uint16_t brge = 0b1111'01'0000001'100;
+
+    // add r18,r16   oooo oo r ddddd rrrr
+    uint16_t add18 = 0b0000'11'1'10010'0000;
+
+    // rjmp -8       oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, lds16);
+    instr_to_bytes(text_bytes, lds17);
+    instr_to_bytes(text_bytes, ldi18);
+    instr_to_bytes(text_bytes, ldi19);
+    instr_to_bytes(text_bytes, add16);
+    instr_to_bytes(text_bytes, adc);
+    instr_to_bytes(text_bytes, eor);
+    instr_to_bytes(text_bytes, cp);
+    instr_to_bytes(text_bytes, cpi);
+    instr_to_bytes(text_bytes, brge);
+    instr_to_bytes(text_bytes, add18);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto image = load_program(atmega168, *text, {});
+
+    // Most jobs start with the same inputs and go the same way round the loop. The rest branch
+    // differently, and stop part way through the loop.
+    std::vector<batch_job> jobs;
+    for (unsigned i = 0; i < 100; ++i) {
+        byte_t a = i % 4 ? 1 : byte_t(37*i);
+        byte_t b = i % 4 ? 2 : byte_t(11*i + 3);
+        jobs.push_back({image, {{0x200, {a, b}}}, 500u + i % 7});
+    }
+
+    auto alone = run_batch(jobs, 1);
+    for (auto engine : {engine::switched, engine::threaded, engine::jit}) {
+        auto together = run_lockstep(jobs, engine);
+        ASSERT_EQ(jobs.size(), together.size());
+        for (unsigned i = 0; i < jobs.size(); ++i) {
+            EXPECT_EQ(alone[i].reason.kind, together[i].reason.kind) << "job " << i;
+            EXPECT_EQ(alone[i].reason.pc, together[i].reason.pc) << "job " << i;
+            EXPECT_EQ(alone[i].reason.cycle, together[i].reason.cycle) << "job " << i;
+            EXPECT_EQ(alone[i].memory, together[i].memory) << "job " << i;
+        }
+    }
+
+    auto other = load_program(atmega168, *text, {});
+    EXPECT_THROW(run_lockstep({{image, {}, 100}, {other, {}, 100}}), std::invalid_argument);
+}
+
+TEST(batch, lockstep_meets_again_after_running_alone)
+{
+    // lds r16,0x200   oooo ooo ddddd oooo
+    uint32_t lds = 0b1001'000'10000'0000'0000'0010'0000'0000;
+
+    // ldi r17,3     oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0000'0001'0011;
+
+    // add r16,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10000'0001;
+
+    // sts 0x202,r16   oooo ooo ddddd oooo
+    uint32_t sts16 = 0b1001'001'10000'0000'0000'0010'0000'0010;
+
+    // cpi r16,0x40  oooo KKKK dddd KKKK
+    uint16_t cpi = 0b0011'0100'0000'0000;
+
+    // brne -5       oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111011'001;
+
+    // subi r18,1    oooo kkkk dddd kkkk
+    uint16_t subi = 0b0101'0000'0010'0001;
+
+    // sts 0x203,r18   oooo ooo ddddd oooo
+    uint32_t sts18 = 0b1001'001'10010'0000'0000'0010'0000'0011;
+
+    // jmp 3         oooo oook kkkk oook kkkk kkkk kkkk kkkk
+    uint32_t jmp = 0b1001'0100'0000'1100'0000'0000'0000'0011;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, lds);
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, sts16);
+    instr_to_bytes(text_bytes, cpi);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, subi);
+    instr_to_bytes(text_bytes, sts18);
+    instr_to_bytes(text_bytes, jmp);
+
+    auto text = text_segment(text_bytes);
+    auto image = load_program(atmega168, *text, {});
+
+    // The lanes leave the inner loop at different times, and subi cannot run in lockstep, so they
+    // run on their own for a while before meeting again at its top
+    std::vector<batch_job> jobs;
+    for (unsigned i = 0; i < 40; ++i) {
+        jobs.push_back({image, {{0x200, {byte_t(i % 8 ? 1 : 5*i)}}}, 20000u + i % 5});
+    }
+    auto alone = run_batch(jobs, 1);
+    for (auto engine : {engine::switched, engine::threaded, engine::jit}) {
+        auto together = run_lockstep(jobs, engine);
+        ASSERT_EQ(jobs.size(), together.size());
+        for (unsigned i = 0; i < jobs.size(); ++i) {
+            EXPECT_EQ(alone[i].reason.kind, together[i].reason.kind) << "job " << i;
+            EXPECT_EQ(alone[i].reason.pc, together[i].reason.pc) << "job " << i;
+            EXPECT_EQ(alone[i].reason.cycle, together[i].reason.cycle) << "job " << i;
+            EXPECT_EQ(alone[i].memory, together[i].memory) << "job " << i;
+        }
+    }
+}
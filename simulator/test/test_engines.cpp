@@ -0,0 +1,1553 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "avr/boards.h"
+#include "avr/instruction.h"
+#include "avr/register.h"
+#include "simulator.h"
+
+#include "decode.h"
+#include "mock_segment.h"
+
+using namespace avr;
+using namespace simulator;
+using namespace testing;
+
+struct engines
+    : TestWithParam<engine>
+{};
+
+INSTANTIATE_TEST_SUITE_P(all, engines, Values(engine::switched, engine::threaded, engine::jit));
+
+TEST_P(engines, loop_to_breakpoint)
+{
+    // ldi r16,100      oooo KKKK dddd KKKK
+    uint16_t ldi16 =  0b1110'0110'0000'0100;
+
+    // ldi r17,1        oooo KKKK dddd KKKK
+    uint16_t ldi17 =  0b1110'0000'0001'0001;
+
+    // ldi r18,0        oooo KKKK dddd KKKK
+    uint16_t ldi18 =  0b1110'0000'0010'0000;
+
+    // add r18,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10010'0001;
+
+    // cp r18,r16   oooo oo r ddddd rrrr
+    uint16_t cp = 0b0001'01'1'10010'0000;
+
+    // brne -3        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111101'001;
+
+    // ldi r19,0xAA     oooo KKKK dddd KKKK
+    uint16_t ldi19 =  0b1110'1010'0011'1010;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, ldi18);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, cp);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, ldi19);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    sim->set_breakpoint(6);
+    auto reason = sim->run();
+    EXPECT_EQ(stop_kind::breakpoint, reason.kind);
+    EXPECT_EQ(6, reason.pc);
+
+    EXPECT_EQ(decode_raw<16>(ldi19), sim->next_instruction());
+    EXPECT_EQ(100, sim->read(18));
+    EXPECT_EQ(SREG_Z, sim->read(SREG) & SREG_Z);
+    EXPECT_EQ(0, sim->read(19));
+
+    sim->step();
+    EXPECT_EQ(0xAA, sim->read(19));
+}
+
+TEST_P(engines, breakpoint_in_loop)
+{
+    // ldi r16,100      oooo KKKK dddd KKKK
+    uint16_t ldi16 =  0b1110'0110'0000'0100;
+
+    // ldi r17,1        oooo KKKK dddd KKKK
+    uint16_t ldi17 =  0b1110'0000'0001'0001;
+
+    // ldi r18,0        oooo KKKK dddd KKKK
+    uint16_t ldi18 =  0b1110'0000'0010'0000;
+
+    // add r18,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10010'0001;
+
+    // cp r18,r16   oooo oo r ddddd rrrr
+    uint16_t cp = 0b0001'01'1'10010'0000;
+
+    // brne -3        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111101'001;
+
+    // ldi r19,0xAA     oooo KKKK dddd KKKK
+    uint16_t ldi19 =  0b1110'1010'0011'1010;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, ldi18);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, cp);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, ldi19);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // Breakpoints which are never reached make no difference
+    for (address_t addr = 100; addr < 600; ++addr) {
+        sim->set_breakpoint(addr);
+    }
+    sim->set_breakpoint(0xFFFF);
+    sim->delete_breakpoint(0xFFFF);
+
+    // Addresses past the end of flash wrap around, as the program counter does
+    sim->set_breakpoint(3 + 0x2000);
+    sim->set_breakpoint(6);
+
+    // The instruction at a breakpoint is still there
+    sim->run();
+    EXPECT_EQ(decode_raw<16>(add), sim->next_instruction());
+    EXPECT_EQ(0, sim->read(18));
+
+    // Running from a breakpoint goes round the loop to it again
+    sim->run();
+    EXPECT_EQ(decode_raw<16>(add), sim->next_instruction());
+    EXPECT_EQ(1, sim->read(18));
+    sim->step();
+    EXPECT_EQ(2, sim->read(18));
+
+    sim->delete_breakpoint(3);
+    sim->run();
+    EXPECT_EQ(decode_raw<16>(ldi19), sim->next_instruction());
+    EXPECT_EQ(100, sim->read(18));
+    EXPECT_EQ(3 + 100*2 + 99*2 + 1, sim->cycles());
+}
+
+TEST_P(engines, step_count_and_run_until_pc)
+{
+    // ldi r16,100      oooo KKKK dddd KKKK
+    uint16_t ldi16 =  0b1110'0110'0000'0100;
+
+    // ldi r17,1        oooo KKKK dddd KKKK
+    uint16_t ldi17 =  0b1110'0000'0001'0001;
+
+    // ldi r18,0        oooo KKKK dddd KKKK
+    uint16_t ldi18 =  0b1110'0000'0010'0000;
+
+    // add r18,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10010'0001;
+
+    // cp r18,r16   oooo oo r ddddd rrrr
+    uint16_t cp = 0b0001'01'1'10010'0000;
+
+    // brne -3        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111101'001;
+
+    // ldi r19,0xAA     oooo KKKK dddd KKKK
+    uint16_t ldi19 =  0b1110'1010'0011'1010;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, ldi18);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, cp);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, ldi19);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    sim->step(0);
+    EXPECT_EQ(0, sim->cycles());
+
+    // The three ldi, then five times round the loop
+    sim->step(3 + 5*3);
+    EXPECT_EQ(decode_raw<16>(add), sim->next_instruction());
+    EXPECT_EQ(5, sim->read(18));
+
+    sim->run_until_pc(6);
+    EXPECT_EQ(decode_raw<16>(ldi19), sim->next_instruction());
+    EXPECT_EQ(100, sim->read(18));
+    EXPECT_EQ(3 + 100*2 + 99*2 + 1, sim->cycles());
+
+    // Both stop at breakpoints on the way
+    auto stopped = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    stopped->set_breakpoint(4);
+    stopped->step(1000);
+    EXPECT_EQ(decode_raw<16>(cp), stopped->next_instruction());
+    EXPECT_EQ(1, stopped->read(18));
+    stopped->run_until_pc(6);
+    EXPECT_EQ(decode_raw<16>(cp), stopped->next_instruction());
+    EXPECT_EQ(2, stopped->read(18));
+}
+
+TEST_P(engines, step_executes_one_instruction)
+{
+    // ldi r16,1       oooo KKKK dddd KKKK
+    uint16_t ldi16 = 0b1110'0000'0000'0001;
+
+    // ldi r17,2       oooo KKKK dddd KKKK
+    uint16_t ldi17 = 0b1110'0000'0001'0010;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    sim->step();
+    EXPECT_EQ(1, sim->read(16));
+    EXPECT_EQ(0, sim->read(17));
+    EXPECT_EQ(decode_raw<16>(ldi17), sim->next_instruction());
+}
+
+TEST_P(engines, whole_data_space)
+{
+    // ldi r16,0x5A  oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0101'0000'1010;
+
+    // sts 0xFFFF,r16   oooo ooo ddddd oooo
+    uint32_t sts = 0b1001'001'10000'0000'1111'1111'1111'1111;
+
+    // lds r17,0xFFFF   oooo ooo ddddd oooo
+    uint32_t lds = 0b1001'000'10001'0000'1111'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, sts);
+    instr_to_bytes(text_bytes, lds);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // Every 16-bit address is backed by memory, whatever the size of the device's SRAM
+    sim->run_until_pc(5);
+    EXPECT_EQ(0x5A, sim->read(0xFFFF));
+    EXPECT_EQ(0x5A, sim->read(17));
+}
+
+TEST_P(engines, invalid_instruction)
+{
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0000'0000'0001;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // Runs off the end of the program into erased flash, and stops there
+    auto reason = sim->run();
+    EXPECT_EQ(stop_kind::invalid_instruction, reason.kind);
+    EXPECT_EQ(1, reason.pc);
+    EXPECT_EQ(1, reason.cycle);
+    EXPECT_EQ(1, sim->read(16));
+
+    reason = sim->step();
+    EXPECT_EQ(stop_kind::invalid_instruction, reason.kind);
+    EXPECT_EQ(1, sim->cycles());
+}
+
+TEST_P(engines, pc_wraps_around_flash)
+{
+    // cpi r16,0     oooo kkkk dddd kkkk
+    uint16_t cpi = 0b0011'0000'0000'0000;
+
+    // brne +2        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'0000010'001;
+
+    // jmp 0x7000     oooo oook kkkk oook kkkk kkkk kkkk kkkk
+    uint32_t jmp_high = 0b1001'0100'0000'1100'0111'0000'0000'0000;
+
+    // ldi r17,7     oooo kkkk dddd kkkk
+    uint16_t ldi17 = 0b1110'0000'0001'0111;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // ldi r16,42    oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0010'0000'1010;
+
+    // jmp 0x3FFF     oooo oook kkkk oook kkkk kkkk kkkk kkkk
+    uint32_t jmp_last = 0b1001'0100'0000'1100'0011'1111'1111'1111;
+
+    // ldi r18,1     oooo kkkk dddd kkkk
+    uint16_t ldi18 = 0b1110'0000'0010'0001;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, cpi);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, jmp_high);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, rjmp);
+
+    // Flash is 0x2000 words, so jumps beyond it land at the same address modulo its size, and the
+    // last word falls through to the first
+    text_bytes.resize(0x1000*2);
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, jmp_last);
+    text_bytes.resize(0x1FFF*2);
+    instr_to_bytes(text_bytes, ldi18);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    sim->run_for(100);
+
+    EXPECT_EQ(42, sim->read(16));
+    EXPECT_EQ(7, sim->read(17));
+    EXPECT_EQ(1, sim->read(18));
+    EXPECT_EQ(decode_raw<16>(rjmp), sim->next_instruction());
+}
+
+TEST_P(engines, subroutine)
+{
+    // ldi r16,255   oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'1111'0000'1111;
+
+    // sts r16,SPL   oooo ooo ddddd oooo
+    uint32_t sts_sp = 0b1001'001'10000'0000'0000'0000'0101'1101;
+
+    // ldi r17,5     oooo kkkk dddd kkkk
+    uint16_t ldi17 = 0b1110'0000'0001'0101;
+
+    // rcall 3         oooo kkkk kkkk kkkk
+    uint16_t rcall = 0b1101'0000'0000'0011;
+
+    // sts r18,0x100      oooo ooo ddddd oooo
+    uint32_t sts_result = 0b1001'001'10010'0000'0000'0001'0000'0000;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // push r17       oooo ooo ddddd oooo
+    uint16_t push = 0b1001'001'10001'1111;
+
+    // pop r18       oooo ooo ddddd oooo
+    uint16_t pop = 0b1001'000'10010'1111;
+
+    // add r18,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10010'0001;
+
+    // ret
+    uint16_t ret = 0b1001'0101'0000'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, sts_sp);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, rcall);
+    instr_to_bytes(text_bytes, sts_result);
+    instr_to_bytes(text_bytes, rjmp);
+    instr_to_bytes(text_bytes, push);
+    instr_to_bytes(text_bytes, pop);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, ret);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    sim->set_breakpoint(7);
+    sim->run();
+
+    EXPECT_EQ(decode_raw<16>(rjmp), sim->next_instruction());
+    EXPECT_EQ(10, sim->read(18));
+    EXPECT_EQ(10, sim->read(0x100));
+    EXPECT_EQ(255, sim->read(SPL));
+    EXPECT_EQ(0x04, sim->read(SPH));
+}
+
+TEST_P(engines, long_loop)
+{
+    // ldi r18,1     oooo kkkk dddd kkkk
+    uint16_t ldi18 = 0b1110'0000'0010'0001;
+
+    // ldi r16,0     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0000;
+
+    // ldi r17,0     oooo kkkk dddd kkkk
+    uint16_t ldi17 = 0b1110'0000'0001'0000;
+
+    // add r16,r18       oooo oo r ddddd rrrr
+    uint16_t add_inner = 0b0000'11'1'10000'0010;
+
+    // brne -2              oooo oo kkkkkkk ooo
+    uint16_t brne_inner = 0b1111'01'1111110'001;
+
+    // add r17,r18       oooo oo r ddddd rrrr
+    uint16_t add_outer = 0b0000'11'1'10001'0010;
+
+    // brne -4              oooo oo kkkkkkk ooo
+    uint16_t brne_outer = 0b1111'01'1111100'001;
+
+    // ldi r19,1     oooo kkkk dddd kkkk
+    uint16_t ldi19 = 0b1110'0000'0011'0001;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi18);
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, add_inner);
+    instr_to_bytes(text_bytes, brne_inner);
+    instr_to_bytes(text_bytes, add_outer);
+    instr_to_bytes(text_bytes, brne_outer);
+    instr_to_bytes(text_bytes, ldi19);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // 256 iterations of the outer loop, each running the inner loop 256 times
+    sim->set_breakpoint(7);
+    sim->run();
+
+    EXPECT_EQ(decode_raw<16>(ldi19), sim->next_instruction());
+    EXPECT_EQ(0, sim->read(16));
+    EXPECT_EQ(0, sim->read(17));
+    EXPECT_EQ(SREG_Z, sim->read(SREG) & SREG_Z);
+}
+
+TEST_P(engines, sreg_flags)
+{
+    // ldi r16,255   oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'1111'0000'1111;
+
+    // ldi r17,1     oooo kkkk dddd kkkk
+    uint16_t ldi17 = 0b1110'0000'0001'0001;
+
+    // add r16,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10000'0001;
+
+    // in r18,SREG   oooo oAA d dddd AAAA
+    uint16_t in = 0b1011'0'11'1'0010'1111;
+
+    // ldi r19,0     oooo kkkk dddd kkkk
+    uint16_t ldi19 = 0b1110'0000'0011'0000;
+
+    // out SREG,r19  oooo oAA r rrrr AAAA
+    uint16_t out = 0b1011'1'11'1'0011'1111;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, in);
+    instr_to_bytes(text_bytes, ldi19);
+    instr_to_bytes(text_bytes, out);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // 0xFF + 1 sets half-carry, zero and carry
+    sim->set_breakpoint(3);
+    sim->run();
+    EXPECT_EQ(SREG_H | SREG_Z | SREG_C, sim->read(SREG));
+
+    // The flags are visible to in, and out replaces them
+    sim->set_breakpoint(6);
+    sim->run();
+    EXPECT_EQ(SREG_H | SREG_Z | SREG_C, sim->read(18));
+    EXPECT_EQ(0, sim->read(SREG));
+}
+
+TEST_P(engines, cycles)
+{
+    // ldi r16,0     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0000;
+
+    // ldi r17,1     oooo kkkk dddd kkkk
+    uint16_t ldi17 = 0b1110'0000'0001'0001;
+
+    // ldi r18,100   oooo kkkk dddd kkkk
+    uint16_t ldi18 = 0b1110'0110'0010'0100;
+
+    // add r16,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10000'0001;
+
+    // cp r16,r18    oooo oo r ddddd rrrr
+    uint16_t cp = 0b0001'01'1'10000'0010;
+
+    // brne -3        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111101'001;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, ldi18);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, cp);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    EXPECT_EQ(0, sim->cycles());
+
+    // Three ldi, then 100 iterations of add, cp and brne, which takes 2 cycles when taken and 1
+    // when not
+    sim->set_breakpoint(6);
+    sim->run();
+    EXPECT_EQ(3 + 100*2 + 99*2 + 1, sim->cycles());
+
+    // rjmp takes 2 cycles
+    sim->delete_breakpoint(6);
+    sim->run_for(10);
+    EXPECT_EQ(3 + 100*2 + 99*2 + 1 + 10, sim->cycles());
+}
+
+TEST_P(engines, run_until_cycle)
+{
+    // ldi r16,0     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0000;
+
+    // ldi r17,1     oooo kkkk dddd kkkk
+    uint16_t ldi17 = 0b1110'0000'0001'0001;
+
+    // add r16,r17   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10000'0001;
+
+    // rjmp -2        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1110;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // Two ldi, then 3 cycles per iteration. The 333rd add finishes at cycle 999, and the rjmp after
+    // it at 1001.
+    sim->run_until_cycle(1000);
+    EXPECT_EQ(1001, sim->cycles());
+    EXPECT_EQ(333 % 256, sim->read(16));
+    EXPECT_EQ(decode_raw<16>(add), sim->next_instruction());
+
+    // Already there
+    sim->run_until_cycle(1000);
+    EXPECT_EQ(1001, sim->cycles());
+}
+
+TEST_P(engines, timer0_overflow_interrupt)
+{
+    // ldi r18,0xFF  oooo kkkk dddd kkkk
+    uint16_t ldi_spl = 0b1110'1111'0010'1111;
+
+    // sts SPL,r18   oooo ooo ddddd oooo
+    uint32_t sts_spl = 0b1001'001'10010'0000'0000'0000'0101'1101;
+
+    // ldi r18,3     oooo kkkk dddd kkkk
+    uint16_t ldi_sph = 0b1110'0000'0010'0011;
+
+    // sts SPH,r18   oooo ooo ddddd oooo
+    uint32_t sts_sph = 0b1001'001'10010'0000'0000'0000'0101'1110;
+
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0001;
+
+    // sts TIMSK0,r16   oooo ooo ddddd oooo
+    uint32_t sts_timsk = 0b1001'001'10000'0000'0000'0000'0110'1110;
+
+    // out TCCR0B,r16   oooo oAA r rrrr AAAA
+    uint16_t out_tccr = 0b1011'1'10'1'0000'0101;
+
+    // sei
+    uint16_t sei = 0b1001'0100'0111'1000;
+
+    // jmp 0x110     oooo oook kkkk oook kkkk kkkk kkkk kkkk
+    uint32_t jmp = 0b1001'0100'0000'1100'0000'0001'0001'0000;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // add r17,r16   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10001'0000;
+
+    // reti
+    uint16_t reti = 0b1001'0101'0001'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_spl);
+    instr_to_bytes(text_bytes, sts_spl);
+    instr_to_bytes(text_bytes, ldi_sph);
+    instr_to_bytes(text_bytes, sts_sph);
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, sts_timsk);
+    instr_to_bytes(text_bytes, out_tccr);
+    instr_to_bytes(text_bytes, sei);
+    instr_to_bytes(text_bytes, jmp);
+
+    // The Timer0 overflow handler is vector 16, at word 32
+    text_bytes.resize(32*2);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, reti);
+
+    // The main loop is past the first 256 words, so returning needs both bytes of the address
+    text_bytes.resize(0x110*2);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // The timer starts counting every cycle from cycle 10, so it overflows at 266, 522 and 778
+    sim->run_until_cycle(1000);
+    EXPECT_EQ(3, sim->read(17));
+    EXPECT_EQ(decode_raw<16>(rjmp), sim->next_instruction());
+    EXPECT_EQ(0xFF, sim->read(SPL));
+    EXPECT_EQ(0, sim->read(0x35) & 1);
+    EXPECT_EQ((sim->cycles() - 10) % 256, sim->read(0x46));
+    EXPECT_EQ(SREG_I, sim->read(SREG) & SREG_I);
+}
+
+TEST_P(engines, timer0_without_interrupts)
+{
+    // ldi r16,2     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0010;
+
+    // out TCCR0B,r16   oooo oAA r rrrr AAAA
+    uint16_t out_tccr = 0b1011'1'10'1'0000'0101;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, out_tccr);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // With a prescaler of 8 the count goes up on every eighth cycle, and wraps at cycle 2048
+    sim->run_until_cycle(2000);
+    EXPECT_EQ(sim->cycles() / 8, sim->read(0x46));
+    EXPECT_EQ(0, sim->read(0x35) & 1);
+
+    // The overflow flag is set, but interrupts are disabled
+    sim->run_until_cycle(3000);
+    EXPECT_EQ(sim->cycles() / 8 % 256, sim->read(0x46));
+    EXPECT_EQ(1, sim->read(0x35) & 1);
+    EXPECT_EQ(decode_raw<16>(rjmp), sim->next_instruction());
+}
+
+TEST_P(engines, idle_loop)
+{
+    // ldi r18,0xFF  oooo kkkk dddd kkkk
+    uint16_t ldi_spl = 0b1110'1111'0010'1111;
+
+    // sts SPL,r18   oooo ooo ddddd oooo
+    uint32_t sts_spl = 0b1001'001'10010'0000'0000'0000'0101'1101;
+
+    // ldi r18,3     oooo kkkk dddd kkkk
+    uint16_t ldi_sph = 0b1110'0000'0010'0011;
+
+    // sts SPH,r18   oooo ooo ddddd oooo
+    uint32_t sts_sph = 0b1001'001'10010'0000'0000'0000'0101'1110;
+
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi_toie = 0b1110'0000'0000'0001;
+
+    // sts TIMSK0,r16   oooo ooo ddddd oooo
+    uint32_t sts_timsk = 0b1001'001'10000'0000'0000'0000'0110'1110;
+
+    // ldi r16,5     oooo kkkk dddd kkkk
+    uint16_t ldi_prescale = 0b1110'0000'0000'0101;
+
+    // out TCCR0B,r16   oooo oAA r rrrr AAAA
+    uint16_t out_tccr = 0b1011'1'10'1'0000'0101;
+
+    // sei
+    uint16_t sei = 0b1001'0100'0111'1000;
+
+    // lds r17,0x100    oooo ooo ddddd oooo
+    uint32_t lds = 0b1001'000'10001'0000'0000'0001'0000'0000;
+
+    // cpi r17,1     oooo kkkk dddd kkkk
+    uint16_t cpi = 0b0011'0000'0001'0001;
+
+    // brne -4        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111100'001;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // ldi r19,1     oooo kkkk dddd kkkk
+    uint16_t ldi19 = 0b1110'0000'0011'0001;
+
+    // sts 0x100,r19    oooo ooo ddddd oooo
+    uint32_t sts_flag = 0b1001'001'10011'0000'0000'0001'0000'0000;
+
+    // reti
+    uint16_t reti = 0b1001'0101'0001'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_spl);
+    instr_to_bytes(text_bytes, sts_spl);
+    instr_to_bytes(text_bytes, ldi_sph);
+    instr_to_bytes(text_bytes, sts_sph);
+    instr_to_bytes(text_bytes, ldi_toie);
+    instr_to_bytes(text_bytes, sts_timsk);
+    instr_to_bytes(text_bytes, ldi_prescale);
+    instr_to_bytes(text_bytes, out_tccr);
+    instr_to_bytes(text_bytes, sei);
+    instr_to_bytes(text_bytes, lds);
+    instr_to_bytes(text_bytes, cpi);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, rjmp);
+
+    // The Timer0 overflow handler sets the flag the main program is waiting for
+    text_bytes.resize(32*2);
+    instr_to_bytes(text_bytes, ldi19);
+    instr_to_bytes(text_bytes, sts_flag);
+    instr_to_bytes(text_bytes, reti);
+
+    auto text = text_segment(text_bytes);
+
+    // Skipping the wait for the overflow, 2^18 cycles away, has to give exactly the same result as
+    // stepping through every iteration
+    auto run = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    run->set_breakpoint(16);
+    run->run();
+
+    auto stepped = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    while (stepped->next_instruction() != decode_raw<16>(rjmp)) {
+        stepped->step();
+    }
+
+    EXPECT_EQ(decode_raw<16>(rjmp), run->next_instruction());
+    EXPECT_LT(1024*256, run->cycles());
+    EXPECT_EQ(stepped->cycles(), run->cycles());
+    EXPECT_EQ(1, run->read(17));
+    EXPECT_EQ(stepped->read(SREG), run->read(SREG));
+    EXPECT_EQ(stepped->read(0x46), run->read(0x46));
+
+    // The same holds when the wait ends at a cycle rather than at a breakpoint
+    auto until = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    until->run_until_cycle(100001);
+    auto stepped_until = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    while (stepped_until->cycles() < 100001) {
+        stepped_until->step();
+    }
+    EXPECT_EQ(stepped_until->cycles(), until->cycles());
+    EXPECT_EQ(stepped_until->next_instruction(), until->next_instruction());
+}
+
+TEST_P(engines, run_until_pc_in_idle_loop)
+{
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi_prescale = 0b1110'0000'0000'0001;
+
+    // out TCCR0B,r16   oooo oAA r rrrr AAAA
+    uint16_t out_tccr = 0b1011'1'10'1'0000'0101;
+
+    // ldi r19,0     oooo kkkk dddd kkkk
+    uint16_t ldi19 = 0b1110'0000'0011'0000;
+
+    // lds r17,0x100    oooo ooo ddddd oooo
+    uint32_t lds = 0b1001'000'10001'0000'0000'0001'0000'0000;
+
+    // cpi r17,1     oooo kkkk dddd kkkk
+    uint16_t cpi = 0b0011'0000'0001'0001;
+
+    // brne -4        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111100'001;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_prescale);
+    instr_to_bytes(text_bytes, out_tccr);
+    instr_to_bytes(text_bytes, ldi19);
+    instr_to_bytes(text_bytes, lds);
+    instr_to_bytes(text_bytes, cpi);
+    instr_to_bytes(text_bytes, brne);
+
+    auto text = text_segment(text_bytes);
+
+    // The loop waits for the timer to overflow, but running to a pc inside it must stop at the next
+    // iteration rather than skipping to the overflow
+    auto run = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    auto stepped = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    for (address_t address : {3, 5, 3, 6, 3}) {
+        EXPECT_EQ(stop_kind::done, run->run_until_pc(address).kind);
+        do {
+            stepped->step();
+        } while (stepped->next_instruction() != run->next_instruction());
+        EXPECT_EQ(stepped->cycles(), run->cycles()) << "to " << address;
+    }
+    EXPECT_GT(20u, run->cycles());
+}
+
+TEST_P(engines, countdown_loops)
+{
+    // ldi r24,0x34  oooo kkkk dddd kkkk
+    uint16_t ldi24 = 0b1110'0011'1000'0100;
+
+    // ldi r25,0x12  oooo kkkk dddd kkkk
+    uint16_t ldi25 = 0b1110'0001'1001'0010;
+
+    // sbiw r24,1    oooo oooo kkpp kkkk
+    uint16_t sbiw = 0b1001'0111'00'00'0001;
+
+    // brne -2        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111110'001;
+
+    // ldi r16,200   oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'1100'0000'1000;
+
+    // subi r16,3    oooo kkkk dddd kkkk
+    uint16_t subi = 0b0101'0000'0000'0011;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi24);
+    instr_to_bytes(text_bytes, ldi25);
+    instr_to_bytes(text_bytes, sbiw);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, subi);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+
+    // 0x1234 iterations of the first loop, and 152 of the second, since 152 * 3 = 200 mod 256. Both
+    // have to come out exactly as if every iteration had been run.
+    auto run = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    run->set_breakpoint(7);
+    run->run();
+
+    auto stepped = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    while (stepped->next_instruction() != decode_raw<16>(rjmp)) {
+        stepped->step();
+    }
+
+    EXPECT_EQ(2 + 0x1234*4 - 1 + 1 + 152*3 - 1, run->cycles());
+    EXPECT_EQ(stepped->cycles(), run->cycles());
+    EXPECT_EQ(stepped->read(SREG), run->read(SREG));
+    EXPECT_EQ(0, run->read(24));
+    EXPECT_EQ(0, run->read(25));
+    EXPECT_EQ(0, run->read(16));
+
+    // Stopping part of the way through a loop
+    for (uint64_t cycle : {10001, 18650}) {
+        auto until = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+        until->run_until_cycle(cycle);
+        auto stepped_until = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+        while (stepped_until->cycles() < cycle) {
+            stepped_until->step();
+        }
+        EXPECT_EQ(stepped_until->cycles(), until->cycles());
+        EXPECT_EQ(stepped_until->read(SREG), until->read(SREG));
+        EXPECT_EQ(stepped_until->read(24), until->read(24));
+        EXPECT_EQ(stepped_until->read(25), until->read(25));
+        EXPECT_EQ(stepped_until->read(16), until->read(16));
+    }
+}
+
+namespace {
+
+    // Sets up the stack and Timer0 with the overflow interrupt, then sleeps in a loop. The overflow
+    // handler counts in r17. Leaving out the overflow interrupt stores zero in TIMSK0 instead, and
+    // leaving interrupts disabled runs cli in place of sei, which keeps the timing the same.
+    std::vector<byte_t> sleep_program(uint8_t tccr0b, uint8_t smcr, bool overflow_interrupt = true,
+        bool sei_before_sleep = true)
+    {
+        // ldi r18,0xFF  oooo kkkk dddd kkkk
+        uint16_t ldi_spl = 0b1110'1111'0010'1111;
+
+        // sts SPL,r18   oooo ooo ddddd oooo
+        uint32_t sts_spl = 0b1001'001'10010'0000'0000'0000'0101'1101;
+
+        // ldi r18,3     oooo kkkk dddd kkkk
+        uint16_t ldi_sph = 0b1110'0000'0010'0011;
+
+        // sts SPH,r18   oooo ooo ddddd oooo
+        uint32_t sts_sph = 0b1001'001'10010'0000'0000'0000'0101'1110;
+
+        // ldi r16,1     oooo kkkk dddd kkkk
+        uint16_t ldi16 = 0b1110'0000'0000'0001;
+
+        // sts TIMSK0,r16   oooo ooo ddddd oooo
+        uint32_t sts_timsk = 0b1001'001'10000'0000'0000'0000'0110'1110;
+
+        // sts TIMSK0,r1    oooo ooo ddddd oooo
+        uint32_t sts_timsk_zero = 0b1001'001'00001'0000'0000'0000'0110'1110;
+
+        // ldi r18,tccr0b   oooo kkkk dddd kkkk
+        uint16_t ldi_tccr = 0b1110'0000'0010'0000 | (tccr0b & 0xF0) << 4 | (tccr0b & 0xF);
+
+        // out TCCR0B,r18   oooo oAA r rrrr AAAA
+        uint16_t out_tccr = 0b1011'1'10'1'0010'0101;
+
+        // ldi r18,smcr  oooo kkkk dddd kkkk
+        uint16_t ldi_smcr = 0b1110'0000'0010'0000 | (smcr & 0xF0) << 4 | (smcr & 0xF);
+
+        // out SMCR,r18  oooo oAA r rrrr AAAA
+        uint16_t out_smcr = 0b1011'1'11'1'0010'0011;
+
+        // sei
+        uint16_t sei = 0b1001'0100'0111'1000;
+
+        // cli
+        uint16_t cli = 0b1001'0100'1111'1000;
+
+        // sleep
+        uint16_t sleep = 0b1001'0101'1000'1000;
+
+        // rjmp -2        oooo kkkk kkkk kkkk
+        uint16_t rjmp = 0b1100'1111'1111'1110;
+
+        // add r17,r16   oooo oo r ddddd rrrr
+        uint16_t add = 0b0000'11'1'10001'0000;
+
+        // reti
+        uint16_t reti = 0b1001'0101'0001'1000;
+
+        std::vector<byte_t> text_bytes;
+        instr_to_bytes(text_bytes, ldi_spl);
+        instr_to_bytes(text_bytes, sts_spl);
+        instr_to_bytes(text_bytes, ldi_sph);
+        instr_to_bytes(text_bytes, sts_sph);
+        instr_to_bytes(text_bytes, ldi16);
+        instr_to_bytes(text_bytes, overflow_interrupt ? sts_timsk : sts_timsk_zero);
+        instr_to_bytes(text_bytes, ldi_tccr);
+        instr_to_bytes(text_bytes, out_tccr);
+        instr_to_bytes(text_bytes, ldi_smcr);
+        instr_to_bytes(text_bytes, out_smcr);
+        instr_to_bytes(text_bytes, sei_before_sleep ? sei : cli);
+        instr_to_bytes(text_bytes, sleep);
+        instr_to_bytes(text_bytes, rjmp);
+
+        text_bytes.resize(32*2);
+        instr_to_bytes(text_bytes, add);
+        instr_to_bytes(text_bytes, reti);
+        return text_bytes;
+    }
+
+}
+
+TEST_P(engines, sleep_until_interrupt)
+{
+    // Idle mode, with the timer counting every 1024 cycles from cycle 11. It overflows every 2^18
+    // cycles, which is all the simulator has to look at.
+    auto text = text_segment(sleep_program(5, 0b000'1));
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    auto reason = sim->run_until_cycle(10*(1 << 18) + 100);
+    EXPECT_EQ(stop_kind::cycle_limit, reason.kind);
+    EXPECT_EQ(10*(1 << 18) + 100, reason.cycle);
+    EXPECT_EQ(10, sim->read(17));
+
+    // Stepping while asleep waits for the next interrupt, and takes it
+    uint16_t add = 0b0000'11'1'10001'0000;
+    sim->step();
+    EXPECT_EQ(decode_raw<16>(add), sim->next_instruction());
+    EXPECT_EQ(11*(1 << 18) + 8, sim->cycles());
+}
+
+TEST_P(engines, sleep_in_power_down)
+{
+    // Power-down stops the I/O clock, so the timer stops at the count it had when the CPU went to
+    // sleep at cycle 15, and nothing wakes it
+    auto text = text_segment(sleep_program(1, 0b010'1));
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    sim->run_until_cycle(1000000);
+    EXPECT_EQ(1000000, sim->cycles());
+    EXPECT_EQ(0, sim->read(17));
+    EXPECT_EQ(15 - 11, sim->read(0x46));
+
+    // With nothing left to wake it, running returns
+    auto reason = sim->run();
+    EXPECT_EQ(stop_kind::asleep, reason.kind);
+    EXPECT_EQ(1000000, reason.cycle);
+}
+
+TEST_P(engines, sleep_with_interrupts_disabled)
+{
+    // The timer overflows and its interrupt is enabled, but with I clear the CPU cannot take it, so
+    // running returns as soon as the CPU goes to sleep at cycle 15
+    auto text = text_segment(sleep_program(1, 0b000'1, true, false));
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    auto reason = sim->run();
+    EXPECT_EQ(stop_kind::asleep, reason.kind);
+    EXPECT_EQ(15, reason.cycle);
+    EXPECT_EQ(0, sim->read(17));
+
+    // Time still passes up to a cycle limit, and the timer keeps counting
+    reason = sim->run_until_cycle(1000);
+    EXPECT_EQ(stop_kind::cycle_limit, reason.kind);
+    EXPECT_EQ(1000, sim->cycles());
+    EXPECT_EQ(1, sim->read(0x35) & 1);
+    EXPECT_EQ(0, sim->read(17));
+}
+
+TEST_P(engines, sleep_with_timer_interrupt_masked)
+{
+    // The timer keeps overflowing, but with TOIE0 clear none of its overflows can wake the CPU
+    auto text = text_segment(sleep_program(1, 0b000'1, false));
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    auto reason = sim->run();
+    EXPECT_EQ(stop_kind::asleep, reason.kind);
+    EXPECT_EQ(15, reason.cycle);
+    EXPECT_EQ(0, sim->read(17));
+}
+
+TEST_P(engines, halt)
+{
+    // cli
+    uint16_t cli = 0b1001'0100'1111'1000;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // ldi r24,1     oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0000'1000'0001;
+
+    // subi r24,2    oooo kkkk dddd kkkk
+    uint16_t subi = 0b0101'0000'1000'0010;
+
+    // brne -2        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111110'001;
+
+    // What exit() ends with: nothing can ever get out of the loop
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, cli);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    auto reason = sim->run();
+    EXPECT_EQ(stop_kind::halted, reason.kind);
+    EXPECT_EQ(1, reason.pc);
+
+    // A countdown which steps over zero never ends either
+    text_bytes.clear();
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, subi);
+    instr_to_bytes(text_bytes, brne);
+
+    text = text_segment(text_bytes);
+    sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    reason = sim->run();
+    EXPECT_EQ(stop_kind::halted, reason.kind);
+    EXPECT_EQ(1, reason.pc);
+
+    // Stepping still goes round
+    reason = sim->step();
+    EXPECT_EQ(stop_kind::done, reason.kind);
+    EXPECT_EQ(2, reason.pc);
+}
+
+TEST_P(engines, port_pins)
+{
+    // ldi r16,0x0F  oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'1111;
+
+    // out DDRB,r16  oooo oAA r rrrr AAAA
+    uint16_t out_ddr = 0b1011'1'00'1'0000'0100;
+
+    // ldi r17,0x05  oooo kkkk dddd kkkk
+    uint16_t ldi17 = 0b1110'0000'0001'0101;
+
+    // out PINB,r17  oooo oAA r rrrr AAAA
+    uint16_t out_pin = 0b1011'1'00'1'0001'0011;
+
+    // in r18,PINB   oooo oAA d dddd AAAA
+    uint16_t in = 0b1011'0'00'1'0010'0011;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, out_ddr);
+    instr_to_bytes(text_bytes, ldi17);
+    instr_to_bytes(text_bytes, out_pin);
+    instr_to_bytes(text_bytes, in);
+    instr_to_bytes(text_bytes, out_pin);
+    instr_to_bytes(text_bytes, in);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // The upper four pins are inputs, two of them driven from outside
+    sim->drive_pins('B', 0x30, 0x10);
+
+    // Writing ones to PINB toggles those bits of PORTB, which drive the outputs
+    sim->run_until_pc(5);
+    EXPECT_EQ(0x05, sim->read(0x25));
+    EXPECT_EQ(0x15, sim->read(18));
+
+    sim->run_until_pc(7);
+    EXPECT_EQ(0x00, sim->read(0x25));
+    EXPECT_EQ(0x10, sim->read(18));
+
+    EXPECT_THROW(sim->drive_pins('A', 1, 1), std::invalid_argument);
+}
+
+TEST_P(engines, serial_echo)
+{
+    // ldi r18,0xFF  oooo kkkk dddd kkkk
+    uint16_t ldi_spl = 0b1110'1111'0010'1111;
+
+    // sts SPL,r18   oooo ooo ddddd oooo
+    uint32_t sts_spl = 0b1001'001'10010'0000'0000'0000'0101'1101;
+
+    // ldi r18,3     oooo kkkk dddd kkkk
+    uint16_t ldi_sph = 0b1110'0000'0010'0011;
+
+    // sts SPH,r18   oooo ooo ddddd oooo
+    uint32_t sts_sph = 0b1001'001'10010'0000'0000'0000'0101'1110;
+
+    // ldi r16,RXCIE0|RXEN0|TXEN0   oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'1001'0000'1000;
+
+    // sts UCSR0B,r16   oooo ooo ddddd oooo
+    uint32_t sts_ucsr = 0b1001'001'10000'0000'0000'0000'1100'0001;
+
+    // sei
+    uint16_t sei = 0b1001'0100'0111'1000;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // lds r18,UDR0  oooo ooo ddddd oooo
+    uint32_t lds = 0b1001'000'10010'0000'0000'0000'1100'0110;
+
+    // sts UDR0,r18  oooo ooo ddddd oooo
+    uint32_t sts_udr = 0b1001'001'10010'0000'0000'0000'1100'0110;
+
+    // reti
+    uint16_t reti = 0b1001'0101'0001'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_spl);
+    instr_to_bytes(text_bytes, sts_spl);
+    instr_to_bytes(text_bytes, ldi_sph);
+    instr_to_bytes(text_bytes, sts_sph);
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, sts_ucsr);
+    instr_to_bytes(text_bytes, sei);
+    instr_to_bytes(text_bytes, rjmp);
+
+    // The receive complete handler sends back whatever arrived
+    text_bytes.resize(36*2);
+    instr_to_bytes(text_bytes, lds);
+    instr_to_bytes(text_bytes, sts_udr);
+    instr_to_bytes(text_bytes, reti);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // Nothing in the program can end the wait for a byte
+    EXPECT_EQ(stop_kind::halted, sim->run().kind);
+    EXPECT_EQ(0x20, sim->read(0xC0));
+
+    sim->serial_receive({'a', 'b', 'c'});
+    EXPECT_EQ(0xA0, sim->read(0xC0));
+
+    // Looking at UDR0 from outside takes nothing out of the receive buffer
+    EXPECT_EQ(0, sim->read(0xC6));
+    EXPECT_EQ(0xA0, sim->read(0xC0));
+    EXPECT_EQ(stop_kind::halted, sim->run().kind);
+    EXPECT_EQ((std::vector<byte_t>{'a', 'b', 'c'}), sim->serial_transmitted());
+    EXPECT_TRUE(sim->serial_transmitted().empty());
+    EXPECT_EQ(0x60, sim->read(0xC0));
+}
+
+TEST_P(engines, snapshot_and_restore)
+{
+    // ldi r18,0xFF  oooo kkkk dddd kkkk
+    uint16_t ldi_spl = 0b1110'1111'0010'1111;
+
+    // sts SPL,r18   oooo ooo ddddd oooo
+    uint32_t sts_spl = 0b1001'001'10010'0000'0000'0000'0101'1101;
+
+    // ldi r18,3     oooo kkkk dddd kkkk
+    uint16_t ldi_sph = 0b1110'0000'0010'0011;
+
+    // sts SPH,r18   oooo ooo ddddd oooo
+    uint32_t sts_sph = 0b1001'001'10010'0000'0000'0000'0101'1110;
+
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0001;
+
+    // sts TIMSK0,r16   oooo ooo ddddd oooo
+    uint32_t sts_timsk = 0b1001'001'10000'0000'0000'0000'0110'1110;
+
+    // out TCCR0B,r16   oooo oAA r rrrr AAAA
+    uint16_t out_tccr = 0b1011'1'10'1'0000'0101;
+
+    // sei
+    uint16_t sei = 0b1001'0100'0111'1000;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // add r17,r16   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10001'0000;
+
+    // sts 0x200,r17   oooo ooo ddddd oooo
+    uint32_t sts_count = 0b1001'001'10001'0000'0000'0010'0000'0000;
+
+    // reti
+    uint16_t reti = 0b1001'0101'0001'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_spl);
+    instr_to_bytes(text_bytes, sts_spl);
+    instr_to_bytes(text_bytes, ldi_sph);
+    instr_to_bytes(text_bytes, sts_sph);
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, sts_timsk);
+    instr_to_bytes(text_bytes, out_tccr);
+    instr_to_bytes(text_bytes, sei);
+    instr_to_bytes(text_bytes, rjmp);
+
+    // The Timer0 overflow handler counts overflows in r17 and in SRAM
+    text_bytes.resize(32*2);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, sts_count);
+    instr_to_bytes(text_bytes, reti);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // The timer overflows at cycles 265, 521 and 777
+    sim->run_until_cycle(300);
+    auto first = sim->snapshot();
+    EXPECT_EQ(1, sim->read(0x200));
+
+    sim->run_until_cycle(600);
+    auto second = sim->snapshot();
+    auto cycles = sim->cycles();
+    EXPECT_EQ(2, sim->read(0x200));
+
+    sim->run_until_cycle(1000);
+    EXPECT_EQ(3, sim->read(17));
+    EXPECT_EQ(3, sim->read(0x200));
+    auto tcnt = sim->read(0x46);
+
+    // Going back to the older snapshot undoes the writes made after either of them
+    sim->restore(first);
+    EXPECT_EQ(1, sim->read(17));
+    EXPECT_EQ(1, sim->read(0x200));
+    EXPECT_LT(sim->cycles(), 300u + 5);
+
+    // Then forward to the newer one, which must bring back the page changed since the older
+    sim->restore(second);
+    EXPECT_EQ(cycles, sim->cycles());
+    EXPECT_EQ(2, sim->read(17));
+    EXPECT_EQ(2, sim->read(0x200));
+
+    // The timer and its scheduled overflow come back too, so running again ends up in the same place
+    sim->run_until_cycle(1000);
+    EXPECT_EQ(3, sim->read(17));
+    EXPECT_EQ(3, sim->read(0x200));
+    EXPECT_EQ(tcnt, sim->read(0x46));
+
+    sim->restore(first);
+    sim->run_until_cycle(1000);
+    EXPECT_EQ(3, sim->read(0x200));
+    EXPECT_EQ(tcnt, sim->read(0x46));
+
+    auto other = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+    EXPECT_THROW(other->restore(first), std::invalid_argument);
+}
+
+TEST_P(engines, reset)
+{
+    // ldi r16,0x42  oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0100'0000'0010;
+
+    // sts 0x200,r16   oooo ooo ddddd oooo
+    uint32_t sts = 0b1001'001'10000'0000'0000'0010'0000'0000;
+
+    // push r16       oooo ooo ddddd oooo
+    uint16_t push = 0b1001'001'10000'1111;
+
+    // sei
+    uint16_t sei = 0b1001'0100'0111'1000;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, sts);
+    instr_to_bytes(text_bytes, push);
+    instr_to_bytes(text_bytes, sei);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    sim->run_until_cycle(100);
+    auto before_reset = sim->snapshot();
+    EXPECT_EQ(0x42, sim->read(0x200));
+
+    // Everything goes back, with the stack pointer at RAMEND
+    sim->reset();
+    EXPECT_EQ(0u, sim->cycles());
+    EXPECT_EQ(LDI, sim->next_instruction().op);
+    EXPECT_EQ(0, sim->read(16));
+    EXPECT_EQ(0, sim->read(0x200));
+    EXPECT_EQ(0, sim->read(SREG));
+    EXPECT_EQ(0xFF, sim->read(SPL));
+    EXPECT_EQ(0x04, sim->read(SPH));
+
+    sim->run_until_cycle(100);
+    EXPECT_EQ(0x42, sim->read(0x200));
+    EXPECT_EQ(0x42, sim->read(0x4FF));
+    EXPECT_EQ(0xFE, sim->read(SPL));
+
+    // A snapshot from before a reset can still be restored, and the pages it brings back are
+    // cleared by the next reset
+    sim->restore(before_reset);
+    EXPECT_EQ(0x42, sim->read(0x200));
+    EXPECT_EQ(0x42, sim->read(0x4FF));
+    sim->reset();
+    EXPECT_EQ(0, sim->read(0x200));
+    EXPECT_EQ(0, sim->read(0x4FF));
+}
+
+TEST_P(engines, reset_runs_like_load)
+{
+    // ldi r16,0x42  oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0100'0000'0010;
+
+    // push r16       oooo ooo ddddd oooo
+    uint16_t push = 0b1001'001'10000'1111;
+
+    // rcall 1         oooo kkkk kkkk kkkk
+    uint16_t rcall = 0b1101'0000'0000'0001;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // pop r17       oooo ooo ddddd oooo
+    uint16_t pop = 0b1001'000'10001'1111;
+
+    // ret
+    uint16_t ret = 0b1001'0101'0000'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, push);
+    instr_to_bytes(text_bytes, rcall);
+    instr_to_bytes(text_bytes, rjmp);
+    instr_to_bytes(text_bytes, push);
+    instr_to_bytes(text_bytes, pop);
+    instr_to_bytes(text_bytes, ret);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // The stack is used straight after load, without the program setting the stack pointer, so
+    // a run after reset only matches one after load if both start from the same state
+    auto data_space = [&]() {
+        std::vector<byte_t> bytes;
+        for (address_t address = 0; address < 0x500; ++address) {
+            bytes.push_back(sim->read(address));
+        }
+        return bytes;
+    };
+    auto after_load = data_space();
+    sim->run_until_cycle(100);
+    auto pc_after_load = sim->next_instruction();
+    auto run_after_load = data_space();
+    EXPECT_EQ(0x42, sim->read(17));
+
+    sim->reset();
+    EXPECT_EQ(after_load, data_space());
+    sim->run_until_cycle(100);
+    EXPECT_EQ(pc_after_load, sim->next_instruction());
+    EXPECT_EQ(run_after_load, data_space());
+}
+
+TEST_P(engines, reverse_execution)
+{
+    // ldi r18,0xFF  oooo kkkk dddd kkkk
+    uint16_t ldi_spl = 0b1110'1111'0010'1111;
+
+    // sts SPL,r18   oooo ooo ddddd oooo
+    uint32_t sts_spl = 0b1001'001'10010'0000'0000'0000'0101'1101;
+
+    // ldi r18,3     oooo kkkk dddd kkkk
+    uint16_t ldi_sph = 0b1110'0000'0010'0011;
+
+    // sts SPH,r18   oooo ooo ddddd oooo
+    uint32_t sts_sph = 0b1001'001'10010'0000'0000'0000'0101'1110;
+
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0001;
+
+    // sts TIMSK0,r16   oooo ooo ddddd oooo
+    uint32_t sts_timsk = 0b1001'001'10000'0000'0000'0000'0110'1110;
+
+    // out TCCR0B,r16   oooo oAA r rrrr AAAA
+    uint16_t out_tccr = 0b1011'1'10'1'0000'0101;
+
+    // sei
+    uint16_t sei = 0b1001'0100'0111'1000;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    // add r17,r16   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10001'0000;
+
+    // sts 0x200,r17   oooo ooo ddddd oooo
+    uint32_t sts_count = 0b1001'001'10001'0000'0000'0010'0000'0000;
+
+    // reti
+    uint16_t reti = 0b1001'0101'0001'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_spl);
+    instr_to_bytes(text_bytes, sts_spl);
+    instr_to_bytes(text_bytes, ldi_sph);
+    instr_to_bytes(text_bytes, sts_sph);
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, sts_timsk);
+    instr_to_bytes(text_bytes, out_tccr);
+    instr_to_bytes(text_bytes, sei);
+    instr_to_bytes(text_bytes, rjmp);
+
+    // The Timer0 overflow handler counts overflows in r17 and in SRAM
+    text_bytes.resize(32*2);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, sts_count);
+    instr_to_bytes(text_bytes, reti);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), GetParam());
+
+    // Without a history there is nowhere to go back to
+    EXPECT_EQ(stop_kind::history_start, sim->reverse_step().kind);
+    sim->keep_history(true);
+
+    // Go back over the steps into and out of the second overflow handler, one at a time
+    sim->run_until_cycle(600);
+    sim->set_breakpoint(32);
+    auto reason = sim->reverse_continue();
+    EXPECT_EQ(stop_kind::breakpoint, reason.kind);
+    EXPECT_EQ(32, reason.pc);
+    EXPECT_EQ(1, sim->read(17));
+    EXPECT_EQ(1, sim->read(0x200));
+
+    std::vector<uint64_t> cycles;
+    std::vector<byte_t> sp;
+    for (int i = 0; i < 3; ++i) {
+        cycles.push_back(sim->cycles());
+        sp.push_back(sim->read(SPL));
+        sim->step();
+    }
+    EXPECT_EQ(2, sim->read(0x200));
+    EXPECT_EQ(0xFF, sim->read(SPL));
+
+    for (int i = 2; i >= 0; --i) {
+        EXPECT_EQ(stop_kind::done, sim->reverse_step().kind);
+        EXPECT_EQ(cycles[i], sim->cycles());
+        EXPECT_EQ(sp[i], sim->read(SPL));
+    }
+    EXPECT_EQ(1, sim->read(0x200));
+
+    // Going back out of the handler, which takes replaying from a checkpoint, ends up in the main loop
+    reason = sim->reverse_step();
+    EXPECT_EQ(stop_kind::done, reason.kind);
+    EXPECT_EQ(11, reason.pc);
+    EXPECT_EQ(SREG_I, sim->read(SREG) & SREG_I);
+    EXPECT_EQ(0xFF, sim->read(SPL));
+    EXPECT_EQ(stop_kind::breakpoint, sim->step().kind);
+    EXPECT_EQ(cycles[0], sim->cycles());
+
+    reason = sim->reverse_continue();
+    EXPECT_EQ(stop_kind::breakpoint, reason.kind);
+    EXPECT_EQ(0, sim->read(17));
+    EXPECT_EQ(0, sim->read(0x200));
+
+    reason = sim->reverse_continue();
+    EXPECT_EQ(stop_kind::history_start, reason.kind);
+    EXPECT_EQ(0, reason.pc);
+    EXPECT_EQ(0, reason.cycle);
+
+    // A long run is checkpointed along the way, and running it again gets to the same place
+    sim->delete_breakpoint(32);
+    sim->run_until_cycle(3 << 20);
+    auto end = sim->cycles();
+    auto count = sim->read(0x200);
+    auto tcnt = sim->read(0x46);
+
+    sim->set_breakpoint(32);
+    reason = sim->reverse_continue();
+    EXPECT_EQ(stop_kind::breakpoint, reason.kind);
+    EXPECT_GT(reason.cycle + 300, end);
+    EXPECT_EQ(byte_t(count - 1), sim->read(0x200));
+    EXPECT_EQ(byte_t(count - 1), sim->read(17));
+    EXPECT_EQ(11, sim->reverse_step().pc);
+
+    sim->delete_breakpoint(32);
+    sim->run_until_cycle(3 << 20);
+    EXPECT_EQ(end, sim->cycles());
+    EXPECT_EQ(tcnt, sim->read(0x46));
+    EXPECT_EQ(count, sim->read(0x200));
+}
+
+TEST_P(engines, shared_image)
+{
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi16 = 0b1110'0000'0000'0001;
+
+    // add r17,r16   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10001'0000;
+
+    // rjmp -2        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1110;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi16);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+    auto image = load_program(atmega168, *text, std::vector<segment *>());
+    auto first = program_with_image(image, GetParam());
+    auto second = program_with_image(image, GetParam());
+
+    // A breakpoint in one simulator is not in the other
+    first->set_breakpoint(1);
+    first->run();
+    first->run();
+    EXPECT_EQ(1, first->read(17));
+
+    EXPECT_EQ(stop_kind::cycle_limit, second->run_for(30).kind);
+    EXPECT_LT(5, second->read(17));
+
+    // Nor does it stay in its own once it is deleted
+    first->delete_breakpoint(1);
+    EXPECT_EQ(stop_kind::cycle_limit, first->run_for(30).kind);
+    EXPECT_LT(5, first->read(17));
+}
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "avr/boards.h"
+#include "fuzz.h"
+
+#include "mock_segment.h"
+
+using namespace avr;
+using namespace simulator;
+using namespace testing;
+
+TEST(fuzz, finds_crashes_behind_comparisons)
+{
+    // ldi r18,0xFF  oooo kkkk dddd kkkk
+    uint16_t ldi_spl = 0b1110'1111'0010'1111;
+
+    // sts SPL,r18   oooo ooo ddddd oooo
+    uint32_t sts_spl = 0b1001'001'10010'0000'0000'0000'0101'1101;
+
+    // ldi r18,4     oooo kkkk dddd kkkk
+    uint16_t ldi_sph = 0b1110'0000'0010'0100;
+
+    // sts SPH,r18   oooo ooo ddddd oooo
+    uint32_t sts_sph = 0b1001'001'10010'0000'0000'0000'0101'1110;
+
+    // lds r16,0x100   oooo ooo ddddd oooo
+    uint32_t lds16 = 0b1001'000'10000'0000'0000'0001'0000'0000;
+
+    // cpi r16,0x46  oooo KKKK dddd KKKK
+    uint16_t cpi_f = 0b0011'0100'0000'0110;
+
+    // brne -4       oooo oo kkkkkkk ooo
+    uint16_t brne_entry = 0b1111'01'1111100'001;
+
+    // lds r17,0x101   oooo ooo ddddd oooo
+    uint32_t lds17 = 0b1001'000'10001'0000'0000'0001'0000'0001;
+
+    // cpi r17,0x55  oooo KKKK dddd KKKK
+    uint16_t cpi_u = 0b0011'0101'0001'0101;
+
+    // brne +2       oooo oo kkkkkkk ooo
+    uint16_t brne_store = 0b1111'01'0000010'001;
+
+    // sts 0x180,r17   oooo ooo ddddd oooo
+    uint32_t sts = 0b1001'001'10001'0000'0000'0001'1000'0000;
+
+    // cpi r17,0x5A  oooo KKKK dddd KKKK
+    uint16_t cpi_z = 0b0011'0101'0001'1010;
+
+    // brne +1       oooo oo kkkkkkk ooo
+    uint16_t brne_recurse = 0b1111'01'0000001'001;
+
+    // rcall -1      oooo kkkk kkkk kkkk
+    uint16_t rcall = 0b1101'1111'1111'1111;
+
+    // rjmp -14      oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'0010;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi_spl);
+    instr_to_bytes(text_bytes, sts_spl);
+    instr_to_bytes(text_bytes, ldi_sph);
+    instr_to_bytes(text_bytes, sts_sph);
+    instr_to_bytes(text_bytes, lds16);      // 6, the entry point
+    instr_to_bytes(text_bytes, cpi_f);
+    instr_to_bytes(text_bytes, brne_entry);
+    instr_to_bytes(text_bytes, lds17);
+    instr_to_bytes(text_bytes, cpi_u);
+    instr_to_bytes(text_bytes, brne_store);
+    instr_to_bytes(text_bytes, sts);
+    instr_to_bytes(text_bytes, cpi_z);
+    instr_to_bytes(text_bytes, brne_recurse);
+    instr_to_bytes(text_bytes, rcall);      // 18, calls itself forever
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto text = text_segment(text_bytes);
+
+    fuzz_target target;
+    target.image = load_program(atmega168, *text, {});
+    target.entry = 6;
+    target.input = 0x100;
+    target.input_size = 4;
+    target.stack_limit = 0x300;
+    target.watchpoints = {0x180};
+
+    // "FU" stores to the watchpoint, and "FZ" recurses until the stack overflows
+    auto fuzz = make_fuzzer(target);
+    std::vector<fuzz_crash> crashes;
+    while (crashes.size() < 2 && fuzz->executions() < 1000000) {
+        for (auto & crash : fuzz->run(1000)) {
+            crashes.push_back(crash);
+        }
+    }
+
+    ASSERT_EQ(2u, crashes.size());
+    std::sort(crashes.begin(), crashes.end(),
+        [](const fuzz_crash & a, const fuzz_crash & b) { return a.reason.kind < b.reason.kind; });
+    EXPECT_EQ(stop_kind::watchpoint, crashes[0].reason.kind);
+    EXPECT_EQ(0x46, crashes[0].input[0]);
+    EXPECT_EQ(0x55, crashes[0].input[1]);
+    EXPECT_EQ(stop_kind::stack_overflow, crashes[1].reason.kind);
+    EXPECT_EQ(0x46, crashes[1].input[0]);
+    EXPECT_EQ(0x5A, crashes[1].input[1]);
+
+    // Getting past each comparison was new coverage
+    EXPECT_GE(fuzz->corpus_size(), 3u);
+    EXPECT_GE(fuzz->edges_covered(), 4u);
+
+    target.entry = 0x1000;
+    target.init_cycles = 10000;
+    EXPECT_THROW(make_fuzzer(target), std::invalid_argument);
+}
+
+TEST(fuzz, input_sets_the_return_address)
+{
+    // lds r16,0x100   oooo ooo ddddd oooo
+    uint32_t lds16 = 0b1001'000'10000'0000'0000'0001'0000'0000;
+
+    // lds r17,0x101   oooo ooo ddddd oooo
+    uint32_t lds17 = 0b1001'000'10001'0000'0000'0001'0000'0001;
+
+    // push r16       oooo ooo ddddd oooo
+    uint16_t push16 = 0b1001'001'10000'1111;
+
+    // push r17       oooo ooo ddddd oooo
+    uint16_t push17 = 0b1001'001'10001'1111;
+
+    // ret
+    uint16_t ret = 0b1001'0101'0000'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, lds16);
+    instr_to_bytes(text_bytes, lds17);
+    instr_to_bytes(text_bytes, push16);
+    instr_to_bytes(text_bytes, push17);
+    instr_to_bytes(text_bytes, ret);
+
+    auto text = text_segment(text_bytes);
+
+    fuzz_target target;
+    target.image = load_program(atmega168, *text, {});
+    target.entry = 0;
+    target.input = 0x100;
+    target.input_size = 2;
+
+    // The input is where ret goes, which is almost always past the end of the program, or of flash
+    auto fuzz = make_fuzzer(target);
+    auto crashes = fuzz->run(1000);
+    ASSERT_FALSE(crashes.empty());
+    for (auto & crash : crashes) {
+        EXPECT_EQ(stop_kind::invalid_instruction, crash.reason.kind);
+        EXPECT_LT(crash.reason.pc, atmega168.flash_end);
+    }
+}
+
+TEST(fuzz, stops_when_the_function_returns)
+{
+    // rcall +1        oooo kkkk kkkk kkkk
+    uint16_t rcall = 0b1101'0000'0000'0001;
+
+    // rjmp +100      oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'0000'0110'0100;
+
+    // lds r16,0x100   oooo ooo ddddd oooo
+    uint32_t lds = 0b1001'000'10000'0000'0000'0001'0000'0000;
+
+    // ret
+    uint16_t ret = 0b1001'0101'0000'1000;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, rcall);
+    instr_to_bytes(text_bytes, rjmp);       // into erased flash, after the function returns
+    instr_to_bytes(text_bytes, lds);        // 2, the entry point
+    instr_to_bytes(text_bytes, ret);
+
+    auto text = text_segment(text_bytes);
+
+    fuzz_target target;
+    target.image = load_program(atmega168, *text, {});
+    target.entry = 2;
+    target.input = 0x100;
+    target.input_size = 1;
+
+    auto fuzz = make_fuzzer(target);
+    EXPECT_TRUE(fuzz->run(100).empty());
+    EXPECT_EQ(100u, fuzz->executions());
+}
@@ -0,0 +1,67 @@
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "simulator/src/scheduler.h"
+
+using namespace simulator;
+
+TEST(scheduler, runs_due_events_in_order)
+{
+    scheduler events;
+    std::vector<int> ran;
+
+    EXPECT_EQ(std::numeric_limits<uint64_t>::max(), events.deadline());
+
+    events.schedule(20, [&](uint64_t) { ran.push_back(3); });
+    events.schedule(10, [&](uint64_t) { ran.push_back(1); });
+    events.schedule(10, [&](uint64_t) { ran.push_back(2); });
+    events.schedule(30, [&](uint64_t) { ran.push_back(4); });
+    EXPECT_EQ(10, events.deadline());
+
+    // Events due on the same cycle run in the order they were scheduled
+    events.run_due(25);
+    EXPECT_EQ((std::vector<int>{1, 2, 3}), ran);
+    EXPECT_EQ(30, events.deadline());
+}
+
+TEST(scheduler, passes_due_cycle)
+{
+    scheduler events;
+    uint64_t due = 0;
+
+    events.schedule(10, [&](uint64_t cycle) { due = cycle; });
+    events.run_due(13);
+    EXPECT_EQ(10, due);
+}
+
+TEST(scheduler, cancel)
+{
+    scheduler events;
+    bool ran = false;
+
+    auto id = events.schedule(10, [&](uint64_t) { ran = true; });
+    events.cancel(id);
+    events.run_due(10);
+    EXPECT_FALSE(ran);
+    EXPECT_EQ(std::numeric_limits<uint64_t>::max(), events.deadline());
+}
+
+TEST(scheduler, events_can_reschedule)
+{
+    scheduler events;
+    int count = 0;
+
+    // A periodic event, like a timer overflowing
+    std::function<void(uint64_t)> tick = [&](uint64_t cycle) {
+        ++count;
+        events.schedule(cycle + 10, tick);
+    };
+    events.schedule(10, tick);
+
+    events.run_due(35);
+    EXPECT_EQ(3, count);
+    EXPECT_EQ(40, events.deadline());
+}
@@ -9,68 +9,12 @@
 #include "simulator.h"
 
 #include "decode.h"
+#include "mock_segment.h"
 
 using namespace avr;
 using namespace simulator;
 using namespace testing;
 
-struct mock_segment
-    : segment
-{
-    mock_segment(size_t size_, address_t address_, std::vector<byte_t> data_)
-        : _size(size_)
-        , _address(address_)
-        , _data(std::move(data_))
-    {}
-
-    size_t size() const override
-    {
-        return _size;
-    }
-
-    address_t address() const override
-    {
-        return _address;
-    }
-
-    const byte_t *bytes() const override
-    {
-        return _data.data();
-    }
-
-private:
-    size_t _size;
-    address_t _address;
-    std::vector<byte_t> _data;
-};
-
-void instr_to_bytes(std::vector<byte_t> & v, uint32_t instr)
-{
-    byte_t *bytes = reinterpret_cast<byte_t *>(&instr);
-    v.push_back(bytes[2]);
-    v.push_back(bytes[3]);
-    v.push_back(bytes[0]);
-    v.push_back(bytes[1]);
-}
-
-void instr_to_bytes(std::vector<byte_t> & v, uint16_t instr)
-{
-    byte_t *bytes = reinterpret_cast<byte_t *>(&instr);
-    v.push_back(bytes[0]);
-    v.push_back(bytes[1]);
-}
-
-std::unique_ptr<segment> empty_segment()
-{
-    return std::make_unique<mock_segment>(0, 0, std::vector<byte_t>());
-}
-
-std::unique_ptr<segment> text_segment(const std::vector<byte_t> & bytes)
-{
-    auto size = bytes.size();
-    return std::make_unique<mock_segment>(size, 0, std::move(bytes));
-}
-
 uint16_t stack_pointer(const simulator::simulator & sim)
 {
     uint16_t sp;
@@ -891,8 +835,8 @@ TEST(push, push)
     sim->step();
 
     EXPECT_EQ(254, sim->read(SPL));
-    EXPECT_EQ(0, sim->read(SPH));
-    EXPECT_EQ(255, sim->read(255));
+    EXPECT_EQ(0x04, sim->read(SPH));
+    EXPECT_EQ(255, sim->read(0x4FF));
 }
 
 TEST(pop, pop)
@@ -906,8 +850,8 @@ TEST(pop, pop)
     // sts r16,SPL      oooo ooo ddddd oooo
     uint32_t sts_sp = 0b1001'001'10000'0000'0000'0000'0101'1101;
 
-    // sts r17,255        oooo ooo ddddd oooo
-    uint32_t sts_data = 0b1001'001'10001'0000'0000'0000'1111'1111;
+    // sts r17,0x4FF      oooo ooo ddddd oooo
+    uint32_t sts_data = 0b1001'001'10001'0000'0000'0100'1111'1111;
 
     // pop r2        oooo ooo ddddd oooo
     uint16_t pop = 0b1001'000'00010'1111;
@@ -929,7 +873,7 @@ TEST(pop, pop)
     sim->step();
 
     EXPECT_EQ(255, sim->read(SPL));
-    EXPECT_EQ(0, sim->read(SPH));
+    EXPECT_EQ(0x04, sim->read(SPH));
     EXPECT_EQ(1, sim->read(R2));
 }
 
@@ -962,7 +906,7 @@ TEST(pop, after_push)
     sim->step();
 
     EXPECT_EQ(255, sim->read(SPL));
-    EXPECT_EQ(0, sim->read(SPH));
+    EXPECT_EQ(0x04, sim->read(SPH));
     EXPECT_EQ(255, sim->read(R2));
 }
 
@@ -1012,3 +956,25 @@ TEST(out, out)
 
     EXPECT_EQ(1, sim->read(SPL));
 }
+
+TEST(decode, invalid_instruction_reported_when_reached)
+{
+    // ldi r16,1     oooo kkkk dddd kkkk
+    uint16_t ldi = 0b1110'0000'0000'0001;
+
+    // Not a valid instruction
+    uint16_t invalid = 0b1111'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, invalid);
+
+    auto text = text_segment(text_bytes);
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>());
+
+    sim->step();
+    EXPECT_EQ(1, sim->read(16));
+    EXPECT_THROW(sim->next_instruction(), invalid_instruction_error);
+    EXPECT_EQ(stop_kind::invalid_instruction, sim->step().kind);
+    EXPECT_EQ(stop_kind::invalid_instruction, sim->next().kind);
+}
@@ -0,0 +1,107 @@
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "avr/boards.h"
+#include "avr/register.h"
+#include "avr/translated.h"
+#include "simulator.h"
+#include "translate.h"
+
+#include "mock_segment.h"
+#include "translated/program.h"
+
+using namespace avr;
+using namespace simulator;
+using namespace testing;
+
+static std::string translate_text(const std::vector<byte_t> & text_bytes)
+{
+    auto text = text_segment(text_bytes);
+    std::ostringstream out;
+    translate(atmega168, *text, std::vector<segment *>(), out);
+    return out.str();
+}
+
+TEST(translate, one_function_per_block)
+{
+    // ldi r16,1     oooo KKKK dddd KKKK
+    uint16_t ldi = 0b1110'0000'0000'0001;
+
+    // add r16,r16   oooo oo r ddddd rrrr
+    uint16_t add = 0b0000'11'1'10000'0000;
+
+    // brne -2        oooo oo kkkkkkk ooo
+    uint16_t brne = 0b1111'01'1111110'001;
+
+    // rjmp -1        oooo kkkk kkkk kkkk
+    uint16_t rjmp = 0b1100'1111'1111'1111;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi);
+    instr_to_bytes(text_bytes, add);
+    instr_to_bytes(text_bytes, brne);
+    instr_to_bytes(text_bytes, rjmp);
+
+    auto code = translate_text(text_bytes);
+
+    // The loop body is a block of its own, since the branch goes back to it
+    EXPECT_NE(std::string::npos, code.find("case 0x0000: c.pc = block_0000(c); break;"));
+    EXPECT_NE(std::string::npos, code.find("case 0x0001: c.pc = block_0001(c); break;"));
+    EXPECT_NE(std::string::npos, code.find("case 0x0003: c.pc = block_0003(c); break;"));
+    EXPECT_EQ(std::string::npos, code.find("case 0x0002:"));
+
+    EXPECT_NE(std::string::npos, code.find("c.ldi(16, 1);"));
+    EXPECT_NE(std::string::npos, code.find("c.add(16, 16);"));
+    EXPECT_NE(std::string::npos, code.find("if (c.flag(SREG_Z)) {"));
+
+    // Cycles are counted once per exit: add and brne, not taken then taken
+    EXPECT_NE(std::string::npos, code.find("c.cycle_count += 2;\n            return 0x0003;"));
+    EXPECT_NE(std::string::npos, code.find("c.cycle_count += 3;\n        return 0x0001;"));
+}
+
+TEST(translate, stops_before_invalid_instruction)
+{
+    // ldi r16,1     oooo KKKK dddd KKKK
+    uint16_t ldi = 0b1110'0000'0000'0001;
+
+    std::vector<byte_t> text_bytes;
+    instr_to_bytes(text_bytes, ldi);
+
+    // The erased flash after the program is not translated, so the block leaves pc there
+    auto code = translate_text(text_bytes);
+    EXPECT_NE(std::string::npos, code.find("return 0x0001;"));
+    EXPECT_EQ(std::string::npos, code.find("case 0x0001:"));
+}
+
+TEST(translate, runs_like_the_interpreter)
+{
+    // The translation of translated_program() is generated and compiled in by the build
+    core c(atmega168);
+    translated::load(c);
+    EXPECT_FALSE(translated::run(c, 1000000));
+
+    auto text = text_segment(translated_program());
+    auto sim = program_with_segments(atmega168, *text, std::vector<segment *>(), engine::switched);
+    EXPECT_EQ(stop_kind::invalid_instruction, sim->run().kind);
+
+    EXPECT_EQ(22, c.pc);
+    EXPECT_EQ(sim->cycles(), c.cycle_count);
+    EXPECT_EQ(sim->read(SREG), c.sreg_value());
+
+    // Peripherals are not translated, so the I/O registers other than the stack pointer are left out
+    for (address_t address = 0; address < 0x20; ++address) {
+        EXPECT_EQ(sim->read(address), c.memory[address]) << "register " << address;
+    }
+    EXPECT_EQ(sim->read(SPL), c.memory[SPL]);
+    EXPECT_EQ(sim->read(SPH), c.memory[SPH]);
+    for (address_t address = 0x100; address < 0x500; ++address) {
+        EXPECT_EQ(sim->read(address), c.memory[address]) << "address " << std::hex << address;
+    }
+
+    // The loop ran its ten times
+    EXPECT_EQ(30, c.memory[26]);
+    EXPECT_EQ(0, c.memory[22]);
+}
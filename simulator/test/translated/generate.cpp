@@ -0,0 +1,25 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "avr/boards.h"
+#include "translate.h"
+
+#include "translated/program.h"
+
+using namespace simulator;
+using namespace testing;
+
+// Writes the translation of the test program, for test-simulator to compile and run
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " <output.cpp>\n";
+        return 1;
+    }
+
+    auto text = text_segment(translated_program());
+    std::ofstream out(argv[1]);
+    translate(avr::atmega168, *text, std::vector<segment *>(), out);
+    return out ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <vector>
+
+#include "mock_segment.h"
+
+namespace testing {
+
+    // A program for the translator to compile, which loops through a subroutine doing arithmetic,
+    // comparisons and stack operations, and stops at the erased flash after it. It starts by
+    // jumping backwards round the end of flash, and forwards round it again, to the next word.
+    inline std::vector<byte_t> translated_program()
+    {
+        // rjmp -2        oooo kkkk kkkk kkkk
+        uint16_t rjmp_back = 0b1100'1111'1111'1110;
+
+        // rjmp +1        oooo kkkk kkkk kkkk
+        uint16_t rjmp_forward = 0b1100'0000'0000'0001;
+
+        // ldi r16,0xFF   oooo KKKK dddd KKKK
+        uint16_t ldi_spl = 0b1110'1111'0000'1111;
+
+        // out SPL,r16    oooo oAA r rrrr AAAA
+        uint16_t out_spl = 0b1011'1'11'1'0000'1101;
+
+        // ldi r16,4      oooo KKKK dddd KKKK
+        uint16_t ldi_sph = 0b1110'0000'0000'0100;
+
+        // out SPH,r16    oooo oAA r rrrr AAAA
+        uint16_t out_sph = 0b1011'1'11'1'0000'1110;
+
+        // ldi r17,0x70   oooo KKKK dddd KKKK
+        uint16_t ldi17 = 0b1110'0111'0001'0000;
+
+        // ldi r18,0x90   oooo KKKK dddd KKKK
+        uint16_t ldi18 = 0b1110'1001'0010'0000;
+
+        // ldi r22,10     oooo KKKK dddd KKKK
+        uint16_t ldi22 = 0b1110'0000'0110'1010;
+
+        // add r17,r18    oooo oo r ddddd rrrr
+        uint16_t add = 0b0000'11'1'10001'0010;
+
+        // adc r19,r17    oooo oo r ddddd rrrr
+        uint16_t adc = 0b0001'11'1'10011'0001;
+
+        // eor r20,r19    oooo oo r ddddd rrrr
+        uint16_t eor = 0b0010'01'1'10100'0011;
+
+        // rcall +20      oooo kkkk kkkk kkkk
+        uint16_t rcall = 0b1101'0000'0001'0100;
+
+        // adiw X,3       oooo oooo KKdd KKKK
+        uint16_t adiw = 0b1001'0110'00'01'0011;
+
+        // subi r22,1     oooo KKKK dddd KKKK
+        uint16_t subi = 0b0101'0000'0110'0001;
+
+        // brne -7        oooo oo kkkkkkk ooo
+        uint16_t brne = 0b1111'01'1111001'001;
+
+        // sts 0x300,r20  oooo ooo ddddd oooo
+        uint32_t sts_result = 0b1001'001'10100'0000'0000'0011'0000'0000;
+
+        // in r21,SREG    oooo oAA d dddd AAAA
+        uint16_t in_sreg = 0b1011'0'11'1'0101'1111;
+
+        // sts 0x301,r21  oooo ooo ddddd oooo
+        uint32_t sts_sreg = 0b1001'001'10101'0000'0000'0011'0000'0001;
+
+        // lds r23,0x200  oooo ooo ddddd oooo
+        uint32_t lds = 0b1001'000'10111'0000'0000'0010'0000'0000;
+
+        // push r17       oooo ooo rrrrr oooo
+        uint16_t push = 0b1001'001'10001'1111;
+
+        // cp r17,r18     oooo oo r ddddd rrrr
+        uint16_t cp = 0b0001'01'1'10001'0010;
+
+        // cpc r19,r20    oooo oo r ddddd rrrr
+        uint16_t cpc = 0b0000'01'1'10011'0100;
+
+        // brge +2        oooo oo kkkkkkk ooo
+        uint16_t brge = 0b1111'01'0000010'100;
+
+        // sts 0x200,r17  oooo ooo ddddd oooo
+        uint32_t sts_less = 0b1001'001'10001'0000'0000'0010'0000'0000;
+
+        // cpi r20,0x80   oooo KKKK dddd KKKK
+        uint16_t cpi = 0b0011'1000'0100'0000;
+
+        // pop r17        oooo ooo ddddd oooo
+        uint16_t pop = 0b1001'000'10001'1111;
+
+        // ret
+        uint16_t ret = 0b1001'0101'0000'1000;
+
+        std::vector<byte_t> text_bytes;
+        instr_to_bytes(text_bytes, rjmp_back);
+        instr_to_bytes(text_bytes, ldi_spl);
+        instr_to_bytes(text_bytes, out_spl);
+        instr_to_bytes(text_bytes, ldi_sph);
+        instr_to_bytes(text_bytes, out_sph);
+        instr_to_bytes(text_bytes, ldi17);
+        instr_to_bytes(text_bytes, ldi18);
+        instr_to_bytes(text_bytes, ldi22);
+        instr_to_bytes(text_bytes, add);
+        instr_to_bytes(text_bytes, adc);
+        instr_to_bytes(text_bytes, eor);
+        instr_to_bytes(text_bytes, rcall);
+        instr_to_bytes(text_bytes, adiw);
+        instr_to_bytes(text_bytes, subi);
+        instr_to_bytes(text_bytes, brne);
+        instr_to_bytes(text_bytes, sts_result);
+        instr_to_bytes(text_bytes, in_sreg);
+        instr_to_bytes(text_bytes, sts_sreg);
+        instr_to_bytes(text_bytes, lds);
+
+        // The subroutine, after a gap of erased flash which ends the program
+        text_bytes.resize(32*2);
+        instr_to_bytes(text_bytes, push);
+        instr_to_bytes(text_bytes, cp);
+        instr_to_bytes(text_bytes, cpc);
+        instr_to_bytes(text_bytes, brge);
+        instr_to_bytes(text_bytes, sts_less);
+        instr_to_bytes(text_bytes, cpi);
+        instr_to_bytes(text_bytes, pop);
+        instr_to_bytes(text_bytes, ret);
+
+        // The last word of the ATmega168's flash
+        text_bytes.resize(0x1FFF*2);
+        instr_to_bytes(text_bytes, rjmp_forward);
+        return text_bytes;
+    }
+
+}